@@ -0,0 +1,158 @@
+#ifndef H_ARENA
+#define H_ARENA
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/* Bump allocator for everything that lives exactly as long as one circuit:
+   gates, their timer pairs and input arrays. Memory is taken from large
+   chunks and given back all at once by Release(), which also runs the
+   destructors of the objects made with Create() in reverse order. Large
+   modules such as Device can be placed here too instead of on the stack. */
+class CircuitArena
+{
+    private:
+        struct Chunk
+        {
+            Chunk* next;
+            std::size_t size;
+        };
+        struct Destructor
+        {
+            void (*destroy)(void*);
+            void* object;
+            Destructor* next;
+        };
+
+        Chunk* chunks = nullptr;
+        char* cursor = nullptr;
+        char* limit = nullptr;
+        Destructor* destructors = nullptr;
+        std::size_t chunkSize;
+        std::size_t used = 0;
+        std::size_t reserved = 0;
+
+        template <typename T> static void Destroy(void* object)
+        {
+            static_cast<T*>(object)->~T();
+        }
+        void NewChunk(std::size_t minimum)
+        {
+            std::size_t size = minimum + sizeof(Chunk) + alignof(std::max_align_t) > chunkSize
+                ? minimum + sizeof(Chunk) + alignof(std::max_align_t) : chunkSize;
+            Chunk* chunk = static_cast<Chunk*>(::operator new(size));
+            chunk->next = chunks;
+            chunk->size = size;
+            chunks = chunk;
+            cursor = reinterpret_cast<char*>(chunk + 1);
+            limit = reinterpret_cast<char*>(chunk) + size;
+            reserved += size;
+        }
+
+    public:
+        CircuitArena(std::size_t _chunkSize = 1 << 20) : chunkSize(_chunkSize) {}
+        ~CircuitArena()
+        {
+            this->Release();
+        }
+        CircuitArena(const CircuitArena&) = delete;
+        CircuitArena& operator=(const CircuitArena&) = delete;
+
+        void* Allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t))
+        {
+            uintptr_t aligned = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(uintptr_t(alignment) - 1);
+            if (!cursor || aligned + size > reinterpret_cast<uintptr_t>(limit))
+            {
+                NewChunk(size + alignment);
+                aligned = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(uintptr_t(alignment) - 1);
+            }
+            cursor = reinterpret_cast<char*>(aligned + size);
+            used += size;
+            return reinterpret_cast<void*>(aligned);
+        }
+        template <typename T, typename... Args> T* Create(Args&&... args)
+        {
+            void* memory = Allocate(sizeof(T), alignof(T));
+            T* object = new (memory) T(std::forward<Args>(args)...);
+            if (!std::is_trivially_destructible<T>::value)
+            {
+                Destructor* destructor = static_cast<Destructor*>(Allocate(sizeof(Destructor), alignof(Destructor)));
+                destructor->destroy = &Destroy<T>;
+                destructor->object = object;
+                destructor->next = destructors;
+                destructors = destructor;
+            }
+            return object;
+        }
+        void Release()
+        {
+            while (destructors)
+            {
+                Destructor* destructor = destructors;
+                destructors = destructor->next;
+                destructor->destroy(destructor->object);
+            }
+            while (chunks)
+            {
+                Chunk* chunk = chunks;
+                chunks = chunk->next;
+                ::operator delete(chunk);
+            }
+            cursor = limit = nullptr;
+            used = reserved = 0;
+        }
+
+        std::size_t BytesUsed() const
+        {
+            return used;
+        }
+        std::size_t BytesReserved() const
+        {
+            return reserved;
+        }
+};
+
+/* Standard allocator over a CircuitArena; without an arena it falls back to
+   the global heap so containers using it work either way */
+template <typename T> class ArenaAllocator
+{
+    template <typename U> friend class ArenaAllocator;
+
+    private:
+        CircuitArena* arena;
+
+    public:
+        typedef T value_type;
+
+        ArenaAllocator(CircuitArena* _arena = nullptr) : arena(_arena) {}
+        template <typename U> ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+        T* allocate(std::size_t count)
+        {
+            if (arena)
+                return static_cast<T*>(arena->Allocate(count * sizeof(T), alignof(T)));
+            else return static_cast<T*>(::operator new(count * sizeof(T)));
+        }
+        void deallocate(T* pointer, std::size_t)
+        {
+            if (!arena)
+                ::operator delete(pointer);
+        }
+        CircuitArena* Arena() const
+        {
+            return arena;
+        }
+        template <typename U> bool operator==(const ArenaAllocator<U>& other) const
+        {
+            return arena == other.arena;
+        }
+        template <typename U> bool operator!=(const ArenaAllocator<U>& other) const
+        {
+            return arena != other.arena;
+        }
+};
+
+#endif // H_ARENA
@@ -0,0 +1,392 @@
+/* Generation benchmarks: construction and emission of decoders, wide AND/OR
+   gates and the full Device. Build next to gates.h with blueprintlib
+   checked out, for example
+
+       g++ -std=c++17 -O2 -pthread -I. benchmark.cpp -o benchmark
+
+   and run with --json results.json to keep a machine readable copy,
+   --filter text to run only matching cases. Peak RSS is the process peak
+   so far, cases run from small to large so it tracks the largest case. */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+#include "gates.h"
+#include "lowering.h"
+
+namespace
+{
+    std::atomic<uint64_t> allocationCount(0);
+    std::atomic<uint64_t> allocationBytes(0);
+}
+
+void* operator new(std::size_t size)
+{
+    ++allocationCount;
+    allocationBytes += size;
+    if (void* memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+void operator delete[](void* memory) noexcept
+{
+    std::free(memory);
+}
+void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+void operator delete[](void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+namespace
+{
+    uint64_t PeakRssKb()
+    {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return counters.PeakWorkingSetSize / 1024;
+        return 0;
+#else
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return static_cast<uint64_t>(usage.ru_maxrss) / 1024;
+#else
+        return static_cast<uint64_t>(usage.ru_maxrss);
+#endif
+#endif
+    }
+
+    /* Swallows the serialized blueprint, only counting it. It also works
+       as the Sink of the Device writers, which ignore the path and leave
+       the count of the last closed sink in `closedBytes`. */
+    class CountingSink : public std::streambuf
+    {
+        private:
+            uint64_t bytes = 0;
+
+        protected:
+            int_type overflow(int_type c) override
+            {
+                if (!traits_type::eq_int_type(c, traits_type::eof()))
+                    ++bytes;
+                return traits_type::not_eof(c);
+            }
+            std::streamsize xsputn(const char*, std::streamsize count) override
+            {
+                bytes += static_cast<uint64_t>(count);
+                return count;
+            }
+
+        public:
+            static uint64_t closedBytes;
+
+            CountingSink() = default;
+            explicit CountingSink(const std::string&)
+            {
+            }
+
+            bool is_open() const
+            {
+                return true;
+            }
+            bool Close()
+            {
+                closedBytes = bytes;
+                return true;
+            }
+            uint64_t Bytes() const
+            {
+                return bytes;
+            }
+    };
+    uint64_t CountingSink::closedBytes = 0;
+
+    struct Result
+    {
+        std::string name;
+        double constructMs = 0;
+        double emitMs = 0;
+        uint64_t allocations = 0;
+        uint64_t allocatedBytes = 0;
+        uint64_t peakRssKb = 0;
+        uint64_t blocks = 0;
+        uint64_t groups = 0;
+        uint64_t toolbarEntries = 0;
+        uint64_t outputBytes = 0;
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    double Milliseconds(Clock::time_point begin, Clock::time_point end)
+    {
+        return std::chrono::duration<double, std::milli>(end - begin).count();
+    }
+
+    /* Runs build(emit); build constructs a circuit and hands its CubeGrid
+       and ToolbarLog to emit while the blocks are still alive, emit prints it through
+       BlueprintStreamWriter. Construction is timed up to the emit call. */
+    template <typename Build> Result Measure(const std::string& name, Build build)
+    {
+        Result result;
+        result.name = name;
+        uint64_t allocations = allocationCount;
+        uint64_t bytes = allocationBytes;
+
+        Clock::time_point begin = Clock::now();
+        Clock::time_point built = begin;
+        CountingSink sink;
+        build([&](CubeGrid&& cubegrid, const ToolbarLog& log)
+        {
+            built = Clock::now();
+            result.blocks = cubegrid.blocks.size();
+            result.groups = cubegrid.groups.size();
+            result.toolbarEntries = log.EntryCount();
+            BlueprintStreamWriter writer(&sink);
+            writer.Write(std::move(cubegrid));
+            writer.Finish();
+        });
+        Clock::time_point emitted = Clock::now();
+
+        result.constructMs = Milliseconds(begin, built);
+        result.emitMs = Milliseconds(built, emitted);
+        result.outputBytes = sink.Bytes();
+        result.allocations = allocationCount - allocations;
+        result.allocatedBytes = allocationBytes - bytes;
+        result.peakRssKb = PeakRssKb();
+        return result;
+    }
+
+    typedef std::vector<std::pair<std::string, std::function<Result(const std::string&)>>> Cases;
+
+    template <unsigned input_count> Result DecoderCase(const std::string& name)
+    {
+        return Measure(name, [](const std::function<void(CubeGrid&&, const ToolbarLog&)>& emit)
+        {
+            std::unique_ptr<Decoder<input_count, (1u << input_count)>> decoder(
+                new Decoder<input_count, (1u << input_count)>("BENCH"));
+            emit(decoder->GetStdMoveCubegrid(), decoder->Log());
+        });
+    }
+    template <unsigned... input_counts> void DecoderCases(Cases& cases)
+    {
+        int expand[] = {(cases.emplace_back("Decoder<" + std::to_string(input_counts) + "," +
+                                            std::to_string(1u << input_counts) + ">", &DecoderCase<input_counts>), 0)...};
+        (void)expand;
+    }
+
+    Result RuntimeDecoderCase(unsigned input_count, const std::string& name)
+    {
+        return Measure(name, [input_count](const std::function<void(CubeGrid&&, const ToolbarLog&)>& emit)
+        {
+            std::unique_ptr<RuntimeDecoder> decoder(new RuntimeDecoder(input_count, "BENCH"));
+            emit(decoder->GetStdMoveCubegrid(), decoder->Log());
+        });
+    }
+
+    /* A chain of `count` gates, each output hooked to the next gate's first input */
+    template <template <unsigned> class Gate, unsigned input_count, unsigned count> Result GateCase(const std::string& name)
+    {
+        return Measure(name, [](const std::function<void(CubeGrid&&, const ToolbarLog&)>& emit)
+        {
+            std::unique_ptr<Gate<input_count>[]> gates(new Gate<input_count>[count]);
+            CircuitCubegridManager manager;
+            for (unsigned i = 0; i < count; ++i)
+            {
+                gates[i].AppendToName(" " + std::to_string(i));
+                if (i + 1 < count)
+                    gates[i].HookOutputTo(gates[i + 1].GetHook(0));
+                manager.AddGate(gates[i]);
+            }
+            manager.Place();
+            emit(manager.GetStdMoveCubegrid(), manager.Log());
+        });
+    }
+    template <unsigned... input_counts> void GateCases(Cases& cases)
+    {
+        int expand[] = {(cases.emplace_back("AndGate<" + std::to_string(input_counts) + "> x256", &GateCase<AndGate, input_counts, 256>),
+                         cases.emplace_back("OrGate<" + std::to_string(input_counts) + "> x256", &GateCase<OrGate, input_counts, 256>), 0)...};
+        (void)expand;
+    }
+    /* The same chain of gates too wide for one updater, built as WideGate trees */
+    template <Netlist::KIND kind, unsigned input_count, unsigned count> Result WideGateCase(const std::string& name)
+    {
+        return Measure(name, [](const std::function<void(CubeGrid&&, const ToolbarLog&)>& emit)
+        {
+            CircuitArena arena;
+            std::vector<std::unique_ptr<WideGate>> gates;
+            CircuitCubegridManager manager;
+            for (unsigned i = 0; i < count; ++i)
+                gates.emplace_back(new WideGate(kind, input_count, ToolbarStrategy().MaxGateInputs(), " " + std::to_string(i), &arena));
+            for (unsigned i = 0; i < count; ++i)
+            {
+                if (i + 1 < count)
+                    gates[i]->HookOutputTo(gates[i + 1]->GetHook(0));
+                gates[i]->Emit(manager);
+            }
+            manager.Place();
+            emit(manager.GetStdMoveCubegrid(), manager.Log());
+        });
+    }
+
+    /* Device::BuildXml prints into a CountingSink, nothing is written to disk */
+    Result DeviceCase(const std::string& name, const DecoderOptions& options)
+    {
+        Result result;
+        result.name = name;
+        uint64_t allocations = allocationCount;
+        uint64_t bytes = allocationBytes;
+        Clock::time_point begin = Clock::now();
+        std::unique_ptr<Device> device(new Device(false, options));
+        device->Wire();
+        Clock::time_point built = Clock::now();
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            result.blocks += device->GetDecoder6to64(i).GetCubegrid().blocks.size();
+            result.groups += device->GetDecoder6to64(i).GetCubegrid().groups.size();
+        }
+        result.blocks += device->GetDecoder2to4().GetCubegrid().blocks.size();
+        result.groups += device->GetDecoder2to4().GetCubegrid().groups.size();
+        // counted once GetCubegrid has written the deferred cross-decoder hooks
+        for (const ToolbarLog* log : device->Logs())
+            result.toolbarEntries += log->EntryCount();
+        device->BuildXml<CountingSink>();
+        Clock::time_point emitted = Clock::now();
+        result.outputBytes = CountingSink::closedBytes;
+        result.constructMs = Milliseconds(begin, built);
+        result.emitMs = Milliseconds(built, emitted);
+        result.allocations = allocationCount - allocations;
+        result.allocatedBytes = allocationBytes - bytes;
+        result.peakRssKb = PeakRssKb();
+        return result;
+    }
+
+    std::string Escape(const std::string& text)
+    {
+        std::string escaped;
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+                escaped.push_back('\\');
+            escaped.push_back(c);
+        }
+        return escaped;
+    }
+    void WriteJson(std::ostream& output, const std::vector<Result>& results)
+    {
+        output<<"[\n";
+        for (std::size_t i = 0; i < results.size(); ++i)
+        {
+            const Result& r = results[i];
+            output<<"  {\"name\": \""<<Escape(r.name)<<"\", \"construct_ms\": "<<r.constructMs
+                  <<", \"emit_ms\": "<<r.emitMs<<", \"allocations\": "<<r.allocations
+                  <<", \"allocated_bytes\": "<<r.allocatedBytes<<", \"peak_rss_kb\": "<<r.peakRssKb
+                  <<", \"blocks\": "<<r.blocks<<", \"groups\": "<<r.groups
+                  <<", \"toolbar_entries\": "<<r.toolbarEntries<<", \"output_bytes\": "<<r.outputBytes
+                  <<"}"<<(i + 1 < results.size() ? "," : "")<<"\n";
+        }
+        output<<"]\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string jsonPath;
+    std::string filter;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string argument = argv[i];
+        if (argument == "--json" && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if (argument == "--filter" && i + 1 < argc)
+            filter = argv[++i];
+        else
+        {
+            std::cout<<"usage: "<<argv[0]<<" [--json file] [--filter text]"<<std::endl;
+            return 1;
+        }
+    }
+
+    Cases cases;
+    GateCases<2, 4, 8, 16, 32>(cases);
+    cases.emplace_back("WideGate AND 64 x256", &WideGateCase<Netlist::AND, 64, 256>);
+    cases.emplace_back("WideGate OR 64 x256", &WideGateCase<Netlist::OR, 64, 256>);
+    DecoderCases<2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12>(cases);
+    for (unsigned inputs = 2; inputs <= 12; ++inputs)
+        cases.emplace_back("RuntimeDecoder(" + std::to_string(inputs) + ")", [inputs](const std::string& name)
+        {
+            return RuntimeDecoderCase(inputs, name);
+        });
+    cases.emplace_back("Device::BuildXml", [](const std::string& name)
+    {
+        return DeviceCase(name, DecoderOptions());
+    });
+    cases.emplace_back("Device minimised", [](const std::string& name)
+    {
+        DecoderOptions options;
+        options.predecode = true;
+        options.minimize = true;
+        return DeviceCase(name, options);
+    });
+
+    std::vector<Result> results;
+    std::printf("%-22s %10s %10s %10s %12s %10s %8s %8s %10s %12s\n", "case", "build ms", "emit ms", "allocs",
+                "alloc bytes", "rss kB", "blocks", "groups", "entries", "output bytes");
+    for (const auto& run : cases)
+    {
+        if (!filter.empty() && run.first.find(filter) == std::string::npos)
+            continue;
+        Result result = run.second(run.first);
+        std::printf("%-22s %10.2f %10.2f %10llu %12llu %10llu %8llu %8llu %10llu %12llu\n", result.name.c_str(),
+                    result.constructMs, result.emitMs,
+                    static_cast<unsigned long long>(result.allocations),
+                    static_cast<unsigned long long>(result.allocatedBytes),
+                    static_cast<unsigned long long>(result.peakRssKb),
+                    static_cast<unsigned long long>(result.blocks),
+                    static_cast<unsigned long long>(result.groups),
+                    static_cast<unsigned long long>(result.toolbarEntries),
+                    static_cast<unsigned long long>(result.outputBytes));
+        results.push_back(result);
+    }
+
+    if (!jsonPath.empty())
+    {
+        std::ofstream json(jsonPath);
+        if (!json.is_open())
+        {
+            std::cout<<"Error writing to "<<jsonPath<<std::endl;
+            return 1;
+        }
+        WriteJson(json, results);
+    }
+    return 0;
+}
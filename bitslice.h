@@ -0,0 +1,226 @@
+#ifndef H_BITSLICE
+#define H_BITSLICE
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#include "netlist.h"
+
+/* Index of the lowest set bit of a non-zero word */
+inline unsigned LowestSetBit(uint64_t word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return index;
+#else
+    unsigned index = 0;
+    while (!(word & 1))
+    {
+        word >>= 1;
+        ++index;
+    }
+    return index;
+#endif
+}
+
+/* Four 64-bit lanes evaluated together, 256 input vectors per word. Kept as
+   a plain array so the compiler can map it onto whatever SIMD width the
+   target has. */
+struct Word256
+{
+    uint64_t lane[4];
+
+    static Word256 Fill(uint64_t value)
+    {
+        return Word256{{value, value, value, value}};
+    }
+    Word256 operator&(const Word256& other) const
+    {
+        return Word256{{lane[0] & other.lane[0], lane[1] & other.lane[1], lane[2] & other.lane[2], lane[3] & other.lane[3]}};
+    }
+    Word256 operator|(const Word256& other) const
+    {
+        return Word256{{lane[0] | other.lane[0], lane[1] | other.lane[1], lane[2] | other.lane[2], lane[3] | other.lane[3]}};
+    }
+    Word256 operator^(const Word256& other) const
+    {
+        return Word256{{lane[0] ^ other.lane[0], lane[1] ^ other.lane[1], lane[2] ^ other.lane[2], lane[3] ^ other.lane[3]}};
+    }
+    Word256 operator~() const
+    {
+        return Word256{{~lane[0], ~lane[1], ~lane[2], ~lane[3]}};
+    }
+};
+
+template <typename Word> struct WordTraits;
+
+template <> struct WordTraits<uint64_t>
+{
+    static const unsigned bits = 64;
+    static uint64_t Fill(uint64_t value)
+    {
+        return value;
+    }
+    static uint64_t Lane(const uint64_t& word, unsigned)
+    {
+        return word;
+    }
+    static void SetLane(uint64_t& word, unsigned, uint64_t value)
+    {
+        word = value;
+    }
+};
+
+template <> struct WordTraits<Word256>
+{
+    static const unsigned bits = 256;
+    static Word256 Fill(uint64_t value)
+    {
+        return Word256::Fill(value);
+    }
+    static uint64_t Lane(const Word256& word, unsigned lane)
+    {
+        return word.lane[lane];
+    }
+    static void SetLane(Word256& word, unsigned lane, uint64_t value)
+    {
+        word.lane[lane] = value;
+    }
+};
+
+/* Evaluates a Netlist for WordTraits<Word>::bits input vectors at once,
+   bit k of every word belonging to vector k */
+template <typename Word = uint64_t> class BitsliceEvaluator
+{
+    private:
+        const Netlist& netlist;
+        std::vector<Netlist::NodeId> order;
+        std::vector<Word> values;
+
+    public:
+        BitsliceEvaluator(const Netlist& _netlist) : netlist(_netlist)
+        {
+            order = netlist.TopologicalOrder();
+            values.resize(netlist.size(), WordTraits<Word>::Fill(0));
+        }
+
+        void SetInput(Netlist::NodeId node, const Word& value)
+        {
+            if (netlist.Kind(node) != Netlist::INPUT)
+                throw std::invalid_argument("Node is not a primary input");
+            values[node] = value;
+        }
+        const Word& Value(Netlist::NodeId node) const
+        {
+            return values[node];
+        }
+
+        void Evaluate()
+        {
+            for (Netlist::NodeId node : order)
+            {
+                const Netlist::NodeId* fanin = netlist.Fanin(node);
+                unsigned count = netlist.PinCount(node);
+                switch (netlist.Kind(node))
+                {
+                    case Netlist::INPUT:
+                        break;
+                    case Netlist::BUFFER:
+                    case Netlist::REGISTER:
+                        values[node] = values[fanin[0]];
+                        break;
+                    case Netlist::NOT:
+                        values[node] = ~values[fanin[0]];
+                        break;
+                    case Netlist::AND:
+                    {
+                        Word acc = WordTraits<Word>::Fill(~uint64_t(0));
+                        for (unsigned i = 0; i < count; ++i)
+                            acc = acc & values[fanin[i]];
+                        values[node] = acc;
+                        break;
+                    }
+                    case Netlist::OR:
+                    {
+                        Word acc = WordTraits<Word>::Fill(0);
+                        for (unsigned i = 0; i < count; ++i)
+                            acc = acc | values[fanin[i]];
+                        values[node] = acc;
+                        break;
+                    }
+                }
+            }
+        }
+
+        /* Bit-sliced pattern of input `bit` for the block of vectors starting
+           at `base`; the low six bits are the usual alternating masks, higher
+           bits are constant within a 64-vector lane */
+        static Word InputPattern(unsigned bit, uint64_t base)
+        {
+            static const uint64_t masks[6] = {
+                0xAAAAAAAAAAAAAAAAull, 0xCCCCCCCCCCCCCCCCull, 0xF0F0F0F0F0F0F0F0ull,
+                0xFF00FF00FF00FF00ull, 0xFFFF0000FFFF0000ull, 0xFFFFFFFF00000000ull
+            };
+            Word word = WordTraits<Word>::Fill(0);
+            for (unsigned lane = 0; lane < WordTraits<Word>::bits / 64; ++lane)
+            {
+                uint64_t laneBase = base + lane * 64;
+                uint64_t value = bit < 6 ? masks[bit] : (((laneBase >> bit) & 1) ? ~uint64_t(0) : 0);
+                WordTraits<Word>::SetLane(word, lane, value);
+            }
+            return word;
+        }
+};
+
+/* Runs every assignment of the netlist's primary inputs through the
+   evaluator. `spec(inputs, expected)` receives the bit-sliced input words
+   in Inputs() order and fills the expected value of every Outputs() entry.
+   Returns the index of the first failing vector, or UINT64_MAX. */
+template <typename Word = uint64_t, typename Spec>
+uint64_t VerifyExhaustive(const Netlist& netlist, Spec spec)
+{
+    const std::vector<Netlist::NodeId>& inputs = netlist.Inputs();
+    const std::vector<Netlist::NodeId>& outputs = netlist.Outputs();
+    if (inputs.size() > 40)
+        throw std::length_error("Too many inputs for exhaustive verification");
+
+    BitsliceEvaluator<Word> evaluator(netlist);
+    std::vector<Word> inputWords(inputs.size());
+    std::vector<Word> expected(outputs.size());
+    const uint64_t total = uint64_t(1) << inputs.size();
+    const unsigned width = WordTraits<Word>::bits;
+
+    for (uint64_t base = 0; base < total; base += width)
+    {
+        for (unsigned i = 0; i < inputs.size(); ++i)
+        {
+            inputWords[i] = BitsliceEvaluator<Word>::InputPattern(i, base);
+            evaluator.SetInput(inputs[i], inputWords[i]);
+        }
+        evaluator.Evaluate();
+        spec(inputWords.data(), expected.data());
+
+        for (unsigned lane = 0; lane < width / 64; ++lane)
+        {
+            uint64_t laneBase = base + lane * 64;
+            if (laneBase >= total)
+                break;
+            uint64_t valid = total - laneBase >= 64 ? ~uint64_t(0) : (uint64_t(1) << (total - laneBase)) - 1;
+            uint64_t mismatch = 0;
+            for (std::size_t o = 0; o < outputs.size(); ++o)
+                mismatch |= WordTraits<Word>::Lane(evaluator.Value(outputs[o]) ^ expected[o], lane);
+            mismatch &= valid;
+            if (mismatch)
+                return laneBase + LowestSetBit(mismatch);
+        }
+    }
+    return UINT64_MAX;
+}
+
+#endif // H_BITSLICE
@@ -0,0 +1,551 @@
+#ifndef H_BLUEPRINTPATCH
+#define H_BLUEPRINTPATCH
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "blueprintstream.h"
+
+/* Whole file mapped read-only */
+class MappedFile
+{
+    private:
+        const char* text = nullptr;
+        std::size_t length = 0;
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#endif
+
+    public:
+        MappedFile(const std::string& path)
+        {
+#ifdef _WIN32
+            file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            LARGE_INTEGER size;
+            if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size))
+                throw std::runtime_error("Can't open " + path);
+            length = static_cast<std::size_t>(size.QuadPart);
+            if (length)
+            {
+                mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                if (mapping)
+                    text = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+                if (!text)
+                    throw std::runtime_error("Can't map " + path);
+            }
+#else
+            int file = open(path.c_str(), O_RDONLY);
+            struct stat status;
+            if (file < 0 || fstat(file, &status) != 0)
+            {
+                if (file >= 0)
+                    close(file);
+                throw std::runtime_error("Can't open " + path);
+            }
+            length = static_cast<std::size_t>(status.st_size);
+            if (length)
+            {
+                void* view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, 0);
+                if (view != MAP_FAILED)
+                {
+                    text = static_cast<const char*>(view);
+                    madvise(view, length, MADV_SEQUENTIAL);
+                }
+            }
+            close(file);
+            if (length && !text)
+                throw std::runtime_error("Can't map " + path);
+#endif
+        }
+        ~MappedFile()
+        {
+#ifdef _WIN32
+            if (text)
+                UnmapViewOfFile(text);
+            if (mapping)
+                CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE)
+                CloseHandle(file);
+#else
+            if (text)
+                munmap(const_cast<char*>(text), length);
+#endif
+        }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const char* data() const
+        {
+            return text;
+        }
+        std::size_t size() const
+        {
+            return length;
+        }
+};
+
+/* Small edits to an existing bp.sbc without rebuilding the circuit: the
+   file is mapped and scanned once for where each block keeps its EntityId,
+   CustomName, Enabled and Min position, and where groups list their
+   members. Edits only record which byte ranges get new text, Write copies
+   the file with them spliced in, so patching costs about as much as
+   copying. Works on the plain XML, not on bp.sbc.gz. */
+class BlueprintPatcher
+{
+    public:
+        struct Span
+        {
+            std::size_t offset = std::string::npos;
+            std::size_t length = 0;
+
+            bool empty() const
+            {
+                return offset == std::string::npos;
+            }
+        };
+        /* grid counts the CubeGrids before the block, positions are only
+           meaningful within one */
+        struct Block
+        {
+            uint32_t grid = 0;
+            Span entityId;
+            Span name;
+            Span enabled;
+            Span coords[3];
+        };
+        struct Group
+        {
+            uint32_t grid = 0;
+            Span name;
+            uint32_t firstMember = 0;
+            uint32_t memberCount = 0;
+        };
+
+    private:
+        MappedFile file;
+        std::vector<Block> blocks;
+        std::vector<Group> groups;
+        // positions of group members, three per member
+        std::vector<Span> members;
+        std::unordered_map<EntityId, uint32_t> byId;
+        std::unordered_map<std::string, std::vector<uint32_t>> byName;
+        // offset -> replaced length and new text
+        std::map<std::size_t, std::pair<std::size_t, std::string>> edits;
+
+        template <std::size_t length> bool At(std::size_t i, const char (&tag)[length]) const
+        {
+            return i + length - 1 <= file.size() && std::memcmp(file.data() + i, tag, length - 1) == 0;
+        }
+        static bool Put(std::streambuf* sink, const char* text, std::size_t length)
+        {
+            return sink->sputn(text, static_cast<std::streamsize>(length)) == static_cast<std::streamsize>(length);
+        }
+        static bool MoveOver(const std::string& from, const std::string& to)
+        {
+#ifdef _WIN32
+            return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+            return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+        }
+        /* Offset of the next `tag` at or after i, or the end of the file */
+        template <std::size_t length> std::size_t Skip(std::size_t i, const char (&tag)[length]) const
+        {
+            while (const char* found = static_cast<const char*>(std::memchr(file.data() + i, tag[0], file.size() - i)))
+            {
+                i = static_cast<std::size_t>(found - file.data());
+                if (At(i, tag))
+                    return i;
+                ++i;
+            }
+            return file.size();
+        }
+        /* Text of an element started right before i, up to the next tag */
+        Span Content(std::size_t i) const
+        {
+            const char* end = static_cast<const char*>(std::memchr(file.data() + i, '<', file.size() - i));
+            Span span;
+            span.offset = i;
+            span.length = (end ? static_cast<std::size_t>(end - file.data()) : file.size()) - i;
+            return span;
+        }
+        /* x="..", y="..", z=".." of the tag that starts at i */
+        bool Attributes(std::size_t i, Span* coords) const
+        {
+            const char names[3][4] = {"x=\"", "y=\"", "z=\""};
+            const char* end = static_cast<const char*>(std::memchr(file.data() + i, '>', file.size() - i));
+            std::size_t close = end ? static_cast<std::size_t>(end - file.data()) : file.size();
+            for (unsigned axis = 0; axis < 3; ++axis)
+            {
+                std::size_t j = i;
+                while (j < close && !(At(j, names[axis]) && (file.data()[j - 1] == ' ' || file.data()[j - 1] == '\t')))
+                    ++j;
+                if (j >= close)
+                    return false;
+                const char* quote = static_cast<const char*>(std::memchr(file.data() + j + 3, '"', close - j - 3));
+                if (!quote)
+                    return false;
+                coords[axis].offset = j + 3;
+                coords[axis].length = static_cast<std::size_t>(quote - file.data()) - coords[axis].offset;
+            }
+            return true;
+        }
+        /* <X>..</X><Y>..</Y><Z>..</Z> following i, the other way groups
+           write positions */
+        bool Elements(std::size_t i, Span* coords) const
+        {
+            const char names[3][3] = {"X>", "Y>", "Z>"};
+            for (unsigned axis = 0; axis < 3; ++axis)
+            {
+                // closing tags in between are skipped, the Vector3I's own ends the search
+                do
+                {
+                    const char* found = static_cast<const char*>(std::memchr(file.data() + i, '<', file.size() - i));
+                    if (!found)
+                        return false;
+                    i = static_cast<std::size_t>(found - file.data()) + 1;
+                } while (At(i, "/") && !At(i, "/Vector3I"));
+                if (!At(i, names[axis]))
+                    return false;
+                coords[axis] = Content(i + 2);
+                i = coords[axis].offset + coords[axis].length;
+            }
+            return true;
+        }
+
+        void Scan()
+        {
+            const char* data = file.data();
+            const std::size_t size = file.size();
+            bool inBlock = false;
+            bool inGroup = false;
+            uint32_t grid = 0;
+            Block block;
+            Group group;
+            if (!size)
+                return;
+            std::size_t i = 0;
+            while (const char* found = static_cast<const char*>(std::memchr(data + i, '<', size - i)))
+            {
+                i = static_cast<std::size_t>(found - data) + 1;
+                char first = i < size ? data[i] : '\0';
+                if (first != '/' && first != 'M' && first != 'E' && first != 'C' && first != 'N' && first != 'V' && first != 'T')
+                    continue;
+                if (At(i, "/CubeGrid>"))
+                    ++grid;
+                else if (At(i, "MyObjectBuilder_CubeBlock ") || At(i, "MyObjectBuilder_CubeBlock>"))
+                {
+                    inBlock = true;
+                    block = Block();
+                    block.grid = grid;
+                }
+                else if (At(i, "/MyObjectBuilder_CubeBlock>") && inBlock)
+                {
+                    inBlock = false;
+                    uint32_t index = static_cast<uint32_t>(blocks.size());
+                    blocks.push_back(block);
+                    if (!block.entityId.empty())
+                        byId[std::strtoull(std::string(data + block.entityId.offset, block.entityId.length).c_str(), nullptr, 10)] = index;
+                    if (!block.name.empty())
+                        byName[std::string(data + block.name.offset, block.name.length)].push_back(index);
+                }
+                else if (inBlock)
+                {
+                    if (block.entityId.empty() && At(i, "EntityId>"))
+                        block.entityId = Content(i + 9);
+                    else if (block.name.empty() && At(i, "CustomName>"))
+                        block.name = Content(i + 11);
+                    else if (block.enabled.empty() && At(i, "Enabled>"))
+                        block.enabled = Content(i + 8);
+                    // most of the file is toolbar slots, none of them is indexed
+                    else if (At(i, "Toolbar>"))
+                        i = Skip(i, "</Toolbar>");
+                    else if (block.coords[0].empty() && (At(i, "Min ") || At(i, "Min>")))
+                    {
+                        if (!Attributes(i, block.coords))
+                            Elements(i, block.coords);
+                    }
+                }
+                else if (At(i, "MyObjectBuilder_BlockGroup>"))
+                {
+                    inGroup = true;
+                    group = Group();
+                    group.grid = grid;
+                    group.firstMember = static_cast<uint32_t>(members.size() / 3);
+                }
+                else if (At(i, "/MyObjectBuilder_BlockGroup>") && inGroup)
+                {
+                    inGroup = false;
+                    group.memberCount = static_cast<uint32_t>(members.size() / 3) - group.firstMember;
+                    groups.push_back(group);
+                }
+                else if (inGroup)
+                {
+                    Span coords[3];
+                    if (group.name.empty() && At(i, "Name>"))
+                        group.name = Content(i + 5);
+                    else if (At(i, "Vector3I") && (Attributes(i, coords) || Elements(i, coords)))
+                        members.insert(members.end(), coords, coords + 3);
+                }
+            }
+        }
+
+        static std::string Escape(const std::string& text)
+        {
+            std::string escaped;
+            for (char c : text)
+            {
+                switch (c)
+                {
+                    case '&': escaped += "&amp;"; break;
+                    case '<': escaped += "&lt;"; break;
+                    case '>': escaped += "&gt;"; break;
+                    case '"': escaped += "&quot;"; break;
+                    default: escaped.push_back(c);
+                }
+            }
+            return escaped;
+        }
+        static std::string Unescape(const std::string& text)
+        {
+            const char* entities[5][2] = {{"&amp;", "&"}, {"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&apos;", "'"}};
+            std::string plain;
+            for (std::size_t i = 0; i < text.size(); ++i)
+            {
+                unsigned e = 0;
+                if (text[i] == '&')
+                    for (; e < 5 && text.compare(i, std::strlen(entities[e][0]), entities[e][0]) != 0; ++e);
+                if (text[i] == '&' && e < 5)
+                {
+                    plain += entities[e][1];
+                    i += std::strlen(entities[e][0]) - 1;
+                }
+                else plain.push_back(text[i]);
+            }
+            return plain;
+        }
+        /* The text a span has now, edited or not */
+        std::string Current(Span span) const
+        {
+            auto edit = edits.find(span.offset);
+            if (edit != edits.end())
+                return edit->second.second;
+            return std::string(file.data() + span.offset, span.length);
+        }
+        void Replace(Span span, const std::string& text)
+        {
+            if (span.empty())
+                throw std::logic_error("Blueprint has no such field to patch");
+            edits[span.offset] = std::make_pair(span.length, text);
+        }
+        /* Replaces `from` with `to` wherever it occurs in the span's text */
+        bool ReplaceIn(Span span, const std::string& from, const std::string& to)
+        {
+            if (span.empty())
+                return false;
+            const char* begin = file.data() + span.offset;
+            if (!edits.count(span.offset) && std::search(begin, begin + span.length, from.begin(), from.end()) == begin + span.length)
+                return false;
+            std::string text = Current(span);
+            bool changed = false;
+            for (std::size_t at = text.find(from); at != std::string::npos; at = text.find(from, at + to.size()))
+            {
+                text.replace(at, from.size(), to);
+                changed = true;
+            }
+            if (changed)
+                Replace(span, text);
+            return changed;
+        }
+        int64_t Coordinate(Span span) const
+        {
+            auto edit = edits.find(span.offset);
+            // the mapped number ends at its closing quote or tag
+            return std::strtoll(edit != edits.end() ? edit->second.second.c_str() : file.data() + span.offset, nullptr, 10);
+        }
+        struct Position
+        {
+            uint32_t grid;
+            int64_t coords[3];
+
+            bool operator==(const Position& other) const
+            {
+                return grid == other.grid && std::equal(coords, coords + 3, other.coords);
+            }
+        };
+        struct PositionHash
+        {
+            std::size_t operator()(const Position& position) const
+            {
+                uint64_t hash = position.grid;
+                for (int64_t coordinate : position.coords)
+                    hash = hash * 1099511628211ull ^ static_cast<uint64_t>(coordinate);
+                return static_cast<std::size_t>(hash);
+            }
+        };
+        Position PositionOf(uint32_t grid, const Span* coords) const
+        {
+            return Position{grid, {Coordinate(coords[0]), Coordinate(coords[1]), Coordinate(coords[2])}};
+        }
+
+    public:
+        BlueprintPatcher(const std::string& _path) : file(_path)
+        {
+            Scan();
+        }
+
+        std::size_t BlockCount() const
+        {
+            return blocks.size();
+        }
+        std::size_t GroupCount() const
+        {
+            return groups.size();
+        }
+        const Block& GetBlock(uint32_t index) const
+        {
+            if (index >= blocks.size())
+                throw std::out_of_range("Block index out of range");
+            return blocks[index];
+        }
+        uint32_t Find(EntityId id) const
+        {
+            auto found = byId.find(id);
+            if (found == byId.end())
+                throw std::out_of_range("No block with EntityId " + std::to_string(id));
+            return found->second;
+        }
+        /* Blocks named exactly `name`, as the file had them */
+        std::vector<uint32_t> Find(const std::string& name) const
+        {
+            auto found = byName.find(Escape(name));
+            return found == byName.end() ? std::vector<uint32_t>() : found->second;
+        }
+        /* Blocks whose name contains `marker`, such as a decoder's name */
+        std::vector<uint32_t> FindContaining(const std::string& marker) const
+        {
+            std::string escaped = Escape(marker);
+            std::vector<uint32_t> found;
+            for (const auto& named : byName)
+                if (named.first.find(escaped) != std::string::npos)
+                    found.insert(found.end(), named.second.begin(), named.second.end());
+            std::sort(found.begin(), found.end());
+            return found;
+        }
+        std::string Name(uint32_t index) const
+        {
+            const Block& block = GetBlock(index);
+            return block.name.empty() ? std::string() : Unescape(Current(block.name));
+        }
+
+        void SetName(uint32_t index, const std::string& name)
+        {
+            Replace(GetBlock(index).name, Escape(name));
+        }
+        void SetEnabled(uint32_t index, bool enabled)
+        {
+            Replace(GetBlock(index).enabled, enabled ? "true" : "false");
+        }
+        /* Renames a module: `from` becomes `to` in every block and group
+           name. Returns the number of names changed. */
+        std::size_t ReplaceInNames(const std::string& from, const std::string& to)
+        {
+            if (from.empty())
+                throw std::invalid_argument("Nothing to replace");
+            std::string escapedFrom = Escape(from);
+            std::string escapedTo = Escape(to);
+            std::size_t changed = 0;
+            for (const Block& block : blocks)
+                changed += ReplaceIn(block.name, escapedFrom, escapedTo);
+            for (const Group& group : groups)
+                changed += ReplaceIn(group.name, escapedFrom, escapedTo);
+            return changed;
+        }
+        /* Moves blocks like CubeGrid::TranslateCoords; groups refer to
+           members by position, so their entries move along */
+        void Translate(const std::vector<uint32_t>& moved, int64_t x, int64_t y, int64_t z)
+        {
+            const int64_t offsets[3] = {x, y, z};
+            std::unordered_set<Position, PositionHash> from;
+            for (uint32_t index : moved)
+            {
+                const Block& block = GetBlock(index);
+                if (block.coords[0].empty())
+                    throw std::logic_error("Block has no position to move");
+                from.insert(PositionOf(block.grid, block.coords));
+            }
+            std::vector<const Span*> movedMembers;
+            for (const Group& group : groups)
+                for (uint32_t member = group.firstMember; member < group.firstMember + group.memberCount; ++member)
+                    if (from.count(PositionOf(group.grid, &members[3 * member])))
+                        movedMembers.push_back(&members[3 * member]);
+
+            for (uint32_t index : moved)
+                for (unsigned axis = 0; axis < 3; ++axis)
+                    Replace(blocks[index].coords[axis], std::to_string(Coordinate(blocks[index].coords[axis]) + offsets[axis]));
+            for (const Span* coords : movedMembers)
+                for (unsigned axis = 0; axis < 3; ++axis)
+                    Replace(coords[axis], std::to_string(Coordinate(coords[axis]) + offsets[axis]));
+        }
+
+        std::size_t EditCount() const
+        {
+            return edits.size();
+        }
+        /* False if the sink took fewer bytes than it was given or failed to
+           flush them */
+        bool WriteTo(std::streambuf* sink) const
+        {
+            std::size_t copied = 0;
+            for (const auto& edit : edits)
+            {
+                if (!Put(sink, file.data() + copied, edit.first - copied)
+                    || !Put(sink, edit.second.second.data(), edit.second.second.size()))
+                    return false;
+                copied = edit.first + edit.second.first;
+            }
+            return Put(sink, file.data() + copied, file.size() - copied) && sink->pubsync() == 0;
+        }
+        /* The copy is written next to the destination under a temporary name
+           and renamed over it once complete, so a failed write never leaves
+           a truncated blueprint. The destination may be the source: the
+           mapping keeps reading the replaced file. Windows refuses to replace
+           a mapped file, Write fails there instead. */
+        bool Write(const std::string& destination) const
+        {
+            std::string temporary = destination + ".tmp";
+            bool written;
+            {
+                BufferedFileSink sink(temporary);
+                written = sink.is_open() && WriteTo(&sink) && sink.Close();
+            }
+            if (written && MoveOver(temporary, destination))
+                return true;
+            std::remove(temporary.c_str());
+            std::cout<<"Error writing to "<<destination<<std::endl;
+            return false;
+        }
+};
+
+#endif // H_BLUEPRINTPATCH
@@ -0,0 +1,636 @@
+#ifndef H_BLUEPRINTSTREAM
+#define H_BLUEPRINTSTREAM
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+#include "blueprintlib/blueprint.h"
+#include "instancing.h"
+#include "parallel.h"
+
+/* Output buffer that hands large chunks straight to the C library, so the
+   serialized blueprint never has to exist in memory as a whole */
+class BufferedFileSink : public std::streambuf
+{
+    private:
+        std::FILE* file;
+        std::vector<char> buffer;
+        std::size_t written = 0;
+        bool failed = false;
+
+        bool Drain()
+        {
+            std::size_t pending = static_cast<std::size_t>(pptr() - pbase());
+            if (pending && std::fwrite(pbase(), 1, pending, file) != pending)
+            {
+                failed = true;
+                return false;
+            }
+            written += pending;
+            setp(buffer.data(), buffer.data() + buffer.size());
+            return true;
+        }
+
+    protected:
+        int_type overflow(int_type c) override
+        {
+            if (!file || !Drain())
+                return traits_type::eof();
+            if (!traits_type::eq_int_type(c, traits_type::eof()))
+            {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+        int sync() override
+        {
+            return file && Drain() && std::fflush(file) == 0 ? 0 : -1;
+        }
+
+    public:
+        BufferedFileSink(const std::string& path, std::size_t bufferSize = 4 << 20) : buffer(bufferSize)
+        {
+            file = std::fopen(path.c_str(), "wb");
+            if (file)
+                std::setvbuf(file, nullptr, _IONBF, 0);
+            setp(buffer.data(), buffer.data() + buffer.size());
+        }
+        ~BufferedFileSink()
+        {
+            Close();
+        }
+        BufferedFileSink(const BufferedFileSink&) = delete;
+        BufferedFileSink& operator=(const BufferedFileSink&) = delete;
+
+        bool is_open() const
+        {
+            return file != nullptr;
+        }
+        /* Flushes and closes the file, false if any of it was not written */
+        bool Close()
+        {
+            if (!file)
+                return false;
+            bool flushed = sync() == 0;
+            bool closed = std::fclose(file) == 0;
+            file = nullptr;
+            return flushed && closed && !failed;
+        }
+        std::size_t BytesWritten() const
+        {
+            return written + static_cast<std::size_t>(pptr() - pbase());
+        }
+};
+
+/* Temporary file for text that is written out later, so it does not have
+   to be held in memory. It is written like any streambuf and copied to
+   its destination once. The file is only made when the first text comes
+   in; when none can be made the text is held in memory instead. */
+class SpoolFile : public std::streambuf
+{
+    private:
+        std::FILE* file = nullptr;
+        std::string memory;
+        std::vector<char> buffer;
+        bool opened = false;
+        bool failed = false;
+
+        bool Drain()
+        {
+            std::size_t pending = static_cast<std::size_t>(pptr() - pbase());
+            setp(buffer.data(), buffer.data() + buffer.size());
+            if (!pending)
+                return !failed;
+            if (!opened)
+            {
+                file = std::tmpfile();
+                opened = true;
+            }
+            if (!file)
+                memory.append(buffer.data(), pending);
+            else if (std::fwrite(buffer.data(), 1, pending, file) != pending)
+                failed = true;
+            return !failed;
+        }
+
+    protected:
+        int_type overflow(int_type c) override
+        {
+            if (!Drain())
+                return traits_type::eof();
+            if (!traits_type::eq_int_type(c, traits_type::eof()))
+            {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+
+    public:
+        SpoolFile(std::size_t bufferSize = 1 << 16) : buffer(bufferSize)
+        {
+            setp(buffer.data(), buffer.data() + buffer.size());
+        }
+        ~SpoolFile()
+        {
+            if (file)
+                std::fclose(file);
+        }
+        SpoolFile(const SpoolFile&) = delete;
+        SpoolFile& operator=(const SpoolFile&) = delete;
+
+        /* Writes everything spooled to `target`; false if some of it could
+           not be spooled or read back */
+        bool CopyTo(std::streambuf& target)
+        {
+            if (!Drain())
+                return false;
+            if (!file)
+            {
+                target.sputn(memory.data(), static_cast<std::streamsize>(memory.size()));
+                return true;
+            }
+            if (std::fflush(file) != 0 || std::fseek(file, 0, SEEK_SET) != 0)
+                return false;
+            std::size_t read;
+            while ((read = std::fread(buffer.data(), 1, buffer.size(), file)) > 0)
+                target.sputn(buffer.data(), static_cast<std::streamsize>(read));
+            return !std::ferror(file);
+        }
+};
+
+/* Writes a blueprint one CubeGrid at a time. Each grid is printed through
+   Blueprint::Print on its own and the surrounding document is cut away on
+   the fly: the header is kept from the first grid, the footer from the
+   last one, everything in between goes straight to the sink.
+
+   A merging writer instead makes every grid after the first part of the
+   first one, the way CubeGrid::AttachCubegrid does: their blocks follow
+   the first grid's blocks and their groups its groups, so toolbars can
+   refer to any of them. The text is spliced on its way to the sink, so
+   no grid is ever held as a whole: blocks are written at once, the later
+   grids' groups go to a SpoolFile and only the first grid's groups and
+   closing tags are kept in memory until Finish. */
+class BlueprintStreamWriter
+{
+    private:
+        /* A streambuf that hands what is written to Filter in chunks */
+        class FilterBuffer : public std::streambuf
+        {
+            private:
+                std::vector<char> buffer;
+
+            protected:
+                virtual void Filter(const char* text, std::size_t length) = 0;
+                void Drain()
+                {
+                    Filter(pbase(), static_cast<std::size_t>(pptr() - pbase()));
+                    setp(buffer.data(), buffer.data() + buffer.size());
+                }
+                int_type overflow(int_type c) override
+                {
+                    Drain();
+                    if (!traits_type::eq_int_type(c, traits_type::eof()))
+                    {
+                        *pptr() = traits_type::to_char_type(c);
+                        pbump(1);
+                    }
+                    return traits_type::not_eof(c);
+                }
+                std::streamsize xsputn(const char* text, std::streamsize count) override
+                {
+                    if (count <= epptr() - pptr())
+                    {
+                        std::memcpy(pptr(), text, static_cast<std::size_t>(count));
+                        pbump(static_cast<int>(count));
+                    }
+                    else
+                    {
+                        Drain();
+                        Filter(text, static_cast<std::size_t>(count));
+                    }
+                    return count;
+                }
+                int sync() override
+                {
+                    Drain();
+                    return 0;
+                }
+
+            public:
+                FilterBuffer(std::size_t bufferSize = 1 << 16) : buffer(bufferSize)
+                {
+                    setp(buffer.data(), buffer.data() + buffer.size());
+                }
+        };
+
+        /* Cuts the document around one printed grid away */
+        class GridFilter : public FilterBuffer
+        {
+            private:
+                enum STATE {HEADER, BODY, FOOTER};
+                std::streambuf* sink;
+                std::string& footer;
+                bool keepHeader;
+                STATE state = HEADER;
+                std::size_t matched = 0;
+
+                static const char* Open()
+                {
+                    return "<CubeGrids>";
+                }
+                static const char* Close()
+                {
+                    return "</CubeGrids>";
+                }
+
+            protected:
+                void Filter(const char* text, std::size_t length) override
+                {
+                    std::size_t i = 0;
+                    while (i < length)
+                    {
+                        switch (state)
+                        {
+                            case HEADER:
+                            {
+                                char ch = text[i++];
+                                if (keepHeader)
+                                    sink->sputc(ch);
+                                matched = ch == Open()[matched] ? matched + 1 : (ch == Open()[0] ? 1 : 0);
+                                if (!Open()[matched])
+                                {
+                                    state = BODY;
+                                    matched = 0;
+                                }
+                                break;
+                            }
+                            case BODY:
+                            {
+                                if (!matched)
+                                {
+                                    // pass everything up to the next tag on in one piece
+                                    const char* tag = static_cast<const char*>(std::memchr(text + i, Close()[0], length - i));
+                                    std::size_t run = (tag ? static_cast<std::size_t>(tag - text) : length) - i;
+                                    sink->sputn(text + i, static_cast<std::streamsize>(run));
+                                    i += run;
+                                    if (tag)
+                                    {
+                                        matched = 1;
+                                        ++i;
+                                    }
+                                    break;
+                                }
+                                char ch = text[i++];
+                                if (ch == Close()[matched])
+                                {
+                                    if (!Close()[++matched])
+                                    {
+                                        state = FOOTER;
+                                        footer.assign(Close());
+                                    }
+                                    break;
+                                }
+                                sink->sputn(Close(), static_cast<std::streamsize>(matched));
+                                matched = 0;
+                                if (ch == Close()[0])
+                                    matched = 1;
+                                else sink->sputc(ch);
+                                break;
+                            }
+                            case FOOTER:
+                                footer.append(text + i, length - i);
+                                i = length;
+                                break;
+                        }
+                    }
+                }
+
+            public:
+                GridFilter(std::streambuf* _sink, std::string& _footer, bool _keepHeader)
+                    : sink(_sink), footer(_footer), keepHeader(_keepHeader) {}
+                ~GridFilter()
+                {
+                    Drain();
+                }
+        };
+
+        /* Merges the grids passing through into the first one. Each state
+           waits for one tag; everything before it goes where the state
+           sends it and the tag itself only belongs to the first grid. */
+        class Splicer : public FilterBuffer
+        {
+            private:
+                enum STATE {PRELUDE, BLOCKS, BETWEEN, GROUPS, REST};
+                std::streambuf* sink;
+                // the first grid from its blocks' end tag to its groups'
+                // end tag, and the rest of it
+                std::string middle;
+                std::string tail;
+                SpoolFile groups;
+                STATE state = PRELUDE;
+                std::size_t matched = 0;
+                bool first = true;
+                bool hasBlocks = false;
+                bool hasGroupSection = false;
+                // thrown by End, streams swallow what is thrown while printing
+                const char* error = nullptr;
+
+                const char* Tag() const
+                {
+                    switch (state)
+                    {
+                        case PRELUDE:
+                            return "<CubeBlocks>";
+                        case BLOCKS:
+                            return "</CubeBlocks>";
+                        case BETWEEN:
+                            return "<BlockGroups>";
+                        case GROUPS:
+                            return "</BlockGroups>";
+                        default:
+                            return nullptr;
+                    }
+                }
+                void Emit(const char* text, std::size_t length)
+                {
+                    if (!length)
+                        return;
+                    switch (state)
+                    {
+                        case PRELUDE:
+                            if (first)
+                                sink->sputn(text, static_cast<std::streamsize>(length));
+                            break;
+                        case BLOCKS:
+                            sink->sputn(text, static_cast<std::streamsize>(length));
+                            break;
+                        case BETWEEN:
+                            if (first)
+                                middle.append(text, length);
+                            break;
+                        case GROUPS:
+                            if (first)
+                                middle.append(text, length);
+                            else if (!hasGroupSection)
+                                error = "First grid has no group section to merge the others' groups into";
+                            else groups.sputn(text, static_cast<std::streamsize>(length));
+                            break;
+                        case REST:
+                            if (first)
+                                tail.append(text, length);
+                            break;
+                    }
+                }
+                void Advance()
+                {
+                    const char* tag = Tag();
+                    switch (state)
+                    {
+                        case PRELUDE:
+                            hasBlocks = true;
+                            Emit(tag, std::strlen(tag));
+                            state = BLOCKS;
+                            break;
+                        case BLOCKS:
+                            state = BETWEEN;
+                            Emit(tag, std::strlen(tag));
+                            break;
+                        case BETWEEN:
+                            Emit(tag, std::strlen(tag));
+                            hasGroupSection = hasGroupSection || first;
+                            state = GROUPS;
+                            break;
+                        case GROUPS:
+                            state = REST;
+                            Emit(tag, std::strlen(tag));
+                            break;
+                        default:
+                            break;
+                    }
+                }
+
+            protected:
+                void Filter(const char* text, std::size_t length) override
+                {
+                    std::size_t i = 0;
+                    while (i < length)
+                    {
+                        const char* tag = Tag();
+                        if (!tag)
+                        {
+                            Emit(text + i, length - i);
+                            return;
+                        }
+                        if (!matched)
+                        {
+                            const char* open = static_cast<const char*>(std::memchr(text + i, tag[0], length - i));
+                            std::size_t run = (open ? static_cast<std::size_t>(open - text) : length) - i;
+                            Emit(text + i, run);
+                            i += run;
+                            if (open)
+                            {
+                                matched = 1;
+                                ++i;
+                            }
+                            continue;
+                        }
+                        char ch = text[i++];
+                        if (ch == tag[matched])
+                        {
+                            if (!tag[++matched])
+                            {
+                                matched = 0;
+                                Advance();
+                            }
+                            continue;
+                        }
+                        // what looked like the tag was ordinary text
+                        Emit(tag, matched);
+                        matched = 0;
+                        if (ch == tag[0])
+                            matched = 1;
+                        else Emit(&ch, 1);
+                    }
+                }
+
+            public:
+                Splicer(std::streambuf* _sink) : sink(_sink) {}
+
+                /* The next grid's text follows */
+                void Begin(bool _first)
+                {
+                    state = PRELUDE;
+                    matched = 0;
+                    first = _first;
+                    hasBlocks = false;
+                }
+                /* Whether the grid had blocks and was merged */
+                bool End()
+                {
+                    Drain();
+                    const char* tag = Tag();
+                    if (matched && tag)
+                        Emit(tag, matched);
+                    matched = 0;
+                    if (first && !hasBlocks)
+                        error = "First grid has no blocks to merge the others into";
+                    if (error)
+                        throw std::logic_error(error);
+                    return hasBlocks;
+                }
+                /* Closes the merged grid */
+                void Finish()
+                {
+                    sink->sputn(middle.data(), static_cast<std::streamsize>(middle.size()));
+                    if (!groups.CopyTo(*sink))
+                        throw std::runtime_error("Spooled groups could not be read back");
+                    sink->sputn(tail.data(), static_cast<std::streamsize>(tail.size()));
+                }
+        };
+
+        std::streambuf* sink;
+        std::string footer;
+        std::size_t grids = 0;
+        bool finished = false;
+        bool merge;
+        Splicer splicer;
+
+        /* Prints one grid, with the document header if it is the first */
+        void Print(CubeGrid&& cubegrid, std::streambuf* target, std::string& gridFooter, bool keepHeader)
+        {
+            Blueprint single;
+            single.Cubegrids.push_back(std::move(cubegrid));
+            GridFilter filter(target, gridFooter, keepHeader);
+            std::ostream output(&filter);
+            single.Print(output, false);
+            output.flush();
+        }
+        /* The text of one grid, without the document around it unless it
+           is the first, is about to be written */
+        std::streambuf* Begin()
+        {
+            if (!merge)
+                return sink;
+            splicer.Begin(grids == 0);
+            return &splicer;
+        }
+        void End()
+        {
+            if (!merge || splicer.End())
+                ++grids;
+        }
+        /* One printed grid */
+        void Add(const std::string& text)
+        {
+            Begin()->sputn(text.data(), static_cast<std::streamsize>(text.size()));
+            End();
+        }
+
+    public:
+        BlueprintStreamWriter(std::streambuf* _sink, bool _merge = false) : sink(_sink), merge(_merge), splicer(_sink) {}
+        ~BlueprintStreamWriter()
+        {
+            this->Finish();
+        }
+        BlueprintStreamWriter(const BlueprintStreamWriter&) = delete;
+        BlueprintStreamWriter& operator=(const BlueprintStreamWriter&) = delete;
+
+        void Write(CubeGrid&& cubegrid)
+        {
+            bool keepHeader = grids == 0;
+            Print(std::move(cubegrid), Begin(), footer, keepHeader);
+            End();
+        }
+        /* A whole blueprint printed into `printed` before, taken as one
+           more grid; merged, every grid in it becomes part of the first */
+        void Write(SpoolFile& printed)
+        {
+            bool keepHeader = grids == 0;
+            {
+                GridFilter filter(Begin(), footer, keepHeader);
+                if (!printed.CopyTo(filter))
+                    throw std::runtime_error("Spooled grid could not be read back");
+            }
+            End();
+        }
+        /* One copy of a grid serialized ahead of time */
+        void Write(const Fragment& fragment, const Fragment::Instance& instance)
+        {
+            Write(fragment, std::vector<Fragment::Instance>(1, instance), 1);
+        }
+        /* Prints the grids into separate buffers on up to `threads` threads
+           and writes each one as soon as it and the grids before it are
+           done, so a slow grid holds up only the writing, not the workers.
+           The grids must be finished: only CubeGrid::Print runs on the
+           workers, and that it reads nothing but its own grid is assumed
+           of blueprintlib, which makes no promise about threads. */
+        void Write(std::vector<CubeGrid>&& cubegrids, unsigned threads = DefaultThreadCount())
+        {
+            bool keepHeader = grids == 0;
+            ParallelOrdered(cubegrids.size(), [&](std::size_t i)
+            {
+                std::pair<std::string, std::string> printed;
+                std::stringbuf buffer;
+                Print(std::move(cubegrids[i]), &buffer, printed.second, keepHeader && i == 0);
+                printed.first = buffer.str();
+                return printed;
+            }, [&](std::size_t, std::pair<std::string, std::string>&& printed)
+            {
+                Add(printed.first);
+                footer.swap(printed.second);
+            }, threads);
+        }
+        /* Copies of one fragment, patched in parallel the same way */
+        void Write(const Fragment& fragment, const std::vector<Fragment::Instance>& instances,
+                   unsigned threads = DefaultThreadCount())
+        {
+            bool keepHeader = grids == 0;
+            ParallelOrdered(instances.size(), [&](std::size_t i)
+            {
+                std::stringbuf buffer;
+                if (keepHeader && i == 0)
+                    buffer.sputn(fragment.Header().data(), static_cast<std::streamsize>(fragment.Header().size()));
+                fragment.Instantiate(&buffer, instances[i]);
+                return buffer.str();
+            }, [&](std::size_t, std::string&& text)
+            {
+                Add(text);
+            }, threads);
+            if (!instances.empty())
+                footer = fragment.Footer();
+        }
+        void Finish()
+        {
+            if (finished)
+                return;
+            finished = true;
+            if (grids)
+            {
+                if (merge)
+                    splicer.Finish();
+                sink->sputn(footer.data(), static_cast<std::streamsize>(footer.size()));
+            }
+            else
+            {
+                Blueprint empty;
+                std::ostream output(sink);
+                empty.Print(output, false);
+            }
+            sink->pubsync();
+        }
+        std::size_t GridCount() const
+        {
+            return grids;
+        }
+};
+
+#endif // H_BLUEPRINTSTREAM
@@ -0,0 +1,126 @@
+#ifndef H_BUS
+#define H_BUS
+
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include "gates.h"
+
+/* Hooks of `width` gate inputs taken together, bit i being hook i, so a
+   whole datapath is wired in one call instead of one HookOutputTo per bit */
+template <unsigned width> class Bus
+{
+    private:
+        TimerPair* inputs[width] = {};
+        Updater* updaters[width] = {};
+
+    public:
+        static unsigned size()
+        {
+            return width;
+        }
+        void Set(unsigned bit, Hook hook)
+        {
+            if (bit >= width)
+                throw std::out_of_range("Bus bit out of range");
+            inputs[bit] = &hook.input;
+            updaters[bit] = &hook.updater;
+        }
+        Hook GetHook(unsigned bit) const
+        {
+            if (bit >= width)
+                throw std::out_of_range("Bus bit out of range");
+            if (!inputs[bit])
+                throw std::logic_error("Bus bit " + std::to_string(bit) + " is not set");
+            return Hook(*inputs[bit], *updaters[bit]);
+        }
+
+        /* One output drives every bit. Its manager's ToolbarStrategy
+           collects the targets in the source's groups once the bus is wide
+           enough, so it keeps six toolbar entries and fires six actions per
+           change however wide the bus is, against six per bit with direct
+           entries; without a strategy the source is set to use groups. An
+           updater shared by several bits is triggered once. */
+        void HookFrom(TimerPair& source) const
+        {
+            source.useGroups = true;
+            std::unordered_set<Updater*> triggered;
+            for (unsigned bit = 0; bit < width; ++bit)
+            {
+                Hook hook = GetHook(bit);
+                source.AddSwitch(hook.input);
+                if (triggered.insert(&hook.updater).second)
+                    source.AddUpdate(hook.updater);
+            }
+        }
+};
+
+/* `count` gates of one type, wired bit by bit through Bus */
+template <typename Gate, unsigned count> class GateArray
+{
+    public:
+        Gate gates[count];
+
+        static unsigned size()
+        {
+            return count;
+        }
+        Gate& operator[](unsigned index)
+        {
+            if (index >= count)
+                throw std::out_of_range("Gate index out of range");
+            return gates[index];
+        }
+        void AppendToName(std::string toAppend)
+        {
+            for (unsigned i = 0; i < count; ++i)
+                gates[i].AppendToName(toAppend + std::string(" ") + std::to_string(i));
+        }
+        /* Input `pin` of every gate */
+        Bus<count> Inputs(unsigned pin)
+        {
+            Bus<count> bus;
+            for (unsigned i = 0; i < count; ++i)
+                bus.Set(i, gates[i].GetHook(pin));
+            return bus;
+        }
+        /* Output of gate i to bit i of the bus */
+        void HookOutputsTo(const Bus<count>& bus)
+        {
+            for (unsigned i = 0; i < count; ++i)
+                gates[i].HookOutputTo(bus.GetHook(i));
+        }
+        /* The same output to input `pin` of every gate, see Bus::HookFrom */
+        void HookToAll(unsigned pin, TimerPair& source)
+        {
+            Inputs(pin).HookFrom(source);
+        }
+        TimerPair& GetOutput(unsigned index)
+        {
+            return (*this)[index].output;
+        }
+        void AddTo(CircuitCubegridManager& manager)
+        {
+            for (unsigned i = 0; i < count; ++i)
+                manager.AddGate(gates[i]);
+        }
+};
+
+/* `width` DFlipFlops clocked together; Inputs() is the D bus */
+template <unsigned width> class Register : public GateArray<DFlipFlop, width>
+{
+    public:
+        using GateArray<DFlipFlop, width>::Inputs;
+
+        Bus<width> Inputs()
+        {
+            return this->Inputs(0);
+        }
+        void ClockFrom(Clock& clock)
+        {
+            for (unsigned i = 0; i < width; ++i)
+                clock.Attach(this->gates[i]);
+        }
+};
+
+#endif // H_BUS
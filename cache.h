@@ -0,0 +1,215 @@
+#ifndef H_CACHE
+#define H_CACHE
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <memory>
+#include <string>
+#include "gates.h"
+#include "instancing.h"
+#include "netlist.h"
+
+/* 64-bit FNV-1a over everything that decides what a module looks like:
+   its type and constructor arguments, the Netlist it is emitted from, the
+   names it hands out, its toolbar strategy, how it is placed and a version
+   to bump whenever the generator itself changes. Not included by gates.h,
+   so only users of the cache need std::filesystem. */
+class FragmentKey
+{
+    private:
+        uint64_t hash = 14695981039346656037ull;
+
+        void AddByte(uint8_t byte)
+        {
+            hash ^= byte;
+            hash *= 1099511628211ull;
+        }
+        static uint64_t Bits(double value)
+        {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            return bits;
+        }
+
+    public:
+        FragmentKey& Add(uint64_t value)
+        {
+            for (unsigned i = 0; i < 8; ++i)
+                AddByte(static_cast<uint8_t>(value >> (8 * i)));
+            return *this;
+        }
+        FragmentKey& Add(const std::string& text)
+        {
+            Add(text.size());
+            for (char c : text)
+                AddByte(static_cast<uint8_t>(c));
+            return *this;
+        }
+        FragmentKey& Add(const Netlist& netlist)
+        {
+            Add(netlist.size());
+            for (Netlist::NodeId node = 0; node < netlist.size(); ++node)
+            {
+                Add(netlist.Kind(node));
+                Add(netlist.PinCount(node));
+                for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+                    Add(netlist.Fanin(node)[i]);
+                Add(netlist.Label(node));
+            }
+            Add(netlist.Inputs().size());
+            for (Netlist::NodeId node : netlist.Inputs())
+                Add(node);
+            Add(netlist.Outputs().size());
+            for (Netlist::NodeId node : netlist.Outputs())
+                Add(node);
+            return *this;
+        }
+        FragmentKey& Add(const Netlist::Pin& pin)
+        {
+            return Add(uint64_t(pin.node)).Add(uint64_t(pin.index));
+        }
+        /* Picks direct entries or groups for every timer pair */
+        FragmentKey& Add(const ToolbarStrategy& strategy)
+        {
+            return Add(uint64_t(strategy.slotsPerPage)).Add(uint64_t(strategy.pages))
+                  .Add(Bits(strategy.entryCost)).Add(Bits(strategy.groupCost));
+        }
+        /* A shared clock is not part of any one module, so only modules
+           without one are keyed */
+        FragmentKey& Add(const DecoderOptions& options)
+        {
+            if (options.clock)
+                throw std::logic_error("A module on a shared clock can't be cached");
+            return Add(uint64_t(options.predecode)).Add(uint64_t(options.minimize)).Add(uint64_t(options.reduce))
+                  .Add(uint64_t(options.maxFanout)).Add(uint64_t(options.stageHops));
+        }
+
+        uint64_t Value() const
+        {
+            return hash;
+        }
+        std::string Hex() const
+        {
+            char text[17];
+            std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(hash));
+            return text;
+        }
+};
+
+/* Fragments on disk, one file per key. A module is only built when its key
+   has no valid file yet; files are written under a temporary name and
+   renamed, so an interrupted run never leaves a half written fragment. */
+class FragmentCache
+{
+    public:
+        enum : uint64_t {VERSION = 3};
+
+    private:
+        std::filesystem::path directory;
+        std::size_t hits = 0;
+        std::size_t misses = 0;
+
+        std::filesystem::path PathOf(FragmentKey key) const
+        {
+            key.Add(uint64_t(VERSION));
+            return directory / (key.Hex() + ".frag");
+        }
+
+    public:
+        FragmentCache(const std::string& _directory = "fragments") : directory(_directory)
+        {
+            std::filesystem::create_directories(directory);
+        }
+
+        bool Contains(const FragmentKey& key) const
+        {
+            return std::filesystem::exists(PathOf(key));
+        }
+        /* The fragment stored under `key`, or build() stored under it */
+        template <typename Build> Fragment Get(const FragmentKey& key, Build build)
+        {
+            std::filesystem::path path = PathOf(key);
+            std::ifstream input(path, std::ios::binary);
+            if (input.is_open())
+            {
+                try
+                {
+                    Fragment fragment = Fragment::Load(input);
+                    ++hits;
+                    return fragment;
+                }
+                catch (const std::exception&)
+                {
+                    // unreadable or corrupt, even with a size too big to
+                    // allocate: a miss, rebuilt and overwritten below
+                }
+            }
+            ++misses;
+            Fragment fragment = build();
+            std::filesystem::path temporary = path;
+            temporary += ".tmp";
+            {
+                std::ofstream output(temporary, std::ios::binary | std::ios::trunc);
+                fragment.Save(output);
+                if (!output)
+                    throw std::runtime_error("Could not write " + temporary.string());
+            }
+            std::filesystem::rename(temporary, path);
+            return fragment;
+        }
+
+        std::size_t Hits() const
+        {
+            return hits;
+        }
+        std::size_t Misses() const
+        {
+            return misses;
+        }
+};
+
+/* Key of a decoder module Device writes, made from what its fragment is
+   printed from: the netlist its constructor lowers with `options` and the
+   pins the debug inputs and lights are hooked to, its name, which every
+   block and group name is made from, whether it is a release build, the
+   ToolbarStrategy its manager picks entries with and the placement
+   settings it is packed with. Builds no blocks. */
+inline FragmentKey DeviceModuleKey(const std::string& type, const std::string& name, unsigned input_count,
+                                   unsigned output_count, bool release, const DecoderOptions& options = DecoderOptions(),
+                                   const ToolbarStrategy& strategy = ToolbarStrategy::Default())
+{
+    FragmentKey key;
+    key.Add(type).Add(name).Add(uint64_t(input_count)).Add(uint64_t(output_count)).Add(uint64_t(release))
+       .Add(options).Add(strategy)
+       .Add(uint64_t(CircuitCubegridManager::ANNEALING_MOVES)).Add(uint64_t(CircuitCubegridManager::SEED));
+    RuntimeDecoder::Model model;
+    key.Add(RuntimeDecoder::BuildNetlist(input_count, output_count, name, model, options));
+    for (const Netlist::Pin& input : model.inputs)
+        key.Add(input);
+    key.Add(model.enable);
+    for (Netlist::NodeId output : model.outputs)
+        key.Add(uint64_t(output));
+    return key.Add(uint64_t(model.latency));
+}
+
+template <typename Sink> void Device::StreamCachedXml(FragmentCache& cache, bool release, const std::string& path)
+{
+    FragmentKey selectorKey = DeviceModuleKey("Decoder<2,4> selector", "DEC4-0", 2, 4, release).Add("ports").Add(uint64_t(4));
+    Fragment selectorFragment = cache.Get(selectorKey, [release]()
+    {
+        return BuildSelectorFragment(release);
+    });
+    FragmentKey decoderKey = DeviceModuleKey("Decoder<6,64>", "DEC64-0", 6, 64, release).Add("enable");
+    Fragment decoderFragment = cache.Get(decoderKey, [release]()
+    {
+        std::unique_ptr<Decoder<6,64>> decoder(new Decoder<6,64>("DEC64-0", release));
+        return BuildDecoderFragment(*decoder);
+    });
+    StreamCopies<Sink>(selectorFragment, decoderFragment, path);
+}
+
+#endif // H_CACHE
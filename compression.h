@@ -0,0 +1,92 @@
+#ifndef H_COMPRESSION
+#define H_COMPRESSION
+
+#include <cstdint>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+/* Output buffer that gzips the blueprint on its way to the file. Like
+   BufferedFileSink it only holds one buffer of text, the compressed stream
+   is written as it fills. gates.h does not include this; include it and
+   link with zlib (-lz) to write, e.g., StreamXml<GzipFileSink>("bp.sbc.gz"). */
+class GzipFileSink : public std::streambuf
+{
+    private:
+        gzFile file;
+        std::vector<char> buffer;
+        std::size_t written = 0;
+        bool failed = false;
+
+        bool Drain()
+        {
+            std::size_t pending = static_cast<std::size_t>(pptr() - pbase());
+            if (pending && gzwrite(file, pbase(), static_cast<unsigned>(pending)) != static_cast<int>(pending))
+            {
+                failed = true;
+                return false;
+            }
+            written += pending;
+            setp(buffer.data(), buffer.data() + buffer.size());
+            return true;
+        }
+
+    protected:
+        int_type overflow(int_type c) override
+        {
+            if (!file || !Drain())
+                return traits_type::eof();
+            if (!traits_type::eq_int_type(c, traits_type::eof()))
+            {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+        int sync() override
+        {
+            return file && Drain() ? 0 : -1;
+        }
+
+    public:
+        /* level 1 is fastest, 9 smallest; the text is very repetitive, so
+           even 1 shrinks it about tenfold */
+        GzipFileSink(const std::string& path, int level = 6, std::size_t bufferSize = 4 << 20)
+            : buffer(bufferSize)
+        {
+            file = gzopen(path.c_str(), ("wb" + std::to_string(level)).c_str());
+            if (file)
+                gzbuffer(file, 1 << 20);
+            setp(buffer.data(), buffer.data() + buffer.size());
+        }
+        ~GzipFileSink()
+        {
+            Close();
+        }
+        GzipFileSink(const GzipFileSink&) = delete;
+        GzipFileSink& operator=(const GzipFileSink&) = delete;
+
+        bool is_open() const
+        {
+            return file != nullptr;
+        }
+        /* Flushes, finishes the gzip stream and closes the file, false if
+           any of it was not written */
+        bool Close()
+        {
+            if (!file)
+                return false;
+            bool flushed = sync() == 0;
+            bool closed = gzclose(file) == Z_OK;
+            file = nullptr;
+            return flushed && closed && !failed;
+        }
+        /* Uncompressed bytes taken so far */
+        std::size_t BytesWritten() const
+        {
+            return written + static_cast<std::size_t>(pptr() - pbase());
+        }
+};
+
+#endif // H_COMPRESSION
@@ -5,10 +5,25 @@
 #include <string>
 #include <bitset>
 #include <cmath>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <exception>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
 #include "blueprintlib/blueprint.h"
 #include "blueprintlib/blocks.h"
+#include "toolbarlog.h"
+#include "names.h"
+#include "netlist.h"
+#include "optimize.h"
+#include "arena.h"
+#include "blueprintstream.h"
+#include "placement.h"
 
 class CircuitCubegridManager;
+class FragmentCache;
 
 class TimerPair
 {
@@ -22,24 +37,163 @@ class TimerPair
         BlockGroup toSwitchLowGroup;
         BlockGroup toUpdateGroup;
 
+    private:
+        typedef ToolbarLog::Connection Connection;
+        enum : uint8_t {SWITCH_ENTRIES = 1, UPDATE_ENTRY = 2};
+
+        ToolbarLog& log;
+        NameTable& names;
+        NameTable::List namePrefix = NameTable::EMPTY;
+        NameTable::List nameSuffix = NameTable::EMPTY;
+        bool renamed = true;
+        ToolbarLog::ConnectionList connections;
+        int groupSlot = -1;
+        uint8_t groupEntries = 0;
+        bool groupNegate = false;
+
+        void WriteSwitch(TimerPair& toSwitch, bool negate, bool grouped)
+        {
+            if (grouped)
+            {
+                log.AddMember(toSwitchLowGroup, toSwitch.timerLow);
+                log.AddMember(toSwitchHighGroup, toSwitch.timerHigh);
+                if (groupEntries & SWITCH_ENTRIES)
+                    return;
+                groupEntries |= SWITCH_ENTRIES;
+                groupNegate = negate;
+                log.Add(timerLow, negate ? "OnOff_Off" : "OnOff_On", toSwitchLowGroup, groupSlot);
+                log.Add(timerLow, negate ? "OnOff_On" : "OnOff_Off", toSwitchHighGroup, groupSlot + 1);
+                log.Add(timerHigh, negate ? "OnOff_On" : "OnOff_Off", toSwitchLowGroup, groupSlot);
+                log.Add(timerHigh, negate ? "OnOff_Off" : "OnOff_On", toSwitchHighGroup, groupSlot + 1);
+            } else {
+                log.Add(timerLow, negate ? "OnOff_Off" : "OnOff_On", toSwitch.timerLow);
+                log.Add(timerLow, negate ? "OnOff_On" : "OnOff_Off", toSwitch.timerHigh);
+                log.Add(timerHigh, negate ? "OnOff_On" : "OnOff_Off", toSwitch.timerLow);
+                log.Add(timerHigh, negate ? "OnOff_Off" : "OnOff_On", toSwitch.timerHigh);
+            }
+        }
+        void WriteUpdate(TimerBlock& toUpdate, bool grouped)
+        {
+            if (grouped)
+            {
+                log.AddMember(toUpdateGroup, toUpdate);
+                if (groupEntries & UPDATE_ENTRY)
+                    return;
+                groupEntries |= UPDATE_ENTRY;
+                log.Add(timerLow, "TriggerNow", toUpdateGroup, groupSlot + 2);
+                log.Add(timerHigh, "TriggerNow", toUpdateGroup, groupSlot + 2);
+            } else {
+                log.Add(timerLow, "TriggerNow", toUpdate);
+                log.Add(timerHigh, "TriggerNow", toUpdate);
+            }
+        }
+        /* Writes the recorded connections as direct entries or through the
+           pair's groups, whichever `strategy` picks for all of them and the
+           entries already on the timers; useGroups decides without one.
+           Groups take the three slots after the existing entries and are
+           kept once used. Their entries switch every target the same way,
+           so targets switched both ways get direct entries. */
+        void WriteConnections(const ToolbarStrategy* strategy)
+        {
+            if (connections.empty())
+                return;
+            unsigned direct = 0;
+            bool switches = false;
+            bool updates = false;
+            bool mixed = false;
+            bool negate = false;
+            log.ForEachConnection(connections, [&](const Connection& connection)
+            {
+                direct += connection.block ? 1 : 2;
+                if (connection.update)
+                {
+                    updates = true;
+                    return;
+                }
+                mixed = mixed || (switches && connection.negate != negate);
+                switches = true;
+                negate = connection.negate;
+            });
+            unsigned existing = static_cast<unsigned>(std::max(log.EntryCount(timerLow), log.EntryCount(timerHigh)));
+            bool grouped = groupSlot >= 0;
+            if (!grouped)
+                grouped = strategy ? strategy->UseGroups(direct, (switches ? 2 : 0) + (updates ? 1 : 0), existing) : useGroups;
+            if (mixed || (switches && (groupEntries & SWITCH_ENTRIES) && negate != groupNegate))
+                grouped = false;
+            if (grouped && groupSlot < 0)
+                groupSlot = std::max(log.NextSlot(timerLow), log.NextSlot(timerHigh));
+            log.ForEachConnection(connections, [&](const Connection& connection)
+            {
+                if (!connection.update)
+                    WriteSwitch(*connection.pair, connection.negate, grouped);
+                else if (connection.pair)
+                {
+                    WriteUpdate(connection.pair->timerLow, grouped);
+                    WriteUpdate(connection.pair->timerHigh, grouped);
+                }
+                else WriteUpdate(*connection.block, grouped);
+            });
+            log.Drop(connections);
+        }
+
+        /* One allocation for the whole name, none when it still fits */
+        static void SetName(std::string& name, const std::string& base, const char* suffix)
+        {
+            name.clear();
+            name.reserve(base.size() + std::char_traits<char>::length(suffix));
+            name.append(base).append(suffix);
+        }
+
     public:
         bool useGroups;
         enum TIMER {LOW = 0, HIGH = 1};
 
-        void UpdateGroupNames()
+        /* Rendered from the segments, the blocks only get their names
+           when the grid is handed out */
+        std::string Name(TIMER timerType)
         {
-            toSwitchHighGroup.name = timerHigh.CustomName() + std::string(" Group");
-            toSwitchLowGroup.name = timerLow.CustomName() + std::string(" Group");
-            toUpdateGroup.name = timerHigh.CustomName() + std::string(" Updater Group");
+            std::string name;
+            names.AppendTo(name, namePrefix);
+            name += timerType ? "H" : "L";
+            names.AppendReversedTo(name, nameSuffix);
+            return name;
         }
-        TimerPair(bool _useGroups = false)
+        /* Writes the timer and group names, once per rename */
+        void RenderNames()
+        {
+            if (!renamed)
+                return;
+            std::string low = Name(LOW);
+            std::string high = Name(HIGH);
+            SetName(toSwitchHighGroup.name, high, " Group");
+            SetName(toSwitchLowGroup.name, low, " Group");
+            SetName(toUpdateGroup.name, high, " Updater Group");
+            timerLow.CustomName().swap(low);
+            timerHigh.CustomName().swap(high);
+            renamed = false;
+        }
+        TimerPair(bool _useGroups = false) : log(ToolbarLog::Get()), names(NameTable::Get())
         {
             useGroups = _useGroups;
             timerLow.Enabled = true;
             timerHigh.Enabled = false;
-            timerLow.CustomName = "L";
-            timerHigh.CustomName = "H";
-            this->UpdateGroupNames();
+        }
+        /* A pair destroyed with connections its manager never wrote was
+           never emitted, or was hooked after its grid was handed out; that
+           ends the program unless another exception is already on its way */
+        ~TimerPair()
+        {
+            if (!std::uncaught_exceptions())
+                CheckWritten();
+            log.Drop(connections);
+            log.Forget(timerLow);
+            log.Forget(timerHigh);
+        }
+        /* Throws if some connection of the pair was recorded but not written */
+        void CheckWritten()
+        {
+            if (!connections.empty())
+                throw std::logic_error("Connections of " + Name(LOW) + " were never written");
         }
         void Negate()
         {
@@ -55,15 +209,13 @@ class TimerPair
         }
         void AppendToName(std::string toAppend)
         {
-            timerLow.CustomName() += toAppend;
-            timerHigh.CustomName() += toAppend;
-            this->UpdateGroupNames();
+            nameSuffix = names.Push(nameSuffix, toAppend);
+            renamed = true;
         }
         void PrependToName(std::string toPrepend)
         {
-            timerLow.CustomName().insert(0, toPrepend);
-            timerHigh.CustomName().insert(0, toPrepend);
-            this->UpdateGroupNames();
+            namePrefix = names.Push(namePrefix, toPrepend);
+            renamed = true;
         }
         EntityId GetHookLow()
         {
@@ -73,49 +225,20 @@ class TimerPair
         {
             return this->timerHigh.GetEntityId();
         }
+        /* Connections are only recorded in the log here; the pair's
+           manager writes them out in WriteConnections once all of them are
+           known */
         void AddSwitch(TimerPair& toSwitch, bool negate = false)
         {
-            if (this->useGroups)
-            {
-                toSwitchLowGroup.AddBlock(toSwitch.timerLow);
-                toSwitchHighGroup.AddBlock(toSwitch.timerHigh);
-                timerLow.toolbar.AddEntry(negate ? "OnOff_Off" : "OnOff_On", toSwitchLowGroup, 0);
-                timerLow.toolbar.AddEntry(negate ? "OnOff_On" : "OnOff_Off", toSwitchHighGroup, 1);
-                timerHigh.toolbar.AddEntry(negate ? "OnOff_On" : "OnOff_Off", toSwitchLowGroup, 0);
-                timerHigh.toolbar.AddEntry(negate ? "OnOff_Off" : "OnOff_On", toSwitchHighGroup, 1);
-            } else {
-                timerLow.toolbar.AddEntry(negate ? "OnOff_Off" : "OnOff_On", toSwitch.timerLow);
-                timerLow.toolbar.AddEntry(negate ? "OnOff_On" : "OnOff_Off", toSwitch.timerHigh);
-                timerHigh.toolbar.AddEntry(negate ? "OnOff_On" : "OnOff_Off", toSwitch.timerLow);
-                timerHigh.toolbar.AddEntry(negate ? "OnOff_Off" : "OnOff_On", toSwitch.timerHigh);
-            }
+            log.Record(connections, Connection{&toSwitch, nullptr, negate, false});
         }
         void AddUpdate(TimerPair& toUpdate)
         {
-            if (this->useGroups)
-            {
-                toUpdateGroup.AddBlock(toUpdate.timerLow);
-                toUpdateGroup.AddBlock(toUpdate.timerHigh);
-                timerLow.toolbar.AddEntry("TriggerNow", toUpdateGroup, 2);
-                timerHigh.toolbar.AddEntry("TriggerNow", toUpdateGroup, 2);
-            } else {
-                timerLow.toolbar.AddEntry("TriggerNow", toUpdate.timerLow);
-                timerLow.toolbar.AddEntry("TriggerNow", toUpdate.timerHigh);
-                timerHigh.toolbar.AddEntry("TriggerNow", toUpdate.timerLow);
-                timerHigh.toolbar.AddEntry("TriggerNow", toUpdate.timerHigh);
-            }
+            log.Record(connections, Connection{&toUpdate, nullptr, false, true});
         }
         void AddUpdate(TimerBlock& toUpdate)
         {
-            if (this->useGroups)
-            {
-                toUpdateGroup.AddBlock(toUpdate);
-                timerLow.toolbar.AddEntry("TriggerNow", toUpdateGroup, 2);
-                timerHigh.toolbar.AddEntry("TriggerNow", toUpdateGroup, 2);
-            } else {
-                timerLow.toolbar.AddEntry("TriggerNow", toUpdate);
-                timerHigh.toolbar.AddEntry("TriggerNow", toUpdate);
-            }
+            log.Record(connections, Connection{nullptr, &toUpdate, false, true});
         }
         void Connect(TimerPair& toConnect)
         {
@@ -139,37 +262,80 @@ struct Hook
     Hook(TimerPair& _input, Updater& _updater) : input(_input), updater(_updater) {}
 };
 
+/* Makes the blocks behind `hook` reachable as `name` in the fragment */
+inline void ExportHook(Fragment& fragment, const std::string& name, Hook hook)
+{
+    fragment.Export(name + " low", hook.input.timerLow);
+    fragment.Export(name + " high", hook.input.timerHigh);
+    fragment.Export(name + " updater", hook.updater);
+}
+
+/* Stand-in for the hook of a gate in another Fragment: gates are hooked to
+   it as usual, its Ids() are passed as the fragment's ports and each copy
+   links them to a hook another fragment exported. Only direct entries can
+   be linked, groups refer to their blocks by position. */
+struct Port
+{
+    TimerPair input;
+    Updater updater;
+
+    Hook GetHook()
+    {
+        return Hook(input, updater);
+    }
+    std::vector<EntityId> Ids()
+    {
+        return std::vector<EntityId>{input.timerLow.GetEntityId(), input.timerHigh.GetEntityId(), updater.GetEntityId()};
+    }
+    /* Fills the copy's links from index `first` on, where Ids() were put
+       in the fragment's port list */
+    static void Link(Fragment::Instance& instance, std::size_t first, const Fragment& target,
+                     const Fragment::Instance& targetInstance, const std::string& name)
+    {
+        if (instance.links.size() < first + 3)
+            instance.links.resize(first + 3);
+        instance.links[first] = target.IdOf(name + " low", targetInstance);
+        instance.links[first + 1] = target.IdOf(name + " high", targetInstance);
+        instance.links[first + 2] = target.IdOf(name + " updater", targetInstance);
+    }
+};
+
 template <unsigned input_count> class LogicGate
 {
     friend class DebugInput;
     friend class CircuitCubegridManager;
 
+    static_assert(input_count <= ToolbarStrategy().MaxGateInputs(),
+                  "The updater can't trigger this many inputs from one toolbar, use WideGate from lowering.h");
+
+    private:
+        ToolbarLog& log;
+
     public:
         TimerPair inputs[input_count];
         TimerPair output;
         Updater updater;
 
-        LogicGate(bool useGroups = false)
+        LogicGate(bool useGroups = false) : log(ToolbarLog::Get())
         {
             SetupInputs(useGroups);
             SetupOutput(useGroups);
             SetupUpdater();
         }
+        virtual ~LogicGate()
+        {
+            log.Forget(updater);
+        }
 
-        std::string GenerateLetter(unsigned index)
+        static std::string GenerateLetter(unsigned index)
         {
             const char startLetter = 'A';
             const char lastLetter = 'Z';
-            char difference = lastLetter - startLetter + 1;
-            if ((index / difference) == 0)
-                return std::string(1, static_cast<char>(index+startLetter));
-            else
-            {
-                std::string ret;
-                ret.append(GenerateLetter((index/difference) - 1));
-                ret.append(std::string(1, static_cast<char>((index % difference)+startLetter)));
-                return ret;
-            }
+            const unsigned difference = lastLetter - startLetter + 1;
+            std::string ret;
+            for (++index; index > 0; index = (index - 1) / difference)
+                ret.insert(ret.begin(), static_cast<char>((index - 1) % difference + startLetter));
+            return ret;
         }
 
         virtual void SetupOutput(bool useGroups)
@@ -227,9 +393,9 @@ template <unsigned input_count> class AndGate : public LogicGate<input_count>
         {
             this->updater.CustomName = "AND updater";
             for (unsigned i = 0; i < input_count; ++i)
-                this->updater.toolbar.AddEntry("TriggerNow", this->inputs[i].GetHookHigh());
+                ToolbarLog::AddEntry(this->updater, "TriggerNow", this->inputs[i].timerHigh);
             for (unsigned i = 0; i < input_count; ++i)
-                this->updater.toolbar.AddEntry("TriggerNow", this->inputs[i].GetHookLow());
+                ToolbarLog::AddEntry(this->updater, "TriggerNow", this->inputs[i].timerLow);
         }
         void SetupOutput(bool useGroups) override
         {
@@ -246,6 +412,9 @@ template <unsigned input_count> class AndGate : public LogicGate<input_count>
             }
         }
     public:
+        static const Netlist::KIND modelKind = Netlist::AND;
+        static const unsigned modelInputs = input_count;
+
         AndGate(bool useGroups = false)
         {
             SetupInputs(useGroups);
@@ -264,9 +433,9 @@ template <unsigned input_count> class OrGate : public LogicGate<input_count>
         {
             this->updater.CustomName = "OR updater";
             for (unsigned i = 0; i < input_count; ++i)
-                this->updater.toolbar.AddEntry("TriggerNow", this->inputs[i].timerLow);
+                ToolbarLog::AddEntry(this->updater, "TriggerNow", this->inputs[i].timerLow);
             for (unsigned i = 0; i < input_count; ++i)
-                this->updater.toolbar.AddEntry("TriggerNow", this->inputs[i].timerHigh);
+                ToolbarLog::AddEntry(this->updater, "TriggerNow", this->inputs[i].timerHigh);
         }
         void SetupOutput(bool useGroups) override
         {
@@ -279,10 +448,13 @@ template <unsigned input_count> class OrGate : public LogicGate<input_count>
             {
                 this->inputs[i].useGroups = useGroups;
                 this->inputs[i].PrependToName("OR ");
-                this->inputs[i].Connect(&this->output);
+                this->inputs[i].Connect(this->output);
             }
         }
     public:
+        static const Netlist::KIND modelKind = Netlist::OR;
+        static const unsigned modelInputs = input_count;
+
         OrGate(bool useGroups = false)
         {
             SetupInputs(useGroups);
@@ -300,8 +472,8 @@ class NotGate : public LogicGate<1>
         void SetupUpdater() override
         {
             updater.CustomName = "NOT updater";
-            updater.toolbar.AddEntry("TriggerNow", this->inputs[0].GetHookLow());
-            updater.toolbar.AddEntry("TriggerNow", this->inputs[0].GetHookHigh());
+            ToolbarLog::AddEntry(updater, "TriggerNow", this->inputs[0].timerLow);
+            ToolbarLog::AddEntry(updater, "TriggerNow", this->inputs[0].timerHigh);
         }
         void SetupOutput(bool useGroups) override
         {
@@ -316,6 +488,9 @@ class NotGate : public LogicGate<1>
             this->inputs[0].NegatedConnect(this->output);
         }
     public:
+        static const Netlist::KIND modelKind = Netlist::NOT;
+        static const unsigned modelInputs = 1;
+
         NotGate(bool useGroups = true)
         {
             SetupInputs(useGroups);
@@ -333,8 +508,8 @@ class InputGate : public LogicGate<1>
         void SetupUpdater() override
         {
             updater.CustomName = "INPUT updater";
-            updater.toolbar.AddEntry("TriggerNow", this->inputs[0].GetHookLow());
-            updater.toolbar.AddEntry("TriggerNow", this->inputs[0].GetHookHigh());
+            ToolbarLog::AddEntry(updater, "TriggerNow", this->inputs[0].timerLow);
+            ToolbarLog::AddEntry(updater, "TriggerNow", this->inputs[0].timerHigh);
         }
         void SetupOutput(bool useGroups) override
         {
@@ -348,6 +523,9 @@ class InputGate : public LogicGate<1>
             this->inputs[0].Connect(this->output);
         }
     public:
+        static const Netlist::KIND modelKind = Netlist::BUFFER;
+        static const unsigned modelInputs = 1;
+
         InputGate(bool useGroups = true)
         {
             SetupInputs(useGroups);
@@ -356,22 +534,175 @@ class InputGate : public LogicGate<1>
         }
 };
 
+/* Edge-triggered D flip-flop, clocked by a Clock. Writing D only flips the
+   input pair, nothing downstream runs; the clock copies D into the output
+   pair and then passes the output on. The updater has no actions, it's
+   only there so the flip-flop can be hooked like any other gate. */
+class DFlipFlop : public LogicGate<1>
+{
+    friend class DebugInput;
+    friend class CircuitCubegridManager;
+
+    private:
+        void SetupUpdater() override
+        {
+            updater.CustomName = "REG updater";
+        }
+        void SetupOutput(bool useGroups) override
+        {
+            this->output.useGroups = useGroups;
+            this->output.PrependToName("REG ");
+        }
+        void SetupInputs(bool useGroups) override
+        {
+            this->inputs[0].useGroups = useGroups;
+            this->inputs[0].PrependToName("REG ");
+            this->inputs[0].AddSwitch(this->output);
+        }
+    public:
+        static const Netlist::KIND modelKind = Netlist::REGISTER;
+        static const unsigned modelInputs = 1;
+
+        DFlipFlop(bool useGroups = false)
+        {
+            SetupInputs(useGroups);
+            SetupOutput(useGroups);
+            SetupUpdater();
+        }
+};
+
+/* Runtime-width counterpart of AndGate/OrGate/NotGate/InputGate/DFlipFlop,
+   used when the gate kind and width come from a Netlist instead of a
+   template argument. Builds the same blocks, names and toolbar entries. */
+class RuntimeGate
+{
+    friend class DebugInput;
+    friend class CircuitCubegridManager;
+
+    public:
+        std::vector<TimerPair, ArenaAllocator<TimerPair>> inputs;
+        TimerPair output;
+        Updater updater;
+        Netlist::KIND kind;
+
+    private:
+        ToolbarLog& log;
+
+        static const char* KindName(Netlist::KIND kind)
+        {
+            switch (kind)
+            {
+                case Netlist::AND: return "AND";
+                case Netlist::OR: return "OR";
+                case Netlist::NOT: return "NOT";
+                case Netlist::BUFFER: return "INPUT";
+                case Netlist::REGISTER: return "REG";
+                default: throw std::invalid_argument("Netlist node kind has no gate");
+            }
+        }
+
+    public:
+        static bool DefaultUseGroups(Netlist::KIND kind)
+        {
+            return kind == Netlist::NOT || kind == Netlist::BUFFER;
+        }
+
+        RuntimeGate(Netlist::KIND _kind, unsigned input_count, bool inputGroups, bool outputGroups, CircuitArena* arena = nullptr)
+            : inputs(input_count, ArenaAllocator<TimerPair>(arena)), kind(_kind), log(ToolbarLog::Get())
+        {
+            std::string kindName = std::string(KindName(kind)) + " ";
+            if ((kind == Netlist::NOT || kind == Netlist::BUFFER || kind == Netlist::REGISTER) && input_count != 1)
+                throw std::invalid_argument("NOT, INPUT and REG gates have exactly one input");
+
+            for (unsigned i = 0; i < input_count; ++i)
+            {
+                inputs[i].SetCoords(i, 0, 0, TimerPair::LOW);
+                inputs[i].SetCoords(i, 1, 0, TimerPair::HIGH);
+                inputs[i].PrependToName(std::string("input ") + LogicGate<1>::GenerateLetter(i) + std::string(" "));
+                inputs[i].useGroups = inputGroups;
+                inputs[i].PrependToName(kindName);
+                if (kind == Netlist::NOT)
+                    inputs[i].NegatedConnect(output);
+                else if (kind == Netlist::REGISTER)
+                    inputs[i].AddSwitch(output);
+                else inputs[i].Connect(output);
+            }
+
+            output.SetCoords(input_count, 0, 0, TimerPair::LOW);
+            output.SetCoords(input_count, 1, 0, TimerPair::HIGH);
+            output.PrependToName("output ");
+            output.useGroups = outputGroups;
+            if (kind == Netlist::NOT)
+                output.Negate();
+            output.PrependToName(kindName);
+
+            updater.CustomName = kindName + "updater";
+            if (kind == Netlist::REGISTER)
+                return;
+            bool highFirst = kind == Netlist::AND;
+            for (unsigned i = 0; i < input_count; ++i)
+                ToolbarLog::AddEntry(updater, "TriggerNow", highFirst ? inputs[i].timerHigh : inputs[i].timerLow);
+            for (unsigned i = 0; i < input_count; ++i)
+                ToolbarLog::AddEntry(updater, "TriggerNow", highFirst ? inputs[i].timerLow : inputs[i].timerHigh);
+        }
+        RuntimeGate(Netlist::KIND _kind, unsigned input_count, bool useGroups, CircuitArena* arena = nullptr)
+            : RuntimeGate(_kind, input_count, useGroups, useGroups, arena) {}
+        RuntimeGate(Netlist::KIND _kind, unsigned input_count, CircuitArena* arena = nullptr)
+            : RuntimeGate(_kind, input_count, DefaultUseGroups(_kind), arena) {}
+        RuntimeGate(const RuntimeGate&) = delete;
+        RuntimeGate& operator=(const RuntimeGate&) = delete;
+        ~RuntimeGate()
+        {
+            log.Forget(updater);
+        }
+
+        unsigned size() const
+        {
+            return static_cast<unsigned>(inputs.size());
+        }
+        void AppendToName(std::string toAppend)
+        {
+            for (TimerPair& input : inputs)
+                input.AppendToName(toAppend);
+            output.AppendToName(toAppend);
+            updater.CustomName() += toAppend;
+        }
+        void HookOutputTo(Hook hook)
+        {
+            output.AddSwitch(hook.input);
+            output.AddUpdate(hook.updater);
+        }
+        Hook GetHook(unsigned inputIndex)
+        {
+            if (inputIndex >= inputs.size())
+                throw std::out_of_range("Input index out of range");
+            else return Hook(this->inputs[inputIndex], this->updater);
+        }
+};
+
 class DebugInput
 {
     friend class CircuitCubegridManager;
 
+    private:
+        ToolbarLog& log = ToolbarLog::Get();
+
     public:
         TimerBlock debugTimer;
         BlockGroup debugGroupInput;
         BlockGroup debugGroupUpdater;
     public:
+        ~DebugInput()
+        {
+            log.Forget(debugTimer);
+        }
         void HookDebugTo(Hook hook)
         {
-            debugGroupInput.AddBlock(hook.input.timerHigh);
-            debugGroupInput.AddBlock(hook.input.timerLow);
-            debugGroupUpdater.AddBlock(hook.updater);
-            debugTimer.toolbar.AddEntry("OnOff", debugGroupInput, 0);
-            debugTimer.toolbar.AddEntry("TriggerNow", debugGroupUpdater, 1);
+            log.AddMember(debugGroupInput, hook.input.timerHigh);
+            log.AddMember(debugGroupInput, hook.input.timerLow);
+            log.AddMember(debugGroupUpdater, hook.updater);
+            log.Add(debugTimer, "OnOff", debugGroupInput, 0);
+            log.Add(debugTimer, "TriggerNow", debugGroupUpdater, 1);
             /*std::size_t highLow = hook.input.timerLow.CustomName().find("L");
             if (highLow != std::string::npos)
                 debugTimer.CustomName = std::string("Debug ") + hook.input.timerLow.CustomName().substr(0, highLow) + hook.input.timerLow.CustomName().substr(highLow+2, std::string::npos);*/
@@ -390,13 +721,151 @@ class DebugInput
         }
 };
 
+/* Clock for DFlipFlops and REG gates. Triggering the timer first makes
+   every attached flip-flop capture its D (slot 0), then launches all of
+   them (slot 1), so none of them sees a neighbour's new value in the same
+   cycle. Each step is one group, the timer keeps two toolbar entries
+   however many flip-flops it drives. Trigger it from a button or a
+   timer that restarts itself. */
+class Clock
+{
+    friend class CircuitCubegridManager;
+
+    private:
+        ToolbarLog& log;
+        std::size_t attached = 0;
 
+    public:
+        TimerBlock timer;
+        BlockGroup captureGroup;
+        BlockGroup launchGroup;
+
+        Clock(std::string name = "CLOCK", ToolbarLog& _log = ToolbarLog::Get()) : log(_log)
+        {
+            timer.Enabled = true;
+            timer.CustomName = name;
+            captureGroup.name = name + std::string(" capture");
+            launchGroup.name = name + std::string(" launch");
+            log.Add(timer, "TriggerNow", captureGroup, 0);
+            log.Add(timer, "TriggerNow", launchGroup, 1);
+        }
+        Clock(const Clock&) = delete;
+        Clock& operator=(const Clock&) = delete;
+        ~Clock()
+        {
+            log.Forget(timer);
+        }
+
+        void Attach(TimerPair& input, TimerPair& output)
+        {
+            log.AddMember(captureGroup, input.timerLow);
+            log.AddMember(captureGroup, input.timerHigh);
+            log.AddMember(launchGroup, output.timerLow);
+            log.AddMember(launchGroup, output.timerHigh);
+            ++attached;
+        }
+        void Attach(DFlipFlop& flipFlop)
+        {
+            Attach(flipFlop.inputs[0], flipFlop.output);
+        }
+        void Attach(RuntimeGate& runtimeGate)
+        {
+            if (runtimeGate.kind != Netlist::REGISTER)
+                throw std::invalid_argument("Only REG gates can be clocked");
+            Attach(runtimeGate.inputs[0], runtimeGate.output);
+        }
+        /* Number of flip-flops attached */
+        std::size_t size() const
+        {
+            return attached;
+        }
+};
 
 class CircuitCubegridManager
 {
     private:
+        ToolbarLog& log;
         CubeGrid cubegrid;
+        std::vector<TimerPair*> timerPairs;
+        std::vector<BlockGroup*> groups;
+        /* Three groups per pair; the set only lives as long as the manager */
+        CircuitArena arena;
+        std::unordered_set<const BlockGroup*, std::hash<const BlockGroup*>, std::equal_to<const BlockGroup*>,
+                           ArenaAllocator<const BlockGroup*>> knownGroups;
+        std::unordered_map<const BlockGroup*, std::size_t> placedGroups;
+        bool movedOut = false;
+        const ToolbarStrategy* strategy = &ToolbarStrategy::Default();
+
+        /* Groups keep filling up while gates are hooked together, so they are
+           only referenced here and moved into the grid once it is handed out */
+        void AddGroup(BlockGroup& group)
+        {
+            if (knownGroups.insert(&group).second)
+                groups.push_back(&group);
+        }
+        /* Every pair's connections are known once the grid is placed or
+           handed out; later ones are written at the next of these */
+        void WriteConnections()
+        {
+            for (TimerPair* timerPair : timerPairs)
+                timerPair->WriteConnections(strategy);
+        }
+        /* The pairs stay registered, so connections made after the grid was
+           handed out by reference are written at the next hand-out. A group
+           that gained members since it was moved into the grid is moved
+           again, rebuilt from the log. */
+        void Finalize()
+        {
+            if (movedOut)
+                throw std::logic_error("The grid was already handed out");
+            this->WriteConnections();
+            for (TimerPair* timerPair : timerPairs)
+                timerPair->RenderNames();
+            for (BlockGroup* group : groups)
+            {
+                if (!group->size())
+                    continue;
+                auto placed = placedGroups.find(group);
+                if (placed == placedGroups.end())
+                {
+                    placedGroups.emplace(group, cubegrid.groups.size());
+                    cubegrid.groups.push_back(std::move(*group));
+                    // toolbar entries still refer to the group by name
+                    group->name = cubegrid.groups.back().name;
+                    continue;
+                }
+                BlockGroup& rebuilt = cubegrid.groups[placed->second];
+                rebuilt = BlockGroup();
+                rebuilt.name = group->name;
+                log.ForEachMember(*group, [&rebuilt](ICubeBlock* member)
+                {
+                    rebuilt.AddBlock(*member);
+                });
+                std::string name = group->name;
+                *group = BlockGroup();
+                group->name = name;
+            }
+        }
+        /* Once the grid is moved out nothing more can be written to it */
+        void MoveOut()
+        {
+            this->Finalize();
+            movedOut = true;
+        }
     public:
+        /* `_log` is the one the gates added here record into */
+        CircuitCubegridManager(ToolbarLog& _log = ToolbarLog::Get()) : log(_log), arena(1 << 16), knownGroups(&arena) {}
+
+        const ToolbarLog& Log() const
+        {
+            return log;
+        }
+        /* How the pairs' connections are written, nullptr to keep every
+           pair's own useGroups */
+        void SetToolbarStrategy(const ToolbarStrategy* _strategy)
+        {
+            strategy = _strategy;
+        }
         void AddBlock(ICubeBlock& cubeblock)
         {
             cubegrid.blocks.AddBlock(cubeblock);
@@ -405,43 +874,36 @@ class CircuitCubegridManager
         {
             cubegrid.blocks.AddBlock(&timerPair.timerLow);
             cubegrid.blocks.AddBlock(&timerPair.timerHigh);
-            if (timerPair.toSwitchLowGroup.size())
-                cubegrid.groups.push_back(timerPair.toSwitchLowGroup);
-            if (timerPair.toSwitchHighGroup.size())
-                cubegrid.groups.push_back(timerPair.toSwitchHighGroup);
-            if (timerPair.toUpdateGroup.size())
-                cubegrid.groups.push_back(timerPair.toUpdateGroup);
+            timerPairs.push_back(&timerPair);
+            AddGroup(timerPair.toSwitchLowGroup);
+            AddGroup(timerPair.toSwitchHighGroup);
+            AddGroup(timerPair.toUpdateGroup);
         }
         template <unsigned input_count> void AddGate(LogicGate<input_count>& logicGate)
         {
             for (unsigned i = 0; i < input_count; ++i)
-            {
-                cubegrid.blocks.AddBlock(&logicGate.inputs[i].timerLow);
-                cubegrid.blocks.AddBlock(&logicGate.inputs[i].timerHigh);
-                if (logicGate.inputs[i].toSwitchLowGroup.size())
-                    cubegrid.groups.push_back(logicGate.inputs[i].toSwitchLowGroup);
-                if (logicGate.inputs[i].toSwitchHighGroup.size())
-                    cubegrid.groups.push_back(logicGate.inputs[i].toSwitchHighGroup);
-                if (logicGate.inputs[i].toUpdateGroup.size())
-                    cubegrid.groups.push_back(logicGate.inputs[i].toUpdateGroup);
-            }
-            cubegrid.blocks.AddBlock(&logicGate.output.timerLow);
-            cubegrid.blocks.AddBlock(&logicGate.output.timerHigh);
+                AddTimers(logicGate.inputs[i]);
+            AddTimers(logicGate.output);
             cubegrid.blocks.AddBlock(&logicGate.updater);
-            if (logicGate.output.toSwitchLowGroup.size())
-                cubegrid.groups.push_back(logicGate.output.toSwitchLowGroup);
-            if (logicGate.output.toSwitchHighGroup.size())
-                cubegrid.groups.push_back(logicGate.output.toSwitchHighGroup);
-            if (logicGate.output.toUpdateGroup.size())
-                cubegrid.groups.push_back(logicGate.output.toUpdateGroup);
+        }
+        void AddGate(RuntimeGate& runtimeGate)
+        {
+            for (TimerPair& input : runtimeGate.inputs)
+                AddTimers(input);
+            AddTimers(runtimeGate.output);
+            cubegrid.blocks.AddBlock(&runtimeGate.updater);
         }
         void AddDebug(DebugInput& debugInput)
         {
             cubegrid.blocks.AddBlock(&debugInput.debugTimer);
-            if (debugInput.debugGroupInput.size())
-                cubegrid.groups.push_back(debugInput.debugGroupInput);
-            if (debugInput.debugGroupUpdater.size())
-                cubegrid.groups.push_back(debugInput.debugGroupUpdater);
+            AddGroup(debugInput.debugGroupInput);
+            AddGroup(debugInput.debugGroupUpdater);
+        }
+        void AddClock(Clock& clock)
+        {
+            cubegrid.blocks.AddBlock(&clock.timer);
+            AddGroup(clock.captureGroup);
+            AddGroup(clock.launchGroup);
         }
         std::size_t AssignCoords(unsigned width)
         {
@@ -453,153 +915,467 @@ class CircuitCubegridManager
             }
             return i/width;
         }
+        /* What the circuits pass to Place */
+        enum : uint32_t {ANNEALING_MOVES = 0, SEED = 1};
+
+        /* Packs the blocks into a compact box, connected blocks close
+           together; see Placement. Returns the size of the box. */
+        Placement::Position Place(unsigned annealingMoves = ANNEALING_MOVES, uint32_t seed = SEED)
+        {
+            this->WriteConnections();
+            Placement placement(cubegrid, log);
+            placement.Place(annealingMoves, seed);
+            placement.Apply();
+            return placement.Extent();
+        }
         CubeGrid GetStdMoveCubegrid()
         {
+            this->MoveOut();
             return std::move(this->cubegrid);
         }
         CubeGrid& GetCubegrid()
         {
+            this->Finalize();
             return this->cubegrid;
         }
+        void StreamTo(BlueprintStreamWriter& writer)
+        {
+            this->MoveOut();
+            writer.Write(std::move(this->cubegrid));
+            this->cubegrid = CubeGrid();
+        }
         void TranslateCoords(int64_t x, int64_t y, int64_t z)
         {
             cubegrid.TranslateCoords(x, y, z);
         }
 };
 
-template <unsigned input_count, unsigned output_count>
-class Decoder
+/* Final pass from the Netlist to game blocks: one RuntimeGate per gate
+   node, hooked together along the netlist's pins. Pins driven by primary
+   inputs are left open and can be reached through GetHook. REGISTER nodes
+   become REG gates, all on one Clock reached through GetClock; it is only
+   made and emitted when there are some. Gates, their input pairs and the
+   clock are placed in a CircuitArena, the caller's if one is given.
+   A ToolbarStrategy given here replaces the one of the manager the gates
+   are emitted into. */
+class NetlistLowering
 {
     private:
-        CircuitCubegridManager mainCg;
-        AndGate<input_count+1> ands[output_count];
-        NotGate nots[input_count];
-        InputGate inputs[input_count];
-        InputGate enable;
-        DebugInput debugInputs[input_count];
-        InteriorLight outputLights[output_count];
-        InteriorLight inputLights[input_count];
+        const Netlist& netlist;
+        CircuitArena ownArena;
+        CircuitArena& arena;
+        std::vector<RuntimeGate*> gates;
+        std::vector<RuntimeGate*> gateOf;
+        std::string clockName;
+        Clock* clock;
+        bool sharedClock;
+        const ToolbarStrategy* strategy;
+
     public:
-        Decoder(std::string name)
+        /* REGISTER nodes go on `_clock` when one is given; it is then the
+           caller's to emit */
+        NetlistLowering(const Netlist& _netlist, std::string name = "", CircuitArena* _arena = nullptr,
+                        const ToolbarStrategy* _strategy = nullptr, Clock* _clock = nullptr)
+            : netlist(_netlist), arena(_arena ? *_arena : ownArena), clockName("CLOCK" + name), clock(_clock),
+              sharedClock(_clock != nullptr), strategy(_strategy)
         {
-            for (unsigned i = 0; i < input_count; i++)
+            gateOf.assign(netlist.size(), nullptr);
+            for (Netlist::NodeId node = 0; node < netlist.size(); ++node)
             {
-                inputs[i].AppendToName(std::string(" ")+name+std::string(" ")+std::to_string(i));
-                nots[i].AppendToName(std::string(" ")+name+std::string(" ")+std::to_string(i));
-                debugInputs[i].SetName(std::string("Debug input ") + name + std::string(" ") + std::to_string(i));
-                inputLights[i].CustomName = std::string(" ")+name+std::string("Light in "+std::to_string(i));
-
-                debugInputs[i].debugTimer.toolbar.AddEntry("OnOff", inputLights[input_count-i-1], 2);
-                debugInputs[i].HookDebugTo(inputs[i].GetHook(0));
+                if (netlist.Kind(node) == Netlist::INPUT)
+                    continue;
+                RuntimeGate* gate = arena.Create<RuntimeGate>(netlist.Kind(node), netlist.PinCount(node), &arena);
+                gates.push_back(gate);
+                gateOf[node] = gate;
+                if (netlist.Kind(node) == Netlist::REGISTER)
+                    GetClock().Attach(*gate);
+                std::string label = netlist.Label(node);
+                if (!label.empty() || !name.empty())
+                    gate->AppendToName(label + name);
             }
+            for (Netlist::NodeId node = 0; node < netlist.size(); ++node)
+            {
+                for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+                {
+                    Netlist::NodeId driver = netlist.Fanin(node)[i];
+                    if (driver != Netlist::NONE && gateOf[driver])
+                        gateOf[driver]->HookOutputTo(gateOf[node]->GetHook(i));
+                }
+            }
+        }
+        NetlistLowering(const NetlistLowering&) = delete;
+        NetlistLowering& operator=(const NetlistLowering&) = delete;
+
+        RuntimeGate& GateOf(Netlist::NodeId node)
+        {
+            if (node >= gateOf.size() || !gateOf[node])
+                throw std::out_of_range("Node has no lowered gate");
+            return *gateOf[node];
+        }
+        Hook GetHook(Netlist::Pin pin)
+        {
+            return GateOf(pin.node).GetHook(pin.index);
+        }
+        void HookOutputTo(Netlist::NodeId node, Hook hook)
+        {
+            GateOf(node).HookOutputTo(hook);
+        }
+        Clock& GetClock()
+        {
+            if (!clock)
+                clock = arena.Create<Clock>(clockName);
+            return *clock;
+        }
+        void Emit(CircuitCubegridManager& manager)
+        {
+            if (strategy)
+                manager.SetToolbarStrategy(strategy);
+            for (RuntimeGate* gate : gates)
+                manager.AddGate(*gate);
+            if (clock && !sharedClock && clock->size())
+                manager.AddClock(*clock);
+        }
+};
+
+/* How a decoder's netlist is built and rewritten before it is lowered */
+struct DecoderOptions
+{
+    /* BuildPredecodedModel instead of one AND over every input per output */
+    bool predecode = false;
+    /* Run the netlist through Minimize */
+    bool minimize = false;
+    /* Run the netlist through Reduce, which drops the gates no output
+       reads, such as predecoder lines of outputs that were not asked for */
+    bool reduce = true;
+    /* Readers a gate output may have before BufferFanout splits it, by
+       default as many as one toolbar holds direct entries for; 0 leaves
+       fan-out alone */
+    unsigned maxFanout = ToolbarStrategy().MaxFanout();
+    /* Pipeline registers every stageHops hops, 0 for none; the outputs
+       then follow the inputs Latency() clock pulses later */
+    uint32_t stageHops = 0;
+    /* The registers go on this clock instead of one of the decoder's own,
+       which the decoder then doesn't emit */
+    Clock* clock = nullptr;
+};
+
+/* Decoder for an input count picked at runtime; Decoder<I,O> wraps it, so
+   the decoder wiring is written only here. The constructor builds the
+   decoder's Netlist once and emits it through NetlistLowering, then adds
+   the debug inputs and lights on top; GetNetlist() is exactly what was
+   emitted. Gates, debug inputs and lights live side by side in the
+   decoder's own CircuitArena, so only this one class is compiled however
+   many sizes a program builds. */
+class RuntimeDecoder
+{
+    public:
+        struct Model
+        {
+            std::vector<Netlist::Pin> inputs;
+            Netlist::Pin enable;
+            std::vector<Netlist::NodeId> outputs;
+            /* Clock pulses from the inputs to the outputs */
+            unsigned latency = 0;
+        };
+
+    private:
+        ToolbarLog log;
+        NameTable names;
+        CircuitArena arena;
+        unsigned input_count;
+        unsigned output_count;
+        Model model;
+        Netlist netlist;
+        NetlistLowering* lowering;
+        CircuitCubegridManager mainCg;
+        Placement::Position extent;
+        std::vector<DebugInput, ArenaAllocator<DebugInput>> debugInputs;
+        std::vector<InteriorLight, ArenaAllocator<InteriorLight>> outputLights;
+        std::vector<InteriorLight, ArenaAllocator<InteriorLight>> inputLights;
+    public:
+        static bool UsesInverted(unsigned input_index, unsigned output_index)
+        {
+            return !((output_index >> input_index) & 1);
+        }
+        static unsigned CheckOutputCount(unsigned input_count, unsigned output_count)
+        {
+            if (input_count == 0 || input_count >= 32)
+                throw std::out_of_range("Decoder input count out of range");
+            if (output_count == 0 || output_count > (1u << input_count))
+                throw std::out_of_range("Decoder output count out of range");
+            return output_count;
+        }
+        /* The decoder's gates, wiring and names, added to `netlist` */
+        static Model BuildModel(Netlist& netlist, unsigned input_count, unsigned output_count, std::string name = "")
+        {
+            CheckOutputCount(input_count, output_count);
+            Model model;
+            model.inputs.resize(input_count);
+            model.outputs.resize(output_count);
+            std::vector<Netlist::NodeId> inputGates(input_count);
+            std::vector<Netlist::NodeId> notGates(input_count);
             for (unsigned i = 0; i < output_count; i++)
             {
-                outputLights[i].CustomName = std::string(" ")+name+std::string("Light out "+std::to_string(i));
-                ands[i].AppendToName(std::string(" ")+name+std::string(" ")+std::to_string(i));
-                ands[i].output.timerLow.toolbar.AddEntry("OnOff_Off", outputLights[i]);
-                ands[i].output.timerHigh.toolbar.AddEntry("OnOff_On", outputLights[i]);
-                enable.HookOutputTo(ands[i].GetHook(input_count));
-                mainCg.AddGate(ands[i]);
-            }
-            enable.AppendToName(std::string(" ")+name+" ENABLE");
-            mainCg.AddGate(enable);
+                model.outputs[i] = netlist.AddNode(Netlist::AND, input_count+1);
+                if (!name.empty())
+                    netlist.SetLabel(model.outputs[i], std::string(" ")+name+std::string(" ")+std::to_string(i));
+            }
+            Netlist::NodeId enable = netlist.Add<InputGate>();
+            if (!name.empty())
+                netlist.SetLabel(enable, std::string(" ")+name+" ENABLE");
+            model.enable = Netlist::Pin{enable, 0};
+            for (unsigned i = 0; i < output_count; i++)
+                netlist.Connect(enable, model.outputs[i], input_count);
             for (unsigned i = 0; i < input_count; i++)
             {
-                inputs[i].HookOutputTo(nots[i].GetHook(0));
-                unsigned power = static_cast<unsigned>(pow(2, i+1));
-                for (unsigned j = 0; j < output_count; j++)
+                inputGates[i] = netlist.Add<InputGate>();
+                notGates[i] = netlist.Add<NotGate>();
+                if (!name.empty())
                 {
-                    if ((j % power) < power/2)
-                        nots[i].HookOutputTo(ands[j].GetHook(i));
-                    else inputs[i].HookOutputTo(ands[j].GetHook(i));
+                    netlist.SetLabel(inputGates[i], std::string(" ")+name+std::string(" ")+std::to_string(i));
+                    netlist.SetLabel(notGates[i], std::string(" ")+name+std::string(" ")+std::to_string(i));
                 }
-                mainCg.AddDebug(debugInputs[i]);
-                mainCg.AddGate(nots[i]);
-                mainCg.AddGate(inputs[i]);
+                model.inputs[i] = Netlist::Pin{inputGates[i], 0};
+                netlist.Connect(inputGates[i], notGates[i], 0);
+                for (unsigned j = 0; j < output_count; j++)
+                    netlist.Connect(UsesInverted(i, j) ? notGates[i] : inputGates[i], model.outputs[j], i);
             }
-            /*std::size_t length = */mainCg.AssignCoords(25);
+            return model;
+        }
 
-            /*CubeGrid armorCb;
-            ArmorBlock armor;
-            armor.Coords.y = -1;
-            for (int i = 0; i < length; i++)
+        /* Same interface as BuildModel, but the inputs are split into stages
+           of stageWidth bits, each decoded on its own (enable folded into the
+           first stage), and every output ANDs one line per stage. 6-to-64
+           becomes two 3-to-8 predecoders feeding 2-input ANDs. */
+        static Model BuildPredecodedModel(Netlist& netlist, unsigned input_count, unsigned output_count,
+                                          std::string name = "", unsigned stageWidth = 3)
+        {
+            CheckOutputCount(input_count, output_count);
+            Model model;
+            model.inputs.resize(input_count);
+            model.outputs.resize(output_count);
+            std::vector<Netlist::NodeId> inputGates(input_count);
+            std::vector<Netlist::NodeId> notGates(input_count);
+            Netlist::NodeId enable = netlist.Add<InputGate>();
+            if (!name.empty())
+                netlist.SetLabel(enable, std::string(" ")+name+" ENABLE");
+            model.enable = Netlist::Pin{enable, 0};
+            for (unsigned i = 0; i < input_count; i++)
             {
-                for (int j = 0; j < 4; j++)
+                inputGates[i] = netlist.Add<InputGate>();
+                notGates[i] = netlist.Add<NotGate>();
+                if (!name.empty())
                 {
-                    armor.Coords.z = j;
-                    armor.Coords.x = i;
-                    armorCb.blocks.AddBlock(armor);
+                    netlist.SetLabel(inputGates[i], std::string(" ")+name+std::string(" ")+std::to_string(i));
+                    netlist.SetLabel(notGates[i], std::string(" ")+name+std::string(" ")+std::to_string(i));
                 }
+                model.inputs[i] = Netlist::Pin{inputGates[i], 0};
+                netlist.Connect(inputGates[i], notGates[i], 0);
             }
 
-            armor.Coords.z = 2;
-            for (int i = 0; i < 8; i++)
+            unsigned stages = (input_count + stageWidth - 1) / stageWidth;
+            std::vector<std::vector<Netlist::NodeId>> lines(stages);
+            for (unsigned s = 0; s < stages; s++)
             {
-                for (int j = 0; j < 8; j++)
+                unsigned first = s * stageWidth;
+                unsigned width = std::min(stageWidth, input_count - first);
+                unsigned pins = width + (s == 0 ? 1 : 0);
+                for (unsigned value = 0; value < (1u << width); value++)
                 {
-                    armor.Coords.y = j;
-                    armor.Coords.x = i;
-                    armorCb.blocks.AddBlock(armor);
-
-                    outputLights[i*8+j].Coords.y = i;
-                    outputLights[i*8+j].Coords.z = 3;
-                    outputLights[i*8+j].Coords.x = j;
-                    outputLights[i*8+j].BlockOrientation.Forward = ORIENT_BACKWARD;
-                    outputLights[i*8+j].BlockOrientation.Up = ORIENT_DOWN;
-                    outputLights[i*8+j].Enabled = false;
-                    armorCb.blocks.AddBlock(&outputLights[i*8+j]);
+                    Netlist::NodeId line = netlist.AddNode(Netlist::AND, pins);
+                    for (unsigned b = 0; b < width; b++)
+                        netlist.Connect(UsesInverted(first+b, value << first) ? notGates[first+b] : inputGates[first+b], line, b);
+                    if (s == 0)
+                        netlist.Connect(enable, line, width);
+                    lines[s].push_back(line);
                 }
-
             }
-            outputLights[0].Enabled = true;
-
-            armor.Coords.z = 2;
-            for (int i = 0; i < inputs; i++)
+            for (unsigned j = 0; j < output_count; j++)
             {
-                for (int j = 8; j < 10; j++)
+                if (stages == 1)
+                    model.outputs[j] = lines[0][j];
+                else
                 {
-                    armor.Coords.y = j;
-                    armor.Coords.x = i;
-                    armorCb.blocks.AddBlock(armor);
+                    model.outputs[j] = netlist.AddNode(Netlist::AND, stages);
+                    for (unsigned s = 0; s < stages; s++)
+                        netlist.Connect(lines[s][(j >> (s * stageWidth)) & ((1u << stageWidth) - 1)], model.outputs[j], s);
                 }
+                if (!name.empty())
+                    netlist.SetLabel(model.outputs[j], std::string(" ")+name+std::string(" ")+std::to_string(j));
             }
-            for (int i = 0; i < inputs; i++)
+            return model;
+        }
+
+        /* `model` in the netlist `rewrite` made */
+        static void Remap(Model& model, const NetlistRewrite& rewrite)
+        {
+            for (Netlist::Pin& input : model.inputs)
+                input = rewrite.Map(input);
+            model.enable = rewrite.Map(model.enable);
+            for (Netlist::NodeId& output : model.outputs)
+                output = rewrite.Map(output);
+        }
+        /* What the constructor lowers: the model `options` picks with the
+           outputs declared, rewritten the way they ask */
+        static Netlist BuildNetlist(unsigned input_count, unsigned output_count, std::string name, Model& model,
+                                    const DecoderOptions& options = DecoderOptions())
+        {
+            Netlist netlist;
+            if (options.predecode)
+                model = BuildPredecodedModel(netlist, input_count, output_count, name);
+            else model = BuildModel(netlist, input_count, output_count, name);
+            for (Netlist::NodeId output : model.outputs)
+                netlist.MarkOutput(output);
+            if (options.minimize)
+            {
+                NetlistRewrite minimized = Minimize(netlist);
+                Remap(model, minimized);
+                netlist = std::move(minimized.netlist);
+            }
+            if (options.reduce)
+            {
+                NetlistRewrite reduced = Reduce(netlist);
+                Remap(model, reduced);
+                netlist = std::move(reduced.netlist);
+            }
+            // last, Simplify would take the buffers out again
+            if (options.maxFanout)
+            {
+                NetlistRewrite buffered = BufferFanout(netlist, options.maxFanout);
+                Remap(model, buffered);
+                netlist = std::move(buffered.netlist);
+            }
+            if (options.stageHops)
             {
-                inputLights[i].Coords.y = 9;
-                inputLights[i].Coords.z = 3;
-                inputLights[i].Coords.x = i;
-                inputLights[i].BlockOrientation.Forward = ORIENT_BACKWARD;
-                inputLights[i].BlockOrientation.Up = ORIENT_DOWN;
-                inputLights[i].Enabled = false;
-                armorCb.blocks.AddBlock(&inputLights[i]);
+                std::vector<uint32_t> cuts = PipelineCuts(netlist, options.stageHops);
+                NetlistRewrite pipelined = Pipeline(netlist, cuts);
+                Remap(model, pipelined);
+                model.latency = static_cast<unsigned>(cuts.size());
+                netlist = std::move(pipelined.netlist);
             }
+            return netlist;
+        }
 
-            blueprint.Cubegrids.push_back(std::move(armorCb));*/
+        /* A release build leaves out the DebugInput timers and the lights */
+        RuntimeDecoder(unsigned _input_count, unsigned _output_count, std::string name, bool release = false,
+                       const DecoderOptions& options = DecoderOptions())
+            : input_count(_input_count), output_count(CheckOutputCount(_input_count, _output_count)),
+              netlist(BuildNetlist(input_count, output_count, name, model, options)), mainCg(log),
+              debugInputs(&arena), outputLights(&arena), inputLights(&arena)
+        {
+            // gates record into the log and name table current when they are built
+            ToolbarLog::Scope scope(log);
+            NameTable::Scope namesScope(names);
+            lowering = arena.Create<NetlistLowering>(netlist, "", &arena, nullptr, options.clock);
+            debugInputs.resize(release ? 0 : _input_count);
+            outputLights.resize(release ? 0 : _output_count);
+            inputLights.resize(release ? 0 : _input_count);
+            for (unsigned i = 0; i < debugInputs.size(); i++)
+            {
+                debugInputs[i].SetName(std::string("Debug input ") + name + std::string(" ") + std::to_string(i));
+                inputLights[i].CustomName = std::string(" ")+name+std::string("Light in "+std::to_string(i));
+                log.Add(debugInputs[i].debugTimer, "OnOff", inputLights[input_count-i-1], 2);
+                debugInputs[i].HookDebugTo(GetHook(i));
+            }
+            for (unsigned i = 0; i < outputLights.size(); i++)
+            {
+                outputLights[i].CustomName = std::string(" ")+name+std::string("Light out "+std::to_string(i));
+                log.Add(GetOutput(i).timerLow, "OnOff_Off", outputLights[i]);
+                log.Add(GetOutput(i).timerHigh, "OnOff_On", outputLights[i]);
+            }
+            lowering->Emit(mainCg);
+            for (DebugInput& debugInput : debugInputs)
+                mainCg.AddDebug(debugInput);
+            extent = mainCg.Place();
+        }
+        RuntimeDecoder(unsigned _input_count, std::string name, bool release = false,
+                       const DecoderOptions& options = DecoderOptions())
+            : RuntimeDecoder(_input_count, _input_count < 32 ? 1u << _input_count : 0, name, release, options) {}
+        RuntimeDecoder(const RuntimeDecoder&) = delete;
+        RuntimeDecoder& operator=(const RuntimeDecoder&) = delete;
 
+        unsigned InputCount() const
+        {
+            return input_count;
+        }
+        unsigned OutputCount() const
+        {
+            return output_count;
+        }
+        /* The netlist the decoder's gates were lowered from, and where its
+           inputs, enable and outputs are in it */
+        const Netlist& GetNetlist() const
+        {
+            return netlist;
+        }
+        const Model& GetModel() const
+        {
+            return model;
+        }
+        /* Toolbar entries and groups of this decoder's blocks only */
+        const ToolbarLog& Log() const
+        {
+            return log;
+        }
+        /* The clock the registers of a pipelined decoder are on, nullptr
+           for a combinational one */
+        Clock* GetClock()
+        {
+            return model.latency ? &lowering->GetClock() : nullptr;
+        }
+        unsigned Latency() const
+        {
+            return model.latency;
         }
         CubeGrid GetStdMoveCubegrid()
         {
-            return std::move(mainCg.GetStdMoveCubegrid());
+            return mainCg.GetStdMoveCubegrid();
+        }
+        /* Blocks the decoder toolbars act on that are not in its grid */
+        std::vector<ICubeBlock*> Lights()
+        {
+            std::vector<ICubeBlock*> lights;
+            for (InteriorLight& light : inputLights)
+                lights.push_back(&light);
+            for (InteriorLight& light : outputLights)
+                lights.push_back(&light);
+            return lights;
+        }
+        /* Size of the box the decoder's blocks were placed in */
+        Placement::Position Extent() const
+        {
+            return extent;
         }
         CubeGrid& GetCubegrid()
         {
             return mainCg.GetCubegrid();
         }
+        void StreamTo(BlueprintStreamWriter& writer)
+        {
+            mainCg.StreamTo(writer);
+        }
         void HookOutputTo(unsigned output_index, Hook hook)
         {
             if (output_index >= output_count)
                 throw std::out_of_range("Output index out of range");
             else
-                ands[output_index].HookOutputTo(hook);
+                lowering->HookOutputTo(model.outputs[output_index], hook);
         }
-        virtual Hook GetHook(unsigned inputIndex)
+        Hook GetHook(unsigned inputIndex)
         {
             if (inputIndex > input_count)
                 throw std::out_of_range("Input index out of range");
             else if (inputIndex == input_count)
-                return enable.GetHook(0);
+                return lowering->GetHook(model.enable);
             else
-                return inputs[inputIndex].GetHook(inputIndex);
+                return lowering->GetHook(model.inputs[inputIndex]);
+        }
+        TimerPair& GetOutput(unsigned output_index)
+        {
+            if (output_index >= output_count)
+                throw std::out_of_range("Output index out of range");
+            else
+                return lowering->GateOf(model.outputs[output_index]).output;
         }
         void TranslateCoords(int64_t x, int64_t y, int64_t z)
         {
@@ -607,32 +1383,479 @@ class Decoder
         }
 };
 
+/* Decoder with its size fixed at compile time. RuntimeDecoder builds it,
+   this only checks the size and keeps the array-based Model. */
+template <unsigned input_count, unsigned output_count>
+class Decoder
+{
+    static_assert(input_count > 0 && input_count < 32, "Decoder input count out of range");
+    static_assert(output_count > 0 && output_count <= (uint64_t(1) << input_count), "Decoder output count out of range");
+
+    public:
+        struct Model
+        {
+            Netlist::Pin inputs[input_count];
+            Netlist::Pin enable;
+            Netlist::NodeId outputs[output_count];
+        };
+
+    private:
+        RuntimeDecoder decoder;
+
+        static Model Convert(const RuntimeDecoder::Model& built, Netlist::NodeId offset = 0)
+        {
+            Model model;
+            for (unsigned i = 0; i < input_count; i++)
+                model.inputs[i] = Netlist::Pin{built.inputs[i].node + offset, built.inputs[i].index};
+            model.enable = Netlist::Pin{built.enable.node + offset, built.enable.index};
+            for (unsigned i = 0; i < output_count; i++)
+                model.outputs[i] = built.outputs[i] + offset;
+            return model;
+        }
+    public:
+
+        static bool UsesInverted(unsigned input_index, unsigned output_index)
+        {
+            return RuntimeDecoder::UsesInverted(input_index, output_index);
+        }
+        static Model BuildModel(Netlist& netlist, std::string name = "")
+        {
+            return Convert(RuntimeDecoder::BuildModel(netlist, input_count, output_count, name));
+        }
+        static Model BuildPredecodedModel(Netlist& netlist, std::string name = "", unsigned stageWidth = 3)
+        {
+            return Convert(RuntimeDecoder::BuildPredecodedModel(netlist, input_count, output_count, name, stageWidth));
+        }
+
+        /* A release build leaves out the DebugInput timers and the lights */
+        Decoder(std::string name, bool release = false, const DecoderOptions& options = DecoderOptions())
+            : decoder(input_count, output_count, name, release, options) {}
+
+        /* The netlist the decoder was lowered from; GetModel(offset) finds
+           the decoder's pins in a copy appended at `offset` */
+        const Netlist& GetNetlist() const
+        {
+            return decoder.GetNetlist();
+        }
+        Model GetModel(Netlist::NodeId offset = 0) const
+        {
+            return Convert(decoder.GetModel(), offset);
+        }
+        const ToolbarLog& Log() const
+        {
+            return decoder.Log();
+        }
+        Clock* GetClock()
+        {
+            return decoder.GetClock();
+        }
+        unsigned Latency() const
+        {
+            return decoder.Latency();
+        }
+        CubeGrid GetStdMoveCubegrid()
+        {
+            return decoder.GetStdMoveCubegrid();
+        }
+        /* Blocks the decoder toolbars act on that are not in its grid */
+        std::vector<ICubeBlock*> Lights()
+        {
+            return decoder.Lights();
+        }
+        /* Size of the box the decoder's blocks were placed in */
+        Placement::Position Extent() const
+        {
+            return decoder.Extent();
+        }
+        CubeGrid& GetCubegrid()
+        {
+            return decoder.GetCubegrid();
+        }
+        void StreamTo(BlueprintStreamWriter& writer)
+        {
+            decoder.StreamTo(writer);
+        }
+        void HookOutputTo(unsigned output_index, Hook hook)
+        {
+            decoder.HookOutputTo(output_index, hook);
+        }
+        virtual Hook GetHook(unsigned inputIndex)
+        {
+            return decoder.GetHook(inputIndex);
+        }
+        TimerPair& GetOutput(unsigned output_index)
+        {
+            return decoder.GetOutput(output_index);
+        }
+        void TranslateCoords(int64_t x, int64_t y, int64_t z)
+        {
+            decoder.TranslateCoords(x, y, z);
+        }
+};
+
 class Device
 {
     private:
         Blueprint blueprint;
-        Decoder<6,64> decoder6to64[4] = {{"DEC64-0"}, {"DEC64-1"}, {"DEC64-2"}, {"DEC64-3"}};
-        Decoder<2,4> decoder2to4 = {"DEC4-0"};
+        bool release;
+        DecoderOptions options;
+        /* One clock for the registers of every pipelined decoder, in a
+           grid of its own; only built when the decoders are pipelined, so
+           an unpipelined Device has the same blocks as ever */
+        ToolbarLog log;
+        std::unique_ptr<Clock> clock;
+        /* Built the first time they are needed, so StreamXml can build
+           and write one decoder at a time instead */
+        mutable CircuitCubegridManager clockCg;
+        mutable std::unique_ptr<Decoder<6,64>> decoder6to64[4];
+        mutable std::unique_ptr<Decoder<2,4>> decoder2to4;
+        bool wired = false;
+
+        DecoderOptions Clocked() const
+        {
+            DecoderOptions clocked = options;
+            clocked.clock = clock.get();
+            return clocked;
+        }
+        static std::string DecoderName(unsigned index)
+        {
+            return "DEC64-" + std::to_string(index);
+        }
+        /* Each decoder records into its own log and name table, so they
+           are built on up to `threads` threads. The clock of a pipelined
+           Device is shared by all of them, and it is built on one. */
+        void Build(unsigned threads = 1) const
+        {
+            if (decoder2to4)
+                return;
+            ParallelFor(5, [this](std::size_t i)
+            {
+                if (i < 4)
+                    decoder6to64[i].reset(new Decoder<6,64>(DecoderName(static_cast<unsigned>(i)), release, Clocked()));
+                else decoder2to4.reset(new Decoder<2,4>("DEC4-0", release, Clocked()));
+            }, clock ? 1 : threads);
+            if (clock && clock->size())
+            {
+                clockCg.AddClock(*clock);
+                clockCg.Place();
+            }
+        }
     public:
+        /* A release build has no DebugInput timers and no lights; every
+           decoder is built with `options` */
+        Device(bool _release = false, const DecoderOptions& _options = DecoderOptions())
+            : release(_release), options(_options),
+              clock(_options.stageHops ? new Clock("CLOCK DEVICE", log) : nullptr), clockCg(log) {}
+
+        bool Pipelined() const
+        {
+            this->Build();
+            return clock && clock->size() > 0;
+        }
+        /* The clock of a pipelined Device, nullptr otherwise */
+        Clock* GetClock()
+        {
+            return Pipelined() ? clock.get() : nullptr;
+        }
+        /* Clock pulses from the selector's and decoders' inputs to the
+           decoder outputs */
+        unsigned Latency() const
+        {
+            this->Build();
+            return decoder2to4->Latency() + decoder6to64[0]->Latency();
+        }
 
-        void BuildXml()
+        struct Model
+        {
+            Decoder<2,4>::Model selector;
+            Decoder<6,64>::Model decoders[4];
+        };
+
+        /* Netlist of the decoders as they were built, hooked the way Wire()
+           hooks them */
+        Model BuildModel(Netlist& netlist) const
+        {
+            this->Build();
+            Model model;
+            model.selector = decoder2to4->GetModel(netlist.Append(decoder2to4->GetNetlist()));
+            for (unsigned i = 0; i < 4; i++)
+            {
+                model.decoders[i] = decoder6to64[i]->GetModel(netlist.Append(decoder6to64[i]->GetNetlist()));
+                netlist.Connect(model.selector.outputs[i], model.decoders[i].enable);
+            }
+            return model;
+        }
+
+        void Wire()
+        {
+            this->Build();
+            if (wired)
+                return;
+            for (unsigned i = 0; i < 4; i++)
+                decoder2to4->HookOutputTo(i, decoder6to64[i]->GetHook(6));
+            wired = true;
+        }
+        Decoder<6,64>& GetDecoder6to64(unsigned index)
+        {
+            if (index >= 4)
+                throw std::out_of_range("Decoder index out of range");
+            this->Build();
+            return *decoder6to64[index];
+        }
+        Decoder<2,4>& GetDecoder2to4()
+        {
+            this->Build();
+            return *decoder2to4;
+        }
+        /* The wired selector and decoder grids, and the clock's, for
+           TimerSimulator */
+        std::vector<CubeGrid*> GetCubegrids()
+        {
+            this->Wire();
+            std::vector<CubeGrid*> cubegrids(1, &decoder2to4->GetCubegrid());
+            for (unsigned i = 0; i < 4; i++)
+                cubegrids.push_back(&decoder6to64[i]->GetCubegrid());
+            if (Pipelined())
+                cubegrids.push_back(&clockCg.GetCubegrid());
+            return cubegrids;
+        }
+        /* The selector's, decoders' and clock's logs, for TimerSimulator */
+        std::vector<const ToolbarLog*> Logs() const
+        {
+            this->Build();
+            std::vector<const ToolbarLog*> logs(1, &decoder2to4->Log());
+            for (unsigned i = 0; i < 4; i++)
+                logs.push_back(&decoder6to64[i]->Log());
+            logs.push_back(&log);
+            return logs;
+        }
+        /* Every writer prints through a Sink opened on `path`: a plain file
+           by default, GzipFileSink from compression.h for a gzipped one. A
+           Sink is a streambuf constructed from the path, with is_open() and
+           a Close() that tells whether everything was written. */
+        template <typename Sink = BufferedFileSink> void BuildXml(const std::string& path = "bp.sbc")
         {
             //decoder6to64.TranslateCoords();
+            this->Wire();
+            // placed decoders are boxes several layers deep, stack them without overlap
+            int64_t z = decoder2to4->Extent().z;
             for (unsigned i = 0; i < 4; i++)
             {
-                decoder2to4.HookOutputTo(i, decoder6to64[i].GetHook(6));
-                decoder2to4.GetCubegrid().AttachCubegrid(decoder6to64[i].GetStdMoveCubegrid(), 0, 0, i+1);
+                int64_t depth = decoder6to64[i]->Extent().z;
+                decoder2to4->GetCubegrid().AttachCubegrid(decoder6to64[i]->GetStdMoveCubegrid(), 0, 0, z);
+                z += depth;
             }
+            if (Pipelined())
+                decoder2to4->GetCubegrid().AttachCubegrid(clockCg.GetStdMoveCubegrid(), 0, 0, z);
 
 
-            blueprint.Cubegrids.push_back(decoder2to4.GetStdMoveCubegrid());
+            blueprint.Cubegrids.push_back(decoder2to4->GetStdMoveCubegrid());
             //for (unsigned i = 0; i < 4; i++)
             //    blueprint.Cubegrids.push_back(decoder6to64[i].GetStdMoveCubegrid());
             std::cout<<"Writing to file..."<<std::endl;
-            std::fstream output("bp.sbc", std::fstream::out);
-            if (output.is_open())
-                blueprint.Print(output, false);
-            else std::cout<<"Error writing to file"<<std::endl;
+            std::unique_ptr<Sink> output = OpenOutput<Sink>(path);
+            if (output)
+            {
+                std::ostream stream(output.get());
+                blueprint.Print(stream, false);
+                CloseOutput(*output, path);
+            }
+        }
+        /* The blueprint BuildXml writes, built and written one module at a
+           time so only one decoder exists at once. The selector is built
+           first, hooked to Ports, and kept as a Fragment. Each decoder is
+           then built, printed into a SpoolFile and destroyed. Last the
+           selector is written with its ports linked to the decoders' enable
+           inputs, and the spooled decoders are merged in after it. The
+           selector's EntityIds are handed out after the decoders' ones.
+           A Device whose decoders were already built, or a pipelined one
+           whose clock reaches into every decoder, is written from its
+           finished grids instead. */
+        template <typename Sink = BufferedFileSink> void StreamXml(const std::string& path = "bp.sbc")
+        {
+            if (decoder2to4 || options.stageHops)
+            {
+                this->StreamBuiltXml<Sink>(path);
+                return;
+            }
+            Fragment selectorFragment = BuildSelectorFragment(release, options);
+            Fragment::Instance selectorInstance;
+            SpoolFile decoders;
+            EntityId lastId = 0;
+            {
+                BlueprintStreamWriter writer(&decoders, true);
+                int64_t z = selectorFragment.Extent().z;
+                for (unsigned i = 0; i < 4; i++)
+                {
+                    std::unique_ptr<Decoder<6,64>> decoder(new Decoder<6,64>(DecoderName(i), release, options));
+                    Hook enable = decoder->GetHook(6);
+                    selectorInstance.links.push_back(enable.input.GetHookLow());
+                    selectorInstance.links.push_back(enable.input.GetHookHigh());
+                    selectorInstance.links.push_back(enable.updater.GetEntityId());
+                    decoder->TranslateCoords(0, 0, z);
+                    z += decoder->Extent().z;
+                    CubeGrid cubegrid = decoder->GetStdMoveCubegrid();
+                    for (std::size_t j = 0; j < cubegrid.blocks.size(); j++)
+                        lastId = std::max(lastId, cubegrid.blocks[j]->GetEntityId());
+                    for (ICubeBlock* light : decoder->Lights())
+                        lastId = std::max(lastId, light->GetEntityId());
+                    writer.Write(std::move(cubegrid));
+                }
+                writer.Finish();
+            }
+            selectorInstance.firstId = lastId + 1;
+
+            std::cout<<"Writing to file..."<<std::endl;
+            std::unique_ptr<Sink> output = OpenOutput<Sink>(path);
+            if (!output)
+                return;
+            BlueprintStreamWriter writer(output.get(), true);
+            writer.Write(selectorFragment, selectorInstance);
+            writer.Write(decoders);
+            writer.Finish();
+            CloseOutput(*output, path);
+        }
+        /* StreamXml on several threads: the decoders of a Device not built
+           yet are constructed concurrently, then hooked together, and the
+           finished grids are printed by a work queue that writes each one as
+           soon as those before it are out. EntityIds come out in whichever
+           order the decoders are built in. */
+        template <typename Sink = BufferedFileSink>
+        void ParallelStreamXml(unsigned threads = DefaultThreadCount(), const std::string& path = "bp.sbc")
+        {
+            this->Build(threads);
+            this->Wire();
+            std::vector<CubeGrid> cubegrids;
+            int64_t z = decoder2to4->Extent().z;
+            cubegrids.push_back(decoder2to4->GetStdMoveCubegrid());
+            for (unsigned i = 0; i < 4; i++)
+            {
+                decoder6to64[i]->TranslateCoords(0, 0, z);
+                z += decoder6to64[i]->Extent().z;
+                cubegrids.push_back(decoder6to64[i]->GetStdMoveCubegrid());
+            }
+            if (Pipelined())
+            {
+                clockCg.TranslateCoords(0, 0, z);
+                cubegrids.push_back(clockCg.GetStdMoveCubegrid());
+            }
+            std::cout<<"Writing to file..."<<std::endl;
+            std::unique_ptr<Sink> output = OpenOutput<Sink>(path);
+            if (!output)
+                return;
+            BlueprintStreamWriter writer(output.get(), true);
+            writer.Write(std::move(cubegrids), threads);
+            writer.Finish();
+            CloseOutput(*output, path);
+        }
+        /* Same blueprint as StreamXml from one serialized 6-to-64 decoder:
+           a single decoder is built, becomes a Fragment and is written four
+           times with its name, EntityIds and position patched. A separate
+           selector is hooked to Ports that each copy links to its own enable
+           input. Static, so no Device and its four decoders are built. */
+        template <typename Sink = BufferedFileSink>
+        static void StreamInstancedXml(bool release = false, const std::string& path = "bp.sbc")
+        {
+            std::unique_ptr<Decoder<6,64>> decoder(new Decoder<6,64>("DEC64-0", release));
+            StreamCopies<Sink>(BuildSelectorFragment(release), BuildDecoderFragment(*decoder), path);
+        }
+        /* StreamInstancedXml with both fragments taken from `cache` while
+           everything that shapes them is unchanged; only a module whose key
+           changed is built. EntityIds are handed out from 1 in output order,
+           so the file comes out the same whether a fragment was cached or
+           not. Defined in cache.h, include it to use this. */
+        template <typename Sink = BufferedFileSink>
+        static void StreamCachedXml(FragmentCache& cache, bool release = false, const std::string& path = "bp.sbc");
+
+    private:
+        /* A Sink writing to `path`, nullptr when it can't be opened */
+        template <typename Sink> static std::unique_ptr<Sink> OpenOutput(const std::string& path)
+        {
+            std::unique_ptr<Sink> sink(new Sink(path));
+            if (sink->is_open())
+                return sink;
+            std::cout<<"Error writing to "<<path<<std::endl;
+            return nullptr;
+        }
+        /* StreamXml for a Device whose decoders exist: each finished grid is
+           printed and merged into the selector's grid on the way out */
+        template <typename Sink> void StreamBuiltXml(const std::string& path)
+        {
+            this->Wire();
+            std::cout<<"Writing to file..."<<std::endl;
+            std::unique_ptr<Sink> output = OpenOutput<Sink>(path);
+            if (!output)
+                return;
+            BlueprintStreamWriter writer(output.get(), true);
+            int64_t z = decoder2to4->Extent().z;
+            decoder2to4->StreamTo(writer);
+            for (unsigned i = 0; i < 4; i++)
+            {
+                decoder6to64[i]->TranslateCoords(0, 0, z);
+                z += decoder6to64[i]->Extent().z;
+                decoder6to64[i]->StreamTo(writer);
+            }
+            if (Pipelined())
+            {
+                clockCg.TranslateCoords(0, 0, z);
+                clockCg.StreamTo(writer);
+            }
+            writer.Finish();
+            CloseOutput(*output, path);
+        }
+        /* Reports a file that was not written completely */
+        template <typename Sink> static void CloseOutput(Sink& output, const std::string& path)
+        {
+            if (!output.Close())
+                std::cout<<"Error writing to "<<path<<std::endl;
+        }
+        static Fragment BuildSelectorFragment(bool release, const DecoderOptions& options = DecoderOptions())
+        {
+            Decoder<2,4> selector("DEC4-0", release, options);
+            Port ports[4];
+            std::vector<EntityId> portIds;
+            for (unsigned i = 0; i < 4; i++)
+            {
+                selector.HookOutputTo(i, ports[i].GetHook());
+                std::vector<EntityId> ids = ports[i].Ids();
+                portIds.insert(portIds.end(), ids.begin(), ids.end());
+            }
+            return Fragment(selector.GetCubegrid(), "", portIds, selector.Lights());
+        }
+        static Fragment BuildDecoderFragment(Decoder<6,64>& decoder)
+        {
+            Fragment fragment(decoder.GetCubegrid(), "DEC64-0", {}, decoder.Lights());
+            ExportHook(fragment, "enable", decoder.GetHook(6));
+            return fragment;
+        }
+        /* The selector and the four decoder copies stacked above it, merged
+           into one grid like BuildXml */
+        template <typename Sink>
+        static void StreamCopies(const Fragment& selectorFragment, const Fragment& decoderFragment, const std::string& path)
+        {
+            Fragment::Instance selectorInstance;
+            EntityId nextId = selectorInstance.firstId + selectorFragment.IdCount();
+            int64_t z = selectorFragment.Extent().z;
+            Fragment::Instance decoders[4];
+            for (unsigned i = 0; i < 4; i++)
+            {
+                decoders[i].name = "DEC64-"+std::to_string(i);
+                decoders[i].z = z;
+                decoders[i].firstId = nextId;
+                nextId += decoderFragment.IdCount();
+                z += decoderFragment.Extent().z;
+                Port::Link(selectorInstance, 3 * i, decoderFragment, decoders[i], "enable");
+            }
+
+            std::cout<<"Writing to file..."<<std::endl;
+            std::unique_ptr<Sink> output = OpenOutput<Sink>(path);
+            if (!output)
+                return;
+            BlueprintStreamWriter writer(output.get(), true);
+            writer.Write(selectorFragment, selectorInstance);
+            writer.Write(decoderFragment, std::vector<Fragment::Instance>(decoders, decoders + 4));
+            writer.Finish();
+            CloseOutput(*output, path);
         }
 };
 
@@ -0,0 +1,658 @@
+#ifndef H_IMPORT
+#define H_IMPORT
+
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "netlist.h"
+#include "lowering.h"
+#include "blueprintstream.h"
+
+/* A netlist read from a synthesis tool. Each primary input is an INPUT pin
+   feeding an InputGate, which lowering leaves open to be hooked from
+   outside; every signal name maps to the node driving it. */
+struct ImportedNetlist
+{
+    std::string name;
+    Netlist netlist;
+    std::unordered_map<std::string, Netlist::NodeId> signals;
+
+    Netlist::NodeId Signal(const std::string& signal) const
+    {
+        auto it = signals.find(signal);
+        if (it == signals.end())
+            throw std::out_of_range("No signal named " + signal);
+        return it->second;
+    }
+};
+
+/* Shared by the readers: gates are added as they are read, pins whose
+   driver has not been seen yet are remembered and connected by Finish(),
+   so a netlist is read in one pass whatever order it lists its gates in */
+class NetlistImport
+{
+    public:
+        typedef Netlist::NodeId NodeId;
+        typedef uint32_t SignalId;
+
+        /* Either a node built here or a signal by name */
+        struct Operand
+        {
+            NodeId node;
+            SignalId signal;
+        };
+
+    private:
+        struct PendingPin
+        {
+            Netlist::Pin pin;
+            SignalId signal;
+        };
+
+        ImportedNetlist result;
+        std::unordered_map<std::string, SignalId> ids;
+        std::vector<std::string> names;
+        std::vector<NodeId> driverOf;
+        std::vector<NodeId> notOf;
+        std::vector<PendingPin> pending;
+        std::vector<SignalId> outputs;
+        const char* format;
+        std::size_t line = 0;
+
+    public:
+        NetlistImport(const char* _format) : format(_format) {}
+
+        [[noreturn]] void Fail(const std::string& message) const
+        {
+            throw std::runtime_error(std::string(format) + " line " + std::to_string(line) + ": " + message);
+        }
+        void SetLine(std::size_t _line)
+        {
+            line = _line;
+        }
+        void SetName(const std::string& name)
+        {
+            result.name = name;
+        }
+
+        SignalId Intern(const std::string& name)
+        {
+            auto inserted = ids.emplace(name, static_cast<SignalId>(names.size()));
+            if (inserted.second)
+            {
+                names.push_back(name);
+                driverOf.push_back(Netlist::NONE);
+                notOf.push_back(Netlist::NONE);
+            }
+            return inserted.first->second;
+        }
+        static Operand Node(NodeId node)
+        {
+            return Operand{node, 0};
+        }
+        Operand Signal(const std::string& name)
+        {
+            return Operand{Netlist::NONE, Intern(name)};
+        }
+
+        NodeId AddGate(Netlist::KIND kind, unsigned pinCount)
+        {
+            return result.netlist.AddNode(kind, pinCount);
+        }
+        void Connect(Operand source, Netlist::Pin pin)
+        {
+            if (source.node != Netlist::NONE)
+                result.netlist.Connect(source.node, pin);
+            else pending.push_back(PendingPin{pin, source.signal});
+        }
+        /* Negation of a signal is built once however often it is used */
+        Operand Not(Operand source)
+        {
+            if (source.node == Netlist::NONE && notOf[source.signal] != Netlist::NONE)
+                return Node(notOf[source.signal]);
+            NodeId gate = AddGate(Netlist::NOT, 1);
+            Connect(source, Netlist::Pin{gate, 0});
+            if (source.node == Netlist::NONE)
+            {
+                notOf[source.signal] = gate;
+                result.netlist.SetLabel(gate, " ~" + names[source.signal]);
+            }
+            return Node(gate);
+        }
+        /* AND/OR over the operands; a single operand is passed through */
+        Operand Combine(Netlist::KIND kind, const std::vector<Operand>& operands)
+        {
+            if (operands.empty())
+                Fail("gate without inputs");
+            if (operands.size() == 1)
+                return operands[0];
+            NodeId gate = AddGate(kind, static_cast<unsigned>(operands.size()));
+            for (unsigned i = 0; i < operands.size(); ++i)
+                Connect(operands[i], Netlist::Pin{gate, i});
+            return Node(gate);
+        }
+
+        /* `value` drives the signal; a plain signal gets a buffer of its own */
+        void Define(const std::string& name, Operand value)
+        {
+            SignalId signal = Intern(name);
+            if (driverOf[signal] != Netlist::NONE)
+                Fail("signal " + name + " has more than one driver");
+            if (value.node == Netlist::NONE)
+            {
+                NodeId buffer = AddGate(Netlist::BUFFER, 1);
+                Connect(value, Netlist::Pin{buffer, 0});
+                value = Node(buffer);
+            }
+            driverOf[signal] = value.node;
+            result.netlist.SetLabel(value.node, " " + name);
+        }
+        void DefineInput(const std::string& name)
+        {
+            SignalId signal = Intern(name);
+            if (driverOf[signal] != Netlist::NONE)
+                Fail("signal " + name + " has more than one driver");
+            driverOf[signal] = AddGate(Netlist::BUFFER, 1);
+            result.netlist.Connect(result.netlist.AddInput(), driverOf[signal], 0);
+            result.netlist.SetLabel(driverOf[signal], " " + name);
+        }
+        void DefineOutput(const std::string& name)
+        {
+            outputs.push_back(Intern(name));
+        }
+
+        ImportedNetlist Finish()
+        {
+            for (const PendingPin& use : pending)
+            {
+                if (driverOf[use.signal] == Netlist::NONE)
+                    throw std::runtime_error(std::string(format) + ": signal " + names[use.signal] + " has no driver");
+                result.netlist.Connect(driverOf[use.signal], use.pin);
+            }
+            for (SignalId signal : outputs)
+            {
+                if (driverOf[signal] == Netlist::NONE)
+                    throw std::runtime_error(std::string(format) + ": output " + names[signal] + " has no driver");
+                result.netlist.MarkOutput(driverOf[signal]);
+            }
+            result.signals.reserve(names.size());
+            for (SignalId signal = 0; signal < names.size(); ++signal)
+                if (driverOf[signal] != Netlist::NONE)
+                    result.signals.emplace(names[signal], driverOf[signal]);
+            return std::move(result);
+        }
+};
+
+/* Berkeley Logic Interchange Format, combinational subset: one .model with
+   .inputs, .outputs and .names covers. A cover becomes an OR of ANDs over
+   the row literals, complemented when it lists the off-set. Constant
+   covers, latches and subcircuits have no gate to map to and are refused. */
+inline ImportedNetlist ReadBlif(std::istream& input)
+{
+    NetlistImport import("BLIF");
+    std::vector<std::string> coverSignals;
+    std::vector<std::string> rows;
+    bool inCover = false;
+    std::size_t coverLine = 0;
+    bool sawModel = false;
+    bool ended = false;
+
+    auto finishCover = [&]()
+    {
+        if (!inCover)
+            return;
+        inCover = false;
+        import.SetLine(coverLine);
+        std::size_t inputs = coverSignals.size() - 1;
+        if (rows.empty())
+            import.Fail("constant cover for " + coverSignals.back() + " is not supported");
+        char onSet = rows[0].back();
+        std::vector<NetlistImport::Operand> terms;
+        for (const std::string& row : rows)
+        {
+            if (row.back() != onSet)
+                import.Fail("cover for " + coverSignals.back() + " mixes on-set and off-set rows");
+            std::vector<NetlistImport::Operand> literals;
+            for (std::size_t i = 0; i < inputs; ++i)
+            {
+                if (row[i] == '1')
+                    literals.push_back(import.Signal(coverSignals[i]));
+                else if (row[i] == '0')
+                    literals.push_back(import.Not(import.Signal(coverSignals[i])));
+            }
+            if (literals.empty())
+                import.Fail("constant cover for " + coverSignals.back() + " is not supported");
+            terms.push_back(import.Combine(Netlist::AND, literals));
+        }
+        NetlistImport::Operand value = import.Combine(Netlist::OR, terms);
+        import.Define(coverSignals.back(), onSet == '0' ? import.Not(value) : value);
+        rows.clear();
+    };
+
+    std::string text;
+    std::string logical;
+    std::size_t number = 0;
+    std::size_t start = 0;
+    while (!ended && std::getline(input, text))
+    {
+        ++number;
+        std::size_t comment = text.find('#');
+        if (comment != std::string::npos)
+            text.erase(comment);
+        if (logical.empty())
+            start = number;
+        logical += text;
+        // a trailing backslash continues the line
+        std::size_t last = logical.find_last_not_of(" \t\r");
+        if (last != std::string::npos && logical[last] == '\\')
+        {
+            logical.erase(last);
+            logical += ' ';
+            continue;
+        }
+        import.SetLine(start);
+
+        std::vector<std::string> tokens;
+        std::size_t i = 0;
+        while (i < logical.size())
+        {
+            while (i < logical.size() && std::isspace(static_cast<unsigned char>(logical[i])))
+                ++i;
+            std::size_t begin = i;
+            while (i < logical.size() && !std::isspace(static_cast<unsigned char>(logical[i])))
+                ++i;
+            if (i > begin)
+                tokens.emplace_back(logical, begin, i - begin);
+        }
+        logical.clear();
+        if (tokens.empty())
+            continue;
+
+        const std::string& keyword = tokens[0];
+        if (keyword[0] != '.')
+        {
+            if (!inCover)
+                import.Fail("cover row outside .names");
+            std::string row;
+            if (coverSignals.size() == 1 && tokens.size() == 1)
+                row = tokens[0];
+            else if (tokens.size() == 2 && tokens[0].size() == coverSignals.size() - 1)
+                row = tokens[0] + tokens[1];
+            else import.Fail("cover row does not match .names");
+            if (row.back() != '0' && row.back() != '1')
+                import.Fail("cover output must be 0 or 1");
+            for (std::size_t j = 0; j + 1 < row.size(); ++j)
+                if (row[j] != '0' && row[j] != '1' && row[j] != '-')
+                    import.Fail("cover literal must be 0, 1 or -");
+            rows.push_back(row);
+            continue;
+        }
+
+        finishCover();
+        if (keyword == ".model")
+        {
+            if (sawModel)
+                import.Fail("hierarchical BLIF is not supported");
+            sawModel = true;
+            if (tokens.size() > 1)
+                import.SetName(tokens[1]);
+        }
+        else if (keyword == ".inputs")
+        {
+            for (std::size_t j = 1; j < tokens.size(); ++j)
+                import.DefineInput(tokens[j]);
+        }
+        else if (keyword == ".outputs")
+        {
+            for (std::size_t j = 1; j < tokens.size(); ++j)
+                import.DefineOutput(tokens[j]);
+        }
+        else if (keyword == ".names")
+        {
+            if (tokens.size() < 2)
+                import.Fail(".names without an output");
+            coverSignals.assign(tokens.begin() + 1, tokens.end());
+            coverLine = start;
+            inCover = true;
+        }
+        else if (keyword == ".end")
+            ended = true;
+        else import.Fail(keyword + " is not supported");
+    }
+    finishCover();
+    return import.Finish();
+}
+
+/* Gate-level Verilog: one module with input/output/wire declarations
+   (bit ranges expand to name[i] signals), the primitives and, or, nand,
+   nor, xor, xnor, not and buf, and assign of a signal or its negation */
+inline ImportedNetlist ReadVerilog(std::istream& input)
+{
+    NetlistImport import("Verilog");
+    std::size_t number = 1;
+
+    // next token: identifier (with its bit select folded in), number or punctuation
+    auto next = [&](std::string& token) -> bool
+    {
+        token.clear();
+        int c;
+        while (true)
+        {
+            c = input.get();
+            if (c == EOF)
+                return false;
+            if (c == '\n')
+                ++number;
+            if (std::isspace(c))
+                continue;
+            if (c == '/' && input.peek() == '/')
+            {
+                while ((c = input.get()) != EOF && c != '\n') {}
+                ++number;
+                continue;
+            }
+            if (c == '/' && input.peek() == '*')
+            {
+                input.get();
+                int previous = 0;
+                while ((c = input.get()) != EOF && !(previous == '*' && c == '/'))
+                {
+                    if (c == '\n')
+                        ++number;
+                    previous = c;
+                }
+                continue;
+            }
+            break;
+        }
+        import.SetLine(number);
+        if (c == '\\')
+        {
+            // escaped identifier, ends at whitespace
+            while ((c = input.peek()) != EOF && !std::isspace(c))
+                token.push_back(static_cast<char>(input.get()));
+            return true;
+        }
+        token.push_back(static_cast<char>(c));
+        if (std::isalnum(c) || c == '_' || c == '$' || c == '\'')
+            while ((c = input.peek()) != EOF && (std::isalnum(c) || c == '_' || c == '$' || c == '\''))
+                token.push_back(static_cast<char>(input.get()));
+        return true;
+    };
+
+    std::vector<std::string> tokens;
+    std::size_t position = 0;
+    auto peek = [&]() -> const std::string&
+    {
+        static const std::string end;
+        return position < tokens.size() ? tokens[position] : end;
+    };
+    auto take = [&]() -> std::string
+    {
+        if (position >= tokens.size())
+            import.Fail("unexpected end of statement");
+        return tokens[position++];
+    };
+    auto expect = [&](const char* token)
+    {
+        if (take() != token)
+            import.Fail(std::string("expected ") + token);
+    };
+    auto isIdentifier = [](const std::string& token)
+    {
+        return !token.empty() && (std::isalpha(static_cast<unsigned char>(token[0])) || token[0] == '_');
+    };
+    auto parseNumber = [&](const std::string& token) -> long
+    {
+        if (token.empty() || !std::isdigit(static_cast<unsigned char>(token[0])))
+            import.Fail("expected a number, got " + token);
+        if (token.find('\'') != std::string::npos)
+            import.Fail("constant " + token + " is not supported");
+        return std::stol(token);
+    };
+    // a signal reference: name or name[bit]
+    auto signal = [&]() -> std::string
+    {
+        std::string name = take();
+        if (!isIdentifier(name))
+        {
+            if (!name.empty() && std::isdigit(static_cast<unsigned char>(name[0])))
+                import.Fail("constant " + name + " is not supported");
+            import.Fail("expected a signal, got " + name);
+        }
+        if (peek() == "[")
+        {
+            take();
+            long bit = parseNumber(take());
+            expect("]");
+            name += "[" + std::to_string(bit) + "]";
+        }
+        return name;
+    };
+    // input/output/wire list, an optional [msb:lsb] range applies to the names after it
+    enum DIRECTION {INPUT, OUTPUT, WIRE};
+    auto declare = [&](DIRECTION direction, bool stopAtKeyword)
+    {
+        long msb = -1, lsb = -1;
+        if (peek() == "wire")
+            take();
+        if (peek() == "[")
+        {
+            take();
+            msb = parseNumber(take());
+            expect(":");
+            lsb = parseNumber(take());
+            expect("]");
+        }
+        while (position < tokens.size())
+        {
+            if (stopAtKeyword && (peek() == "input" || peek() == "output" || peek() == "inout"))
+                return;
+            if (peek() == "wire")
+            {
+                take();
+                continue;
+            }
+            std::string name = take();
+            if (!isIdentifier(name))
+                import.Fail("expected a name, got " + name);
+            std::vector<std::string> bits;
+            if (msb < 0)
+                bits.push_back(name);
+            else for (long bit = msb; ; bit += msb > lsb ? -1 : 1)
+            {
+                bits.push_back(name + "[" + std::to_string(bit) + "]");
+                if (bit == lsb)
+                    break;
+            }
+            for (const std::string& bit : bits)
+            {
+                if (direction == INPUT)
+                    import.DefineInput(bit);
+                else if (direction == OUTPUT)
+                    import.DefineOutput(bit);
+            }
+            if (position < tokens.size())
+                expect(",");
+        }
+    };
+
+    bool inModule = false;
+    bool sawModule = false;
+    std::string token;
+    while (true)
+    {
+        tokens.clear();
+        position = 0;
+        bool more;
+        while ((more = next(token)) && token != ";" && token != "endmodule")
+            tokens.push_back(token);
+        if (more && token == "endmodule")
+        {
+            if (!tokens.empty())
+                import.Fail("expected ;");
+            if (!inModule)
+                import.Fail("endmodule outside a module");
+            inModule = false;
+            continue;
+        }
+        if (!more)
+        {
+            if (!tokens.empty() || inModule)
+                import.Fail("unexpected end of file");
+            break;
+        }
+        if (tokens.empty())
+            continue;
+
+        std::string keyword = take();
+        if (keyword == "module")
+        {
+            if (sawModule)
+                import.Fail("hierarchical Verilog is not supported");
+            sawModule = inModule = true;
+            import.SetName(take());
+            if (peek() == "(")
+            {
+                take();
+                // ANSI headers declare their ports here, plain headers only list them
+                if (tokens.back() != ")")
+                    import.Fail("expected )");
+                tokens.pop_back();
+                while (position < tokens.size())
+                {
+                    std::string port = take();
+                    if (port == "input")
+                        declare(INPUT, true);
+                    else if (port == "output")
+                        declare(OUTPUT, true);
+                    else if (port == "inout")
+                        import.Fail("inout ports are not supported");
+                    else if (!isIdentifier(port) && port != ",")
+                        import.Fail("unexpected " + port + " in port list");
+                }
+            }
+            continue;
+        }
+        if (!inModule)
+            import.Fail("statement outside a module");
+
+        if (keyword == "input")
+            declare(INPUT, false);
+        else if (keyword == "output")
+            declare(OUTPUT, false);
+        else if (keyword == "wire")
+            declare(WIRE, false);
+        else if (keyword == "assign")
+        {
+            std::string target = signal();
+            expect("=");
+            bool negated = peek() == "~" || peek() == "!";
+            if (negated)
+                take();
+            NetlistImport::Operand value = import.Signal(signal());
+            if (position != tokens.size())
+                import.Fail("only assign of a signal or its negation is supported");
+            import.Define(target, negated ? import.Not(value) : value);
+        }
+        else if (keyword == "and" || keyword == "or" || keyword == "nand" || keyword == "nor" ||
+                 keyword == "xor" || keyword == "xnor" || keyword == "not" || keyword == "buf")
+        {
+            if (peek() == "#")
+            {
+                take();
+                take();
+            }
+            // one or more instances: [name] (out, in, ...) separated by commas
+            while (true)
+            {
+                if (isIdentifier(peek()))
+                    take();
+                expect("(");
+                std::string output = signal();
+                std::vector<NetlistImport::Operand> operands;
+                while (peek() == ",")
+                {
+                    take();
+                    operands.push_back(import.Signal(signal()));
+                }
+                expect(")");
+
+                bool invert = keyword == "nand" || keyword == "nor" || keyword == "xnor" || keyword == "not";
+                NetlistImport::Operand value;
+                if (keyword == "not" || keyword == "buf")
+                {
+                    if (operands.size() != 1)
+                        import.Fail(keyword + " takes exactly one input");
+                    value = operands[0];
+                }
+                else if (operands.size() < 2)
+                    import.Fail(keyword + " takes at least two inputs");
+                else if (keyword == "xor" || keyword == "xnor")
+                {
+                    // chained two-input parity: (a & ~b) | (~a & b)
+                    value = operands[0];
+                    for (std::size_t i = 1; i < operands.size(); ++i)
+                    {
+                        NetlistImport::Operand left = import.Combine(Netlist::AND, {value, import.Not(operands[i])});
+                        NetlistImport::Operand right = import.Combine(Netlist::AND, {import.Not(value), operands[i]});
+                        value = import.Combine(Netlist::OR, {left, right});
+                    }
+                }
+                else value = import.Combine(keyword == "and" || keyword == "nand" ? Netlist::AND : Netlist::OR, operands);
+                import.Define(output, invert ? import.Not(value) : value);
+
+                if (position == tokens.size())
+                    break;
+                expect(",");
+            }
+        }
+        else import.Fail(keyword + " is not supported");
+    }
+    if (!sawModule)
+        import.Fail("no module found");
+    return import.Finish();
+}
+
+/* Picks the reader by extension: .blif, otherwise Verilog */
+inline ImportedNetlist ReadNetlist(const std::string& path)
+{
+    std::ifstream input(path);
+    if (!input.is_open())
+        throw std::runtime_error("Could not open " + path);
+    std::string extension = path.size() >= 5 ? path.substr(path.size() - 5) : "";
+    for (char& c : extension)
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return extension == ".blif" ? ReadBlif(input) : ReadVerilog(input);
+}
+
+/* Lowers an imported netlist into one grid and streams it to `path`:
+   duplicate gates and logic no output depends on are removed, gates wider
+   than the toolbar allows are split, the grid is packed by Placement and
+   printed straight into the file. Returns bytes written. */
+inline std::size_t WriteNetlistBlueprint(const Netlist& netlist, const std::string& path,
+                                         const ToolbarStrategy& strategy = ToolbarStrategy())
+{
+    NetlistRewrite narrow = DecomposeFanin(Reduce(netlist).netlist, strategy.MaxGateInputs());
+    CircuitArena arena;
+    NetlistLowering lowering(narrow.netlist, "", &arena, &strategy);
+    CircuitCubegridManager manager;
+    lowering.Emit(manager);
+    manager.Place();
+
+    BufferedFileSink sink(path);
+    if (!sink.is_open())
+        throw std::runtime_error("Could not write " + path);
+    BlueprintStreamWriter writer(&sink);
+    manager.StreamTo(writer);
+    writer.Finish();
+    return sink.BytesWritten();
+}
+
+#endif // H_IMPORT
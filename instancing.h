@@ -0,0 +1,407 @@
+#ifndef H_INSTANCING
+#define H_INSTANCING
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "blueprintlib/blueprint.h"
+#include "blueprintlib/blocks.h"
+
+/* A grid serialized once and written out any number of times, each copy
+   with its own name, EntityIds and position. The holes to patch are found
+   without knowing the XML layout: the grid is printed twice, the second
+   time shifted by a distinct offset per axis, so every number that moved is
+   a coordinate; the content of an EntityId element or of a toolbar slot's
+   BlockEntityId is an id, and the marker (the name the grid was built with)
+   is a name where it is a whole word inside a name element: a block's
+   CustomName, a group's Name or the GroupName of a toolbar slot. Other
+   numbers and text are left alone even when they happen to match.
+   EntityIds of blocks outside the grid that it refers to (ports) are linked
+   per copy to other fragments' blocks, found by the names they were
+   exported under. A fragment can be saved and loaded again without the
+   blocks it was made from. */
+class Fragment
+{
+    public:
+        struct Instance
+        {
+            std::string name;
+            int64_t x = 0;
+            int64_t y = 0;
+            int64_t z = 0;
+            /* Ids of this copy are firstId, firstId + 1, ... in grid order */
+            EntityId firstId = 1;
+            /* What the fragment's ports refer to in this copy, in the order
+               the ports were given */
+            std::vector<EntityId> links;
+        };
+        struct Box
+        {
+            int64_t x;
+            int64_t y;
+            int64_t z;
+        };
+
+    private:
+        enum KIND : uint8_t {NAME, ID, PORT, X, Y, Z};
+        enum : int64_t {SHIFT_X = 1000003, SHIFT_Y = 2000003, SHIFT_Z = 3000017};
+
+        struct Hole
+        {
+            std::size_t offset;
+            std::size_t length;
+            KIND kind;
+            uint64_t value;
+        };
+
+        std::string header;
+        std::string body;
+        std::string footer;
+        std::vector<Hole> holes;
+        std::unordered_map<EntityId, uint32_t> ordinals;
+        std::map<std::string, uint32_t> exports;
+        uint32_t idCount = 0;
+        int64_t extent[3] = {0, 0, 0};
+
+        Fragment() {}
+
+        static void WriteNumber(std::ostream& output, uint64_t value)
+        {
+            for (unsigned i = 0; i < 8; ++i)
+                output.put(static_cast<char>((value >> (8 * i)) & 0xFF));
+        }
+        static uint64_t ReadNumber(std::istream& input)
+        {
+            uint64_t value = 0;
+            for (unsigned i = 0; i < 8; ++i)
+                value |= uint64_t(static_cast<unsigned char>(input.get())) << (8 * i);
+            return value;
+        }
+        static void WriteString(std::ostream& output, const std::string& text)
+        {
+            WriteNumber(output, text.size());
+            output.write(text.data(), static_cast<std::streamsize>(text.size()));
+        }
+        /* Bytes left to read, so a size read from a corrupt file can't ask
+           for more memory than the file holds */
+        static uint64_t Remaining(std::istream& input)
+        {
+            std::istream::pos_type position = input.tellg();
+            if (position == std::istream::pos_type(-1) || !input.seekg(0, std::ios::end))
+                throw std::runtime_error("Fragment file can't be measured");
+            std::istream::pos_type end = input.tellg();
+            input.seekg(position);
+            if (end == std::istream::pos_type(-1) || !input)
+                throw std::runtime_error("Fragment file can't be measured");
+            return static_cast<uint64_t>(end - position);
+        }
+        static std::string ReadString(std::istream& input)
+        {
+            uint64_t size = ReadNumber(input);
+            if (!input || size > Remaining(input))
+                throw std::runtime_error("Fragment file is corrupt");
+            std::string text(static_cast<std::size_t>(size), '\0');
+            input.read(&text[0], static_cast<std::streamsize>(size));
+            return text;
+        }
+        static const char* Magic()
+        {
+            return "SEFRAG01";
+        }
+
+        static std::string Print(CubeGrid& cubegrid)
+        {
+            Blueprint single;
+            single.Cubegrids.push_back(std::move(cubegrid));
+            std::ostringstream output;
+            single.Print(output, false);
+            cubegrid = std::move(single.Cubegrids.front());
+            return output.str();
+        }
+        /* Start of a number that is not part of a word */
+        static bool NumberAt(const std::string& text, std::size_t i)
+        {
+            if (i && (std::isalnum(static_cast<unsigned char>(text[i - 1])) || text[i - 1] == '_' || text[i - 1] == '-'))
+                return false;
+            if (text[i] == '-')
+                return i + 1 < text.size() && std::isdigit(static_cast<unsigned char>(text[i + 1]));
+            return std::isdigit(static_cast<unsigned char>(text[i]));
+        }
+        static std::size_t NumberEnd(const std::string& text, std::size_t i)
+        {
+            for (++i; i < text.size() && std::isdigit(static_cast<unsigned char>(text[i])); ++i);
+            return i;
+        }
+
+        /* Whether the number in [begin, end) is all of an EntityId or a
+           BlockEntityId element, the only places ids are written */
+        static bool IdAt(const std::string& text, std::size_t begin, std::size_t end)
+        {
+            for (const char* tag : {"EntityId", "BlockEntityId"})
+            {
+                std::string open = std::string("<") + tag + ">";
+                std::string close = std::string("</") + tag + ">";
+                if (begin >= open.size() && text.compare(begin - open.size(), open.size(), open) == 0
+                    && text.compare(end, close.size(), close) == 0)
+                    return true;
+            }
+            return false;
+        }
+
+        static bool WordCharacter(char c)
+        {
+            return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-';
+        }
+        /* Whether [begin, begin + size) is a whole word in the content of a
+           CustomName, Name or GroupName element */
+        static bool NameAt(const std::string& text, std::size_t begin, std::size_t size)
+        {
+            if ((begin && WordCharacter(text[begin - 1])) || (begin + size < text.size() && WordCharacter(text[begin + size])))
+                return false;
+            std::size_t tag = text.rfind('<', begin);
+            if (tag == std::string::npos)
+                return false;
+            for (const char* open : {"<CustomName>", "<Name>", "<GroupName>"})
+                if (text.compare(tag, std::strlen(open), open) == 0)
+                    return true;
+            return false;
+        }
+
+        void Scan(const std::string& shifted, const std::string& marker, const std::unordered_map<EntityId, uint32_t>& ports)
+        {
+            std::size_t i = 0;
+            std::size_t j = 0;
+            while (i < body.size())
+            {
+                if (!marker.empty() && body.compare(i, marker.size(), marker) == 0 && NameAt(body, i, marker.size()))
+                {
+                    if (shifted.compare(j, marker.size(), marker) != 0)
+                        throw std::logic_error("Grid prints differently when moved");
+                    holes.push_back(Hole{i, marker.size(), NAME, 0});
+                    i += marker.size();
+                    j += marker.size();
+                    continue;
+                }
+                if (NumberAt(body, i))
+                {
+                    std::size_t end = NumberEnd(body, i);
+                    std::size_t shiftedEnd = NumberEnd(shifted, j);
+                    std::string number = body.substr(i, end - i);
+                    int64_t moved = std::strtoll(shifted.c_str() + j, nullptr, 10) - std::strtoll(number.c_str(), nullptr, 10);
+                    if (moved == SHIFT_X || moved == SHIFT_Y || moved == SHIFT_Z)
+                    {
+                        KIND axis = moved == SHIFT_X ? X : moved == SHIFT_Y ? Y : Z;
+                        int64_t coordinate = std::strtoll(number.c_str(), nullptr, 10);
+                        holes.push_back(Hole{i, end - i, axis, static_cast<uint64_t>(coordinate)});
+                        extent[axis - X] = std::max(extent[axis - X], coordinate + 1);
+                    }
+                    else if (number[0] != '-' && IdAt(body, i, end))
+                    {
+                        EntityId id = std::strtoull(number.c_str(), nullptr, 10);
+                        auto ordinal = ordinals.find(id);
+                        if (ordinal != ordinals.end())
+                            holes.push_back(Hole{i, end - i, ID, ordinal->second});
+                        else if (ports.count(id))
+                            holes.push_back(Hole{i, end - i, PORT, ports.at(id)});
+                    }
+                    i = end;
+                    j = shiftedEnd;
+                    continue;
+                }
+                if (j >= shifted.size() || body[i] != shifted[j])
+                    throw std::logic_error("Grid prints differently when moved");
+                ++i;
+                ++j;
+            }
+        }
+
+    public:
+        /* The grid is left as it was; marker is the name its blocks carry,
+           ports the EntityIds of outside blocks it has entries for and owned
+           the blocks kept outside the grid that still belong to every copy
+           (the decoder lights), which get fresh ids like the grid's */
+        Fragment(CubeGrid& cubegrid, const std::string& marker = "", const std::vector<EntityId>& ports = {},
+                 const std::vector<ICubeBlock*>& owned = {})
+        {
+            for (std::size_t i = 0; i < cubegrid.blocks.size(); ++i)
+                ordinals.emplace(cubegrid.blocks[i]->GetEntityId(), static_cast<uint32_t>(ordinals.size()));
+            for (ICubeBlock* block : owned)
+                ordinals.emplace(block->GetEntityId(), static_cast<uint32_t>(ordinals.size()));
+            idCount = static_cast<uint32_t>(ordinals.size());
+            std::string printed = Print(cubegrid);
+            cubegrid.TranslateCoords(SHIFT_X, SHIFT_Y, SHIFT_Z);
+            std::string shifted = Print(cubegrid);
+            cubegrid.TranslateCoords(-SHIFT_X, -SHIFT_Y, -SHIFT_Z);
+
+            const std::string open = "<CubeGrids>";
+            const std::string close = "</CubeGrids>";
+            std::size_t begin = printed.find(open);
+            std::size_t end = printed.rfind(close);
+            std::size_t shiftedBegin = shifted.find(open);
+            if (begin == std::string::npos || end == std::string::npos || shiftedBegin == std::string::npos)
+                throw std::logic_error("Blueprint has no CubeGrids section");
+            begin += open.size();
+            header = printed.substr(0, begin);
+            body = printed.substr(begin, end - begin);
+            footer = printed.substr(end);
+            std::unordered_map<EntityId, uint32_t> portIndex;
+            for (std::size_t i = 0; i < ports.size(); ++i)
+                portIndex.emplace(ports[i], static_cast<uint32_t>(i));
+            Scan(shifted.substr(shiftedBegin + open.size()), marker, portIndex);
+        }
+
+        void Save(std::ostream& output) const
+        {
+            output.write(Magic(), 8);
+            WriteString(output, header);
+            WriteString(output, body);
+            WriteString(output, footer);
+            WriteNumber(output, idCount);
+            for (int64_t size : extent)
+                WriteNumber(output, static_cast<uint64_t>(size));
+            WriteNumber(output, holes.size());
+            for (const Hole& hole : holes)
+            {
+                WriteNumber(output, hole.offset);
+                WriteNumber(output, hole.length);
+                WriteNumber(output, hole.kind);
+                WriteNumber(output, hole.value);
+            }
+            WriteNumber(output, exports.size());
+            for (auto& exported : exports)
+            {
+                WriteString(output, exported.first);
+                WriteNumber(output, exported.second);
+            }
+        }
+        /* Throws std::runtime_error when the data isn't a saved fragment */
+        static Fragment Load(std::istream& input)
+        {
+            char magic[8];
+            if (!input.read(magic, 8) || std::string(magic, 8) != Magic())
+                throw std::runtime_error("Not a fragment file");
+            Fragment fragment;
+            fragment.header = ReadString(input);
+            fragment.body = ReadString(input);
+            fragment.footer = ReadString(input);
+            fragment.idCount = static_cast<uint32_t>(ReadNumber(input));
+            for (int64_t& size : fragment.extent)
+                size = static_cast<int64_t>(ReadNumber(input));
+            uint64_t holeCount = ReadNumber(input);
+            for (uint64_t i = 0; i < holeCount && input; ++i)
+            {
+                Hole hole;
+                hole.offset = static_cast<std::size_t>(ReadNumber(input));
+                hole.length = static_cast<std::size_t>(ReadNumber(input));
+                hole.kind = static_cast<KIND>(ReadNumber(input));
+                hole.value = ReadNumber(input);
+                if (hole.kind > Z || hole.offset + hole.length > fragment.body.size()
+                    || (!fragment.holes.empty() && hole.offset < fragment.holes.back().offset + fragment.holes.back().length))
+                    throw std::runtime_error("Fragment file is corrupt");
+                fragment.holes.push_back(hole);
+            }
+            uint64_t exportCount = ReadNumber(input);
+            for (uint64_t i = 0; i < exportCount && input; ++i)
+            {
+                std::string name = ReadString(input);
+                fragment.exports[name] = static_cast<uint32_t>(ReadNumber(input));
+            }
+            if (!input)
+                throw std::runtime_error("Fragment file is truncated");
+            return fragment;
+        }
+
+        /* Makes `block` reachable as IdOf(name, ...), also after Load */
+        void Export(const std::string& name, ICubeBlock& block)
+        {
+            auto ordinal = ordinals.find(block.GetEntityId());
+            if (ordinal == ordinals.end())
+                throw std::out_of_range("Block is not part of the fragment");
+            exports[name] = ordinal->second;
+        }
+        EntityId IdOf(const std::string& name, const Instance& instance) const
+        {
+            auto exported = exports.find(name);
+            if (exported == exports.end())
+                throw std::out_of_range("Fragment exports no block named " + name);
+            return instance.firstId + exported->second;
+        }
+
+        /* Number of EntityIds one copy uses */
+        uint32_t IdCount() const
+        {
+            return idCount;
+        }
+        /* EntityId the copy `instance` gives to `block` of the original
+           grid, only while the fragment still knows its blocks */
+        EntityId IdOf(ICubeBlock& block, const Instance& instance) const
+        {
+            auto ordinal = ordinals.find(block.GetEntityId());
+            if (ordinal == ordinals.end())
+                throw std::out_of_range("Block is not part of the fragment");
+            return instance.firstId + ordinal->second;
+        }
+        /* One past the largest coordinate of the grid on each axis */
+        Box Extent() const
+        {
+            return Box{extent[0], extent[1], extent[2]};
+        }
+        const std::string& Header() const
+        {
+            return header;
+        }
+        const std::string& Footer() const
+        {
+            return footer;
+        }
+
+        /* Writes the grid of one copy, without the surrounding document */
+        void Instantiate(std::streambuf* sink, const Instance& instance) const
+        {
+            std::size_t written = 0;
+            for (const Hole& hole : holes)
+            {
+                sink->sputn(body.data() + written, static_cast<std::streamsize>(hole.offset - written));
+                written = hole.offset + hole.length;
+                std::string patch;
+                switch (hole.kind)
+                {
+                    case NAME:
+                        patch = instance.name;
+                        break;
+                    case ID:
+                        patch = std::to_string(instance.firstId + hole.value);
+                        break;
+                    case PORT:
+                        if (hole.value >= instance.links.size())
+                            throw std::logic_error("Fragment port is not linked");
+                        patch = std::to_string(instance.links[hole.value]);
+                        break;
+                    case X:
+                        patch = std::to_string(static_cast<int64_t>(hole.value) + instance.x);
+                        break;
+                    case Y:
+                        patch = std::to_string(static_cast<int64_t>(hole.value) + instance.y);
+                        break;
+                    case Z:
+                        patch = std::to_string(static_cast<int64_t>(hole.value) + instance.z);
+                        break;
+                }
+                sink->sputn(patch.data(), static_cast<std::streamsize>(patch.size()));
+            }
+            sink->sputn(body.data() + written, static_cast<std::streamsize>(body.size() - written));
+        }
+};
+
+#endif // H_INSTANCING
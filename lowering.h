@@ -0,0 +1,71 @@
+#ifndef H_LOWERING
+#define H_LOWERING
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "gates.h"
+#include "netlist.h"
+#include "optimize.h"
+#include "arena.h"
+
+/* NetlistLowering itself is in gates.h, the decoders are emitted through it */
+
+/* AND or OR over any number of inputs, lowered as a DecomposeFanin tree of
+   gates narrow enough for their updater's toolbar. It is hooked like one
+   gate: GetHook(i) reaches input i wherever it landed in the tree. */
+class WideGate
+{
+    private:
+        NetlistRewrite tree;
+        NetlistLowering lowering;
+        unsigned input_count;
+        unsigned depth;
+
+        static NetlistRewrite BuildTree(Netlist::KIND kind, unsigned input_count, unsigned maxInputs)
+        {
+            if (kind != Netlist::AND && kind != Netlist::OR)
+                throw std::invalid_argument("Only AND and OR gates can be widened");
+            Netlist netlist;
+            netlist.MarkOutput(netlist.AddNode(kind, input_count));
+            return DecomposeFanin(netlist, maxInputs);
+        }
+
+    public:
+        WideGate(Netlist::KIND kind, unsigned _input_count, unsigned maxInputs = ToolbarStrategy().MaxGateInputs(),
+                 std::string name = "", CircuitArena* arena = nullptr)
+            : tree(BuildTree(kind, _input_count, maxInputs)), lowering(tree.netlist, name, arena),
+              input_count(_input_count), depth(1)
+        {
+            for (unsigned width = input_count; width > maxInputs; width = (width + maxInputs - 1) / maxInputs)
+                ++depth;
+        }
+        WideGate(const WideGate&) = delete;
+        WideGate& operator=(const WideGate&) = delete;
+
+        unsigned size() const
+        {
+            return input_count;
+        }
+        /* Gates on the way from an input to the output */
+        unsigned Depth() const
+        {
+            return depth;
+        }
+        Hook GetHook(unsigned inputIndex)
+        {
+            if (inputIndex >= input_count)
+                throw std::out_of_range("Input index out of range");
+            return lowering.GetHook(tree.Map(Netlist::Pin{0, inputIndex}));
+        }
+        void HookOutputTo(Hook hook)
+        {
+            lowering.HookOutputTo(tree.Map(0), hook);
+        }
+        void Emit(CircuitCubegridManager& manager)
+        {
+            lowering.Emit(manager);
+        }
+};
+
+#endif // H_LOWERING
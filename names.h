@@ -0,0 +1,121 @@
+#ifndef H_NAMES
+#define H_NAMES
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Block names are assembled from a handful of distinct pieces ("AND ",
+   "input B ", " DEC64-2 5", ...). Each piece is stored once and a name is
+   kept as a chain of piece ids until it is actually needed, so prepending
+   and appending never touches a std::string.
+   Like ToolbarLog there is one table per circuit: pairs keep the table
+   Get() returns when they are built, a Scope makes a circuit's own one
+   current. */
+class NameTable
+{
+    public:
+        typedef uint32_t List;
+        enum : List {EMPTY = UINT32_MAX};
+
+    private:
+        struct Cell
+        {
+            uint32_t segment;
+            List next;
+        };
+
+        std::deque<std::string> segments;
+        std::unordered_map<std::string, uint32_t> ids;
+        std::vector<Cell> cells;
+        std::vector<uint32_t> scratch;
+
+        static NameTable*& Current()
+        {
+            static thread_local NameTable* current = nullptr;
+            return current;
+        }
+
+    public:
+        /* Makes `table` the one Get() returns on this thread while it lives */
+        class Scope
+        {
+            private:
+                NameTable* previous;
+
+            public:
+                Scope(NameTable& table) : previous(Current())
+                {
+                    Current() = &table;
+                }
+                ~Scope()
+                {
+                    Current() = previous;
+                }
+                Scope(const Scope&) = delete;
+                Scope& operator=(const Scope&) = delete;
+        };
+
+        NameTable() = default;
+        NameTable(const NameTable&) = delete;
+        NameTable& operator=(const NameTable&) = delete;
+
+        /* The innermost Scope's table, or one kept for the thread outside
+           any scope */
+        static NameTable& Get()
+        {
+            if (NameTable* current = Current())
+                return *current;
+            static thread_local NameTable table;
+            return table;
+        }
+
+        uint32_t Intern(const std::string& segment)
+        {
+            auto found = ids.find(segment);
+            if (found != ids.end())
+                return found->second;
+            uint32_t id = static_cast<uint32_t>(segments.size());
+            segments.push_back(segment);
+            ids.emplace(segment, id);
+            return id;
+        }
+        const std::string& Segment(uint32_t id) const
+        {
+            return segments[id];
+        }
+
+        /* New list with `segment` in front of `list`; lists share their tails */
+        List Push(List list, uint32_t segment)
+        {
+            cells.push_back(Cell{segment, list});
+            return static_cast<List>(cells.size() - 1);
+        }
+        List Push(List list, const std::string& segment)
+        {
+            return Push(list, Intern(segment));
+        }
+
+        void AppendTo(std::string& out, List list) const
+        {
+            for (List i = list; i != EMPTY; i = cells[i].next)
+                out += segments[cells[i].segment];
+        }
+        void AppendReversedTo(std::string& out, List list)
+        {
+            scratch.clear();
+            for (List i = list; i != EMPTY; i = cells[i].next)
+                scratch.push_back(cells[i].segment);
+            for (std::size_t i = scratch.size(); i-- > 0;)
+                out += segments[scratch[i]];
+        }
+
+        std::size_t SegmentCount() const
+        {
+            return segments.size();
+        }
+};
+
+#endif // H_NAMES
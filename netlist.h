@@ -0,0 +1,217 @@
+#ifndef H_NETLIST
+#define H_NETLIST
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Logical view of a circuit: one node per gate, its input pins stored
+   contiguously in a flat array. Pins can be connected after the gate was
+   added, the same way gates are hooked together with HookOutputTo.
+   REGISTER is a clocked D flip-flop; passes that only look at settled
+   values treat it as a buffer, so loops through registers are refused
+   like any other loop. */
+class Netlist
+{
+    public:
+        typedef uint32_t NodeId;
+        enum : NodeId {NONE = UINT32_MAX};
+        enum KIND : uint8_t {INPUT = 0, BUFFER = 1, NOT = 2, AND = 3, OR = 4, REGISTER = 5};
+
+        struct Pin
+        {
+            NodeId node;
+            unsigned index;
+        };
+
+        /* Compressed adjacency: the neighbours of node n are
+           nodes[start[n]] .. nodes[start[n+1]-1] */
+        struct Adjacency
+        {
+            std::vector<uint32_t> start;
+            std::vector<NodeId> nodes;
+
+            const NodeId* begin(NodeId node) const
+            {
+                return nodes.data() + start[node];
+            }
+            const NodeId* end(NodeId node) const
+            {
+                return nodes.data() + start[node + 1];
+            }
+            uint32_t Count(NodeId node) const
+            {
+                return start[node + 1] - start[node];
+            }
+        };
+
+    private:
+        std::vector<uint8_t> kinds;
+        std::vector<uint32_t> pinStart;
+        std::vector<NodeId> drivers;
+        std::vector<NodeId> primaryInputs;
+        std::vector<NodeId> primaryOutputs;
+        std::unordered_map<NodeId, std::string> labels;
+
+    public:
+        Netlist()
+        {
+            pinStart.push_back(0);
+        }
+
+        static const char* KindName(KIND kind)
+        {
+            switch (kind)
+            {
+                case INPUT: return "INPUT PIN";
+                case BUFFER: return "INPUT";
+                case NOT: return "NOT";
+                case AND: return "AND";
+                case OR: return "OR";
+                case REGISTER: return "REGISTER";
+            }
+            return "?";
+        }
+
+        NodeId AddNode(KIND kind, unsigned pinCount)
+        {
+            if (kind == INPUT && pinCount != 0)
+                throw std::invalid_argument("Primary inputs have no pins");
+            NodeId id = static_cast<NodeId>(kinds.size());
+            kinds.push_back(kind);
+            drivers.resize(drivers.size() + pinCount, NodeId(NONE));
+            pinStart.push_back(static_cast<uint32_t>(drivers.size()));
+            if (kind == INPUT)
+                primaryInputs.push_back(id);
+            return id;
+        }
+        NodeId AddInput()
+        {
+            return AddNode(INPUT, 0);
+        }
+        template <typename Gate> NodeId Add()
+        {
+            return AddNode(Gate::modelKind, Gate::modelInputs);
+        }
+        void Connect(NodeId driver, Pin pin)
+        {
+            if (driver >= size() || pin.node >= size())
+                throw std::out_of_range("Node index out of range");
+            if (pin.index >= PinCount(pin.node))
+                throw std::out_of_range("Input index out of range");
+            drivers[pinStart[pin.node] + pin.index] = driver;
+        }
+        void Connect(NodeId driver, NodeId node, unsigned index)
+        {
+            Connect(driver, Pin{node, index});
+        }
+        void MarkOutput(NodeId node)
+        {
+            primaryOutputs.push_back(node);
+        }
+        /* Copies every node of `other` in, numbered from the returned id on,
+           with its pins, labels and declared outputs */
+        NodeId Append(const Netlist& other)
+        {
+            NodeId offset = static_cast<NodeId>(size());
+            for (NodeId node = 0; node < other.size(); ++node)
+                AddNode(other.Kind(node), other.PinCount(node));
+            for (NodeId node = 0; node < other.size(); ++node)
+                for (unsigned i = 0; i < other.PinCount(node); ++i)
+                    if (other.Fanin(node)[i] != NONE)
+                        Connect(other.Fanin(node)[i] + offset, node + offset, i);
+            for (const auto& label : other.labels)
+                labels[label.first + offset] = label.second;
+            for (NodeId output : other.primaryOutputs)
+                MarkOutput(output + offset);
+            return offset;
+        }
+        void SetLabel(NodeId node, std::string label)
+        {
+            labels[node] = label;
+        }
+        std::string Label(NodeId node) const
+        {
+            auto it = labels.find(node);
+            return it == labels.end() ? std::string() : it->second;
+        }
+
+        std::size_t size() const
+        {
+            return kinds.size();
+        }
+        KIND Kind(NodeId node) const
+        {
+            return static_cast<KIND>(kinds[node]);
+        }
+        unsigned PinCount(NodeId node) const
+        {
+            return pinStart[node + 1] - pinStart[node];
+        }
+        const NodeId* Fanin(NodeId node) const
+        {
+            return drivers.data() + pinStart[node];
+        }
+        const std::vector<NodeId>& Inputs() const
+        {
+            return primaryInputs;
+        }
+        const std::vector<NodeId>& Outputs() const
+        {
+            return primaryOutputs;
+        }
+
+        /* Gates fed by each node, one entry per connected pin */
+        Adjacency BuildFanout() const
+        {
+            Adjacency fanout;
+            fanout.start.assign(size() + 1, 0);
+            for (NodeId driver : drivers)
+                if (driver != NONE)
+                    ++fanout.start[driver + 1];
+            for (std::size_t i = 0; i < size(); ++i)
+                fanout.start[i + 1] += fanout.start[i];
+            fanout.nodes.resize(fanout.start.back());
+            std::vector<uint32_t> fill(fanout.start.begin(), fanout.start.end() - 1);
+            for (NodeId node = 0; node < size(); ++node)
+                for (unsigned i = 0; i < PinCount(node); ++i)
+                    if (Fanin(node)[i] != NONE)
+                        fanout.nodes[fill[Fanin(node)[i]]++] = node;
+            return fanout;
+        }
+
+        /* Drivers before the gates they feed; throws on combinational loops
+           and, unless allowOpen is set, on unconnected pins */
+        std::vector<NodeId> TopologicalOrder(bool allowOpen = false) const
+        {
+            std::vector<uint32_t> pending(size(), 0);
+            for (NodeId node = 0; node < size(); ++node)
+            {
+                for (unsigned i = 0; i < PinCount(node); ++i)
+                {
+                    if (Fanin(node)[i] != NONE)
+                        ++pending[node];
+                    else if (!allowOpen)
+                        throw std::logic_error("Unconnected gate input");
+                }
+            }
+            Adjacency fanout = BuildFanout();
+
+            std::vector<NodeId> order;
+            order.reserve(size());
+            for (NodeId node = 0; node < size(); ++node)
+                if (!pending[node])
+                    order.push_back(node);
+            for (std::size_t i = 0; i < order.size(); ++i)
+                for (const NodeId* next = fanout.begin(order[i]); next != fanout.end(order[i]); ++next)
+                    if (!--pending[*next])
+                        order.push_back(*next);
+            if (order.size() != size())
+                throw std::logic_error("Combinational loop in netlist");
+            return order;
+        }
+};
+
+#endif // H_NETLIST
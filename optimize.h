@@ -0,0 +1,693 @@
+#ifndef H_OPTIMIZE
+#define H_OPTIMIZE
+
+#include <algorithm>
+#include <cstdint>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "netlist.h"
+#include "timing.h"
+
+/* A rewritten netlist and, for every node of the original, the node now
+   carrying its value. Pins of kept nodes keep their index unless the pass
+   moved them to another gate, then movedPins says where they went. */
+struct NetlistRewrite
+{
+    Netlist netlist;
+    std::vector<Netlist::NodeId> map;
+    std::unordered_map<uint64_t, Netlist::Pin> movedPins;
+
+    static uint64_t PinKey(Netlist::Pin pin)
+    {
+        return (uint64_t(pin.node) << 32) | pin.index;
+    }
+    Netlist::NodeId Map(Netlist::NodeId node) const
+    {
+        return map[node];
+    }
+    Netlist::Pin Map(Netlist::Pin pin) const
+    {
+        auto moved = movedPins.find(PinKey(pin));
+        if (moved != movedPins.end())
+            return moved->second;
+        return Netlist::Pin{map[pin.node], pin.index};
+    }
+};
+
+/* `second`, a rewrite of first.netlist, applied after `first`, a rewrite
+   of `netlist`. A node removed by either pass maps to NONE. Only open pins
+   are followed into movedPins, the others are wired inside the netlist. */
+inline NetlistRewrite ChainRewrites(const Netlist& netlist, const NetlistRewrite& first, NetlistRewrite second)
+{
+    NetlistRewrite chained;
+    chained.map.resize(netlist.size());
+    for (Netlist::NodeId node = 0; node < netlist.size(); ++node)
+    {
+        Netlist::NodeId middle = first.map[node];
+        chained.map[node] = middle == Netlist::NONE ? Netlist::NONE : second.map[middle];
+    }
+    for (Netlist::NodeId node = 0; node < netlist.size(); ++node)
+        for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+        {
+            if (netlist.Fanin(node)[i] != Netlist::NONE)
+                continue;
+            Netlist::Pin pin = first.Map(Netlist::Pin{node, i});
+            if (pin.node == Netlist::NONE)
+                continue;
+            pin = second.Map(pin);
+            if (pin.node != Netlist::NONE && (pin.node != chained.map[node] || pin.index != i))
+                chained.movedPins[NetlistRewrite::PinKey(Netlist::Pin{node, i})] = pin;
+        }
+    chained.netlist = std::move(second.netlist);
+    return chained;
+}
+
+/* Local clean-up: removes buffers that only pass a gate output along,
+   cancels double negation, folds single-fanout AND/OR gates into an AND/OR
+   of the same kind they feed and drops repeated inputs. Buffers driven by
+   a primary input or left open are kept, they are where the circuit is
+   hooked from outside. Open pins of AND/OR gates come after the connected
+   ones, movedPins says where each of them ended up. */
+inline NetlistRewrite Simplify(const Netlist& netlist)
+{
+    typedef Netlist::NodeId NodeId;
+    const std::size_t size = netlist.size();
+    std::vector<NodeId> order = netlist.TopologicalOrder(true);
+    Netlist::Adjacency fanout = netlist.BuildFanout();
+    std::vector<uint8_t> isOutput(size, 0);
+    for (NodeId node : netlist.Outputs())
+        isOutput[node] = 1;
+
+    std::vector<NodeId> alias(size);
+    std::vector<uint8_t> absorbed(size, 0);
+    std::vector<std::vector<NodeId>> leaves(size);
+    std::vector<std::vector<Netlist::Pin>> openPins(size);
+    // only gates whose one reader is the gate folding them in
+    auto absorbable = [&](NodeId node)
+    {
+        return fanout.Count(node) == 1 && !isOutput[node];
+    };
+
+    for (NodeId node : order)
+    {
+        const NodeId* fanin = netlist.Fanin(node);
+        alias[node] = node;
+        switch (netlist.Kind(node))
+        {
+            case Netlist::INPUT:
+            case Netlist::REGISTER:
+                break;
+            case Netlist::BUFFER:
+                if (fanin[0] != Netlist::NONE && netlist.Kind(fanin[0]) != Netlist::INPUT)
+                {
+                    alias[node] = alias[fanin[0]];
+                    absorbed[node] = 1;
+                }
+                break;
+            case Netlist::NOT:
+            {
+                NodeId driver = fanin[0] == Netlist::NONE ? Netlist::NONE : alias[fanin[0]];
+                if (driver != Netlist::NONE && netlist.Kind(driver) == Netlist::NOT
+                    && netlist.Fanin(driver)[0] != Netlist::NONE)
+                {
+                    alias[node] = alias[netlist.Fanin(driver)[0]];
+                    absorbed[node] = 1;
+                    if (driver == fanin[0] && absorbable(driver))
+                        absorbed[driver] = 1;
+                }
+                break;
+            }
+            case Netlist::AND:
+            case Netlist::OR:
+            {
+                std::vector<NodeId>& list = leaves[node];
+                std::vector<Netlist::Pin>& open = openPins[node];
+                for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+                {
+                    NodeId driver = fanin[i] == Netlist::NONE ? Netlist::NONE : alias[fanin[i]];
+                    if (driver == Netlist::NONE)
+                        open.push_back(Netlist::Pin{node, i});
+                    else if (driver == fanin[i] && netlist.Kind(driver) == netlist.Kind(node) && absorbable(driver)
+                             && !(leaves[driver].empty() && openPins[driver].empty()) && !absorbed[driver])
+                    {
+                        list.insert(list.end(), leaves[driver].begin(), leaves[driver].end());
+                        open.insert(open.end(), openPins[driver].begin(), openPins[driver].end());
+                        absorbed[driver] = 1;
+                    }
+                    else list.push_back(driver);
+                }
+                std::sort(list.begin(), list.end());
+                list.erase(std::unique(list.begin(), list.end()), list.end());
+                if (list.size() == 1 && open.empty())
+                {
+                    alias[node] = list[0];
+                    absorbed[node] = 1;
+                }
+                break;
+            }
+        }
+    }
+
+    NetlistRewrite rewrite;
+    rewrite.map.assign(size, Netlist::NONE);
+    for (NodeId node = 0; node < size; ++node)
+    {
+        if (absorbed[node])
+            continue;
+        Netlist::KIND kind = netlist.Kind(node);
+        unsigned pins = (kind == Netlist::AND || kind == Netlist::OR)
+            ? static_cast<unsigned>(leaves[node].size() + openPins[node].size()) : netlist.PinCount(node);
+        rewrite.map[node] = rewrite.netlist.AddNode(kind, pins);
+        std::string label = netlist.Label(node);
+        if (!label.empty())
+            rewrite.netlist.SetLabel(rewrite.map[node], label);
+    }
+    for (NodeId node = 0; node < size; ++node)
+        if (absorbed[node])
+            rewrite.map[node] = rewrite.map[alias[node]];
+    for (NodeId node = 0; node < size; ++node)
+    {
+        if (absorbed[node])
+            continue;
+        Netlist::KIND kind = netlist.Kind(node);
+        if (kind == Netlist::AND || kind == Netlist::OR)
+        {
+            unsigned connected = static_cast<unsigned>(leaves[node].size());
+            for (unsigned i = 0; i < connected; ++i)
+                rewrite.netlist.Connect(rewrite.map[leaves[node][i]], rewrite.map[node], i);
+            for (unsigned j = 0; j < openPins[node].size(); ++j)
+            {
+                Netlist::Pin pin = openPins[node][j];
+                if (pin.node != node || pin.index != connected + j)
+                    rewrite.movedPins[NetlistRewrite::PinKey(pin)] = Netlist::Pin{rewrite.map[node], connected + j};
+            }
+        }
+        else
+        {
+            for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+                if (netlist.Fanin(node)[i] != Netlist::NONE)
+                    rewrite.netlist.Connect(rewrite.map[netlist.Fanin(node)[i]], rewrite.map[node], i);
+        }
+    }
+    for (NodeId node : netlist.Outputs())
+        rewrite.netlist.MarkOutput(rewrite.map[node]);
+    return rewrite;
+}
+
+/* Multi-level minimisation by repeated common-pair extraction: the pair of
+   inputs shared by the most AND (or OR) gates is moved into a new two-input
+   gate of the same kind, as long as at least minShared gates share it.
+   Every gate costs two timers per input plus three, so a pair shared by k
+   gates saves 2k-7 blocks; the default only extracts pairs that pay off.
+   Applied to a flat decoder this discovers predecoding on its own. */
+inline NetlistRewrite ExtractCommonPairs(const Netlist& netlist, unsigned minShared = 4)
+{
+    typedef Netlist::NodeId NodeId;
+    const std::size_t size = netlist.size();
+    std::vector<Netlist::KIND> kinds(size);
+    std::vector<std::vector<NodeId>> fanins(size);
+    std::vector<uint8_t> open(size, 0);
+    for (NodeId node = 0; node < size; ++node)
+    {
+        kinds[node] = netlist.Kind(node);
+        fanins[node].assign(netlist.Fanin(node), netlist.Fanin(node) + netlist.PinCount(node));
+        if (std::find(fanins[node].begin(), fanins[node].end(), Netlist::NONE) != fanins[node].end())
+            open[node] = 1;
+        if ((kinds[node] == Netlist::AND || kinds[node] == Netlist::OR) && !open[node])
+            std::sort(fanins[node].begin(), fanins[node].end());
+    }
+
+    const Netlist::KIND reducible[2] = {Netlist::AND, Netlist::OR};
+    for (Netlist::KIND kind : reducible)
+    {
+        auto key = [](NodeId a, NodeId b)
+        {
+            return a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a;
+        };
+        auto candidate = [&](NodeId node)
+        {
+            return kinds[node] == kind && !open[node] && fanins[node].size() > 2;
+        };
+        std::unordered_map<uint64_t, uint32_t> counts;
+        std::vector<std::vector<NodeId>> uses(fanins.size());
+        for (NodeId node = 0; node < fanins.size(); ++node)
+        {
+            if (!candidate(node))
+                continue;
+            const std::vector<NodeId>& list = fanins[node];
+            for (std::size_t i = 0; i < list.size(); ++i)
+            {
+                uses[list[i]].push_back(node);
+                for (std::size_t j = i + 1; j < list.size(); ++j)
+                    ++counts[key(list[i], list[j])];
+            }
+        }
+        std::priority_queue<std::pair<uint32_t, uint64_t>> heap;
+        for (auto& pair : counts)
+            if (pair.second >= minShared)
+                heap.push(std::make_pair(pair.second, pair.first));
+
+        while (!heap.empty())
+        {
+            std::pair<uint32_t, uint64_t> top = heap.top();
+            heap.pop();
+            auto current = counts.find(top.second);
+            if (current == counts.end() || current->second != top.first)
+                continue;
+            NodeId a = static_cast<NodeId>(top.second >> 32);
+            NodeId b = static_cast<NodeId>(top.second & 0xFFFFFFFFu);
+
+            NodeId extracted = static_cast<NodeId>(fanins.size());
+            kinds.push_back(kind);
+            fanins.push_back(std::vector<NodeId>{a, b});
+            open.push_back(0);
+            uses.emplace_back();
+            counts.erase(current);
+
+            std::vector<NodeId> users = uses[a].size() < uses[b].size() ? uses[a] : uses[b];
+            std::sort(users.begin(), users.end());
+            users.erase(std::unique(users.begin(), users.end()), users.end());
+            for (NodeId user : users)
+            {
+                std::vector<NodeId>& list = fanins[user];
+                if (!candidate(user) || !std::binary_search(list.begin(), list.end(), a)
+                    || !std::binary_search(list.begin(), list.end(), b))
+                    continue;
+                list.erase(std::find(list.begin(), list.end(), a));
+                list.erase(std::find(list.begin(), list.end(), b));
+                // a gate left with two inputs is no longer a candidate
+                bool stillCandidate = list.size() + 1 > 2;
+                for (NodeId other : list)
+                {
+                    // a pair still shared widely enough goes back in with its new count
+                    for (NodeId removed : {a, b})
+                        if (--counts[key(removed, other)] >= minShared)
+                            heap.push(std::make_pair(counts[key(removed, other)], key(removed, other)));
+                    if (!stillCandidate)
+                        continue;
+                    uint32_t& count = counts[key(extracted, other)];
+                    if (++count >= minShared)
+                        heap.push(std::make_pair(count, key(extracted, other)));
+                }
+                list.insert(std::lower_bound(list.begin(), list.end(), extracted), extracted);
+                uses[extracted].push_back(user);
+            }
+        }
+    }
+
+    NetlistRewrite rewrite;
+    rewrite.map.resize(size);
+    std::vector<NodeId> newId(fanins.size());
+    for (NodeId node = 0; node < fanins.size(); ++node)
+    {
+        newId[node] = rewrite.netlist.AddNode(kinds[node], static_cast<unsigned>(fanins[node].size()));
+        if (node < size)
+        {
+            rewrite.map[node] = newId[node];
+            std::string label = netlist.Label(node);
+            if (!label.empty())
+                rewrite.netlist.SetLabel(newId[node], label);
+        }
+    }
+    for (NodeId node = 0; node < fanins.size(); ++node)
+        for (unsigned i = 0; i < fanins[node].size(); ++i)
+            if (fanins[node][i] != Netlist::NONE)
+                rewrite.netlist.Connect(newId[fanins[node][i]], newId[node], i);
+    for (NodeId node : netlist.Outputs())
+        rewrite.netlist.MarkOutput(rewrite.map[node]);
+    return rewrite;
+}
+
+/* Splits every AND/OR gate with more than maxInputs pins into a balanced
+   tree of gates of the same kind, each at most maxInputs wide, so every
+   updater fits its toolbar. The original node becomes the root; its pins
+   move to the leaves and are reported in movedPins. A tree over n inputs
+   is ceil(log_maxInputs(n)) gates deep. */
+inline NetlistRewrite DecomposeFanin(const Netlist& netlist, unsigned maxInputs)
+{
+    typedef Netlist::NodeId NodeId;
+    if (maxInputs < 2)
+        throw std::invalid_argument("Gates need at least two inputs");
+    const std::size_t size = netlist.size();
+    auto wide = [&](NodeId node)
+    {
+        Netlist::KIND kind = netlist.Kind(node);
+        return (kind == Netlist::AND || kind == Netlist::OR) && netlist.PinCount(node) > maxInputs;
+    };
+    auto split = [&](std::size_t count)
+    {
+        return (count + maxInputs - 1) / maxInputs;
+    };
+
+    NetlistRewrite rewrite;
+    rewrite.map.resize(size);
+    for (NodeId node = 0; node < size; ++node)
+    {
+        std::size_t pins = netlist.PinCount(node);
+        if (wide(node))
+            while (pins > maxInputs)
+                pins = split(pins);
+        rewrite.map[node] = rewrite.netlist.AddNode(netlist.Kind(node), static_cast<unsigned>(pins));
+        std::string label = netlist.Label(node);
+        if (!label.empty())
+            rewrite.netlist.SetLabel(rewrite.map[node], label);
+    }
+
+    for (NodeId node = 0; node < size; ++node)
+    {
+        if (!wide(node))
+            continue;
+        // a level entry is either a pin of the original gate or a new gate
+        struct Source
+        {
+            bool pin;
+            uint32_t id;
+        };
+        std::vector<Source> level;
+        for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+            level.push_back(Source{true, i});
+        auto attach = [&](const Source& source, Netlist::Pin target)
+        {
+            if (source.pin)
+                rewrite.movedPins[NetlistRewrite::PinKey(Netlist::Pin{node, source.id})] = target;
+            else rewrite.netlist.Connect(source.id, target);
+        };
+        while (level.size() > maxInputs)
+        {
+            std::size_t gates = split(level.size());
+            std::vector<Source> next;
+            std::size_t begin = 0;
+            for (std::size_t g = 0; g < gates; ++g)
+            {
+                std::size_t end = level.size() * (g + 1) / gates;
+                NodeId gate = rewrite.netlist.AddNode(netlist.Kind(node), static_cast<unsigned>(end - begin));
+                if (!netlist.Label(node).empty())
+                    rewrite.netlist.SetLabel(gate, netlist.Label(node));
+                for (unsigned j = 0; begin < end; ++begin, ++j)
+                    attach(level[begin], Netlist::Pin{gate, j});
+                next.push_back(Source{false, gate});
+            }
+            level.swap(next);
+        }
+        for (unsigned j = 0; j < level.size(); ++j)
+            attach(level[j], Netlist::Pin{rewrite.map[node], j});
+    }
+
+    for (NodeId node = 0; node < size; ++node)
+        for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+            if (netlist.Fanin(node)[i] != Netlist::NONE)
+                rewrite.netlist.Connect(rewrite.map[netlist.Fanin(node)[i]], rewrite.Map(Netlist::Pin{node, i}));
+    for (NodeId node : netlist.Outputs())
+        rewrite.netlist.MarkOutput(rewrite.map[node]);
+    return rewrite;
+}
+
+/* Splits every gate output read by more than maxFanout pins into a balanced
+   tree of buffers, so no timer has to switch and trigger more than
+   maxFanout gates. Each level costs one buffer (HOPS_PER_GATE hops) and
+   divides the load by maxFanout: a small limit spreads the toolbar actions
+   over more triggers, a large one keeps the path short. Primary inputs are
+   hooked from outside and left alone. Simplify removes these buffers again,
+   so this is meant to run last. */
+inline NetlistRewrite BufferFanout(const Netlist& netlist, unsigned maxFanout = 8)
+{
+    typedef Netlist::NodeId NodeId;
+    if (maxFanout < 2)
+        throw std::invalid_argument("Fan-out limit must be at least 2");
+    const std::size_t size = netlist.size();
+    NetlistRewrite rewrite;
+    rewrite.map.resize(size);
+    std::vector<std::vector<Netlist::Pin>> readers(size);
+    for (NodeId node = 0; node < size; ++node)
+    {
+        rewrite.map[node] = rewrite.netlist.AddNode(netlist.Kind(node), netlist.PinCount(node));
+        std::string label = netlist.Label(node);
+        if (!label.empty())
+            rewrite.netlist.SetLabel(rewrite.map[node], label);
+        for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+            if (netlist.Fanin(node)[i] != Netlist::NONE)
+                readers[netlist.Fanin(node)[i]].push_back(Netlist::Pin{node, i});
+    }
+
+    for (NodeId driver = 0; driver < size; ++driver)
+    {
+        std::vector<Netlist::Pin> level = readers[driver];
+        if (netlist.Kind(driver) != Netlist::INPUT)
+        {
+            std::string label = netlist.Label(driver) + " fan-out";
+            while (level.size() > maxFanout)
+            {
+                // as many buffers as needed, each taking an equal share
+                std::size_t buffers = (level.size() + maxFanout - 1) / maxFanout;
+                std::vector<Netlist::Pin> next;
+                std::size_t begin = 0;
+                for (std::size_t b = 0; b < buffers; ++b)
+                {
+                    std::size_t end = level.size() * (b + 1) / buffers;
+                    NodeId buffer = rewrite.netlist.AddNode(Netlist::BUFFER, 1);
+                    rewrite.netlist.SetLabel(buffer, label);
+                    for (; begin < end; ++begin)
+                        rewrite.netlist.Connect(buffer, level[begin]);
+                    next.push_back(Netlist::Pin{buffer, 0});
+                }
+                level.swap(next);
+            }
+        }
+        for (const Netlist::Pin& pin : level)
+            rewrite.netlist.Connect(driver, pin);
+    }
+    for (NodeId node : netlist.Outputs())
+        rewrite.netlist.MarkOutput(rewrite.map[node]);
+    return rewrite;
+}
+
+/* Inserts pipeline registers where paths cross the hop depths in `cuts`
+   (arrivals as in TimingAnalysis), so one clock cycle only has to cover
+   the gates between two cuts. A node's stage is the number of cuts below
+   its arrival; a pin reading an earlier stage gets one REGISTER per stage
+   in between, chained after the driver and shared by all its readers.
+   Outputs are padded to the last stage, every output then comes
+   cuts.size() clocks after its inputs; outputs map to their last
+   register. Open pins are hooked at stage 0, those needing registers are
+   moved to the first of their own chain. */
+inline NetlistRewrite Pipeline(const Netlist& netlist, std::vector<uint32_t> cuts)
+{
+    typedef Netlist::NodeId NodeId;
+    const std::size_t size = netlist.size();
+    for (NodeId node = 0; node < size; ++node)
+        if (netlist.Kind(node) == Netlist::REGISTER)
+            throw std::invalid_argument("Netlist already has registers");
+    std::sort(cuts.begin(), cuts.end());
+    cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+    TimingAnalysis timing(netlist);
+    std::vector<unsigned> stage(size);
+    for (NodeId node = 0; node < size; ++node)
+        stage[node] = static_cast<unsigned>(std::lower_bound(cuts.begin(), cuts.end(), timing.Arrival(node)) - cuts.begin());
+
+    NetlistRewrite rewrite;
+    rewrite.map.resize(size);
+    for (NodeId node = 0; node < size; ++node)
+    {
+        rewrite.map[node] = rewrite.netlist.AddNode(netlist.Kind(node), netlist.PinCount(node));
+        std::string label = netlist.Label(node);
+        if (!label.empty())
+            rewrite.netlist.SetLabel(rewrite.map[node], label);
+    }
+    std::vector<std::vector<NodeId>> chains(size);
+    // driver's value `delay` stages later
+    auto delayed = [&](NodeId driver, unsigned delay)
+    {
+        std::vector<NodeId>& chain = chains[driver];
+        while (chain.size() < delay)
+        {
+            NodeId reg = rewrite.netlist.AddNode(Netlist::REGISTER, 1);
+            rewrite.netlist.SetLabel(reg, netlist.Label(driver) + " stage " +
+                                          std::to_string(stage[driver] + chain.size() + 1));
+            rewrite.netlist.Connect(chain.empty() ? rewrite.map[driver] : chain.back(), reg, 0);
+            chain.push_back(reg);
+        }
+        return delay ? chain[delay - 1] : rewrite.map[driver];
+    };
+
+    for (NodeId node = 0; node < size; ++node)
+    {
+        for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+        {
+            NodeId driver = netlist.Fanin(node)[i];
+            Netlist::Pin pin{rewrite.map[node], i};
+            if (driver != Netlist::NONE)
+                rewrite.netlist.Connect(delayed(driver, stage[node] - stage[driver]), pin);
+            else if (stage[node] > 0)
+            {
+                std::string label = netlist.Label(node) + " pin " + std::to_string(i) + " stage ";
+                NodeId first = Netlist::NONE;
+                NodeId last = Netlist::NONE;
+                for (unsigned k = 1; k <= stage[node]; ++k)
+                {
+                    NodeId reg = rewrite.netlist.AddNode(Netlist::REGISTER, 1);
+                    rewrite.netlist.SetLabel(reg, label + std::to_string(k));
+                    if (last != Netlist::NONE)
+                        rewrite.netlist.Connect(last, reg, 0);
+                    else first = reg;
+                    last = reg;
+                }
+                rewrite.netlist.Connect(last, pin);
+                rewrite.movedPins[NetlistRewrite::PinKey(Netlist::Pin{node, i})] = Netlist::Pin{first, 0};
+            }
+        }
+    }
+    for (NodeId node : netlist.Outputs())
+    {
+        rewrite.map[node] = delayed(node, static_cast<unsigned>(cuts.size()) - stage[node]);
+        rewrite.netlist.MarkOutput(rewrite.map[node]);
+    }
+    return rewrite;
+}
+
+/* Cuts for Pipeline every `stageHops` hops, as many as the netlist needs */
+inline std::vector<uint32_t> PipelineCuts(const Netlist& netlist, uint32_t stageHops)
+{
+    if (!stageHops)
+        throw std::invalid_argument("Pipeline stage must be at least one hop");
+    std::vector<uint32_t> cuts;
+    uint32_t worst = TimingAnalysis(netlist).WorstArrival();
+    for (uint32_t cut = stageHops; cut < worst; cut += stageHops)
+        cuts.push_back(cut);
+    return cuts;
+}
+
+/* Hash-consing: gates of the same kind fed by the same nodes (in any order
+   for AND/OR) carry the same value, so only the first of them is kept and
+   the others are mapped to it. Gates with an open pin are hooked from
+   outside and never merged, neither are primary inputs. */
+inline NetlistRewrite MergeEquivalent(const Netlist& netlist)
+{
+    typedef Netlist::NodeId NodeId;
+    struct KeyHash
+    {
+        std::size_t operator()(const std::vector<NodeId>& key) const
+        {
+            uint64_t hash = 14695981039346656037ull;
+            for (NodeId id : key)
+                hash = (hash ^ id) * 1099511628211ull;
+            return static_cast<std::size_t>(hash);
+        }
+    };
+    const std::size_t size = netlist.size();
+    std::vector<NodeId> representative(size);
+    std::unordered_map<std::vector<NodeId>, NodeId, KeyHash> seen;
+    std::vector<NodeId> key;
+    for (NodeId node : netlist.TopologicalOrder(true))
+    {
+        representative[node] = node;
+        Netlist::KIND kind = netlist.Kind(node);
+        if (kind == Netlist::INPUT)
+            continue;
+        const NodeId* fanin = netlist.Fanin(node);
+        if (std::find(fanin, fanin + netlist.PinCount(node), NodeId(Netlist::NONE)) != fanin + netlist.PinCount(node))
+            continue;
+        key.assign(1, kind);
+        for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+            key.push_back(representative[fanin[i]]);
+        if (kind == Netlist::AND || kind == Netlist::OR)
+            std::sort(key.begin() + 1, key.end());
+        auto inserted = seen.emplace(key, node);
+        if (!inserted.second)
+            representative[node] = inserted.first->second;
+    }
+
+    NetlistRewrite rewrite;
+    rewrite.map.assign(size, Netlist::NONE);
+    for (NodeId node = 0; node < size; ++node)
+    {
+        if (representative[node] != node)
+            continue;
+        rewrite.map[node] = rewrite.netlist.AddNode(netlist.Kind(node), netlist.PinCount(node));
+        std::string label = netlist.Label(node);
+        if (!label.empty())
+            rewrite.netlist.SetLabel(rewrite.map[node], label);
+    }
+    for (NodeId node = 0; node < size; ++node)
+        rewrite.map[node] = rewrite.map[representative[node]];
+    for (NodeId node = 0; node < size; ++node)
+    {
+        if (representative[node] != node)
+            continue;
+        for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+            if (netlist.Fanin(node)[i] != Netlist::NONE)
+                rewrite.netlist.Connect(rewrite.map[netlist.Fanin(node)[i]], rewrite.map[node], i);
+    }
+    for (NodeId node : netlist.Outputs())
+        rewrite.netlist.MarkOutput(rewrite.map[node]);
+    return rewrite;
+}
+
+/* Keeps only what some declared output depends on, found by walking the
+   fanin back from Outputs(); primary inputs always stay. Removed nodes map
+   to NONE, so their pins can no longer be hooked. */
+inline NetlistRewrite RemoveDeadLogic(const Netlist& netlist)
+{
+    typedef Netlist::NodeId NodeId;
+    if (netlist.Outputs().empty())
+        throw std::logic_error("Netlist declares no outputs, everything would be removed");
+    const std::size_t size = netlist.size();
+    std::vector<uint8_t> live(size, 0);
+    std::vector<NodeId> pending(netlist.Outputs().begin(), netlist.Outputs().end());
+    for (NodeId node : netlist.Inputs())
+        live[node] = 1;
+    while (!pending.empty())
+    {
+        NodeId node = pending.back();
+        pending.pop_back();
+        if (node == Netlist::NONE || live[node] == 2)
+            continue;
+        live[node] = 2;
+        for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+            pending.push_back(netlist.Fanin(node)[i]);
+    }
+
+    NetlistRewrite rewrite;
+    rewrite.map.assign(size, Netlist::NONE);
+    for (NodeId node = 0; node < size; ++node)
+    {
+        if (!live[node])
+            continue;
+        rewrite.map[node] = rewrite.netlist.AddNode(netlist.Kind(node), netlist.PinCount(node));
+        std::string label = netlist.Label(node);
+        if (!label.empty())
+            rewrite.netlist.SetLabel(rewrite.map[node], label);
+    }
+    for (NodeId node = 0; node < size; ++node)
+    {
+        if (!live[node])
+            continue;
+        for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+            if (netlist.Fanin(node)[i] != Netlist::NONE)
+                rewrite.netlist.Connect(rewrite.map[netlist.Fanin(node)[i]], rewrite.map[node], i);
+    }
+    for (NodeId node : netlist.Outputs())
+        rewrite.netlist.MarkOutput(rewrite.map[node]);
+    return rewrite;
+}
+
+/* MergeEquivalent, then RemoveDeadLogic */
+inline NetlistRewrite Reduce(const Netlist& netlist)
+{
+    NetlistRewrite merged = MergeEquivalent(netlist);
+    return ChainRewrites(netlist, merged, RemoveDeadLogic(merged.netlist));
+}
+
+/* Simplify, extract shared pairs, simplify again */
+inline NetlistRewrite Minimize(const Netlist& netlist, unsigned minShared = 4)
+{
+    NetlistRewrite first = Simplify(netlist);
+    NetlistRewrite second = ExtractCommonPairs(first.netlist, minShared);
+    NetlistRewrite chained = ChainRewrites(netlist, first, second);
+    return ChainRewrites(netlist, chained, Simplify(chained.netlist));
+}
+
+#endif // H_OPTIMIZE
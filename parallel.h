@@ -0,0 +1,170 @@
+#ifndef H_PARALLEL
+#define H_PARALLEL
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Number of workers to use when the caller doesn't say */
+inline unsigned DefaultThreadCount()
+{
+    unsigned threads = std::thread::hardware_concurrency();
+    return threads ? threads : 1;
+}
+
+/* Calls function(i) for every i below count on up to `threads` threads.
+   Workers pull the next index from a shared counter, so uneven jobs still
+   keep every thread busy. The first exception thrown by a job is rethrown
+   once all workers have stopped. Jobs must not share state; circuits
+   record into their own ToolbarLog, so building one per job is fine. */
+template <typename Function> void ParallelFor(std::size_t count, Function function, unsigned threads = DefaultThreadCount())
+{
+    threads = static_cast<unsigned>(std::min<std::size_t>(std::max(threads, 1u), count));
+    if (threads <= 1)
+    {
+        for (std::size_t i = 0; i < count; ++i)
+            function(i);
+        return;
+    }
+    std::atomic<std::size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex errorLock;
+    auto worker = [&]()
+    {
+        for (std::size_t i = next++; i < count && !failed; i = next++)
+        {
+            try
+            {
+                function(i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(errorLock);
+                if (!error)
+                    error = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; ++t)
+        workers.emplace_back(worker);
+    worker();
+    for (std::thread& thread : workers)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+/* Calls produce(i) for every i below count on up to `threads` worker
+   threads and consume(i, result) on the calling thread in index order, each
+   as soon as its result and all before it are ready. Workers pull the next
+   index from a shared queue and never wait for the rest of a batch; at most
+   twice `threads` results wait to be consumed, so memory stays bounded
+   however many jobs there are. The first exception thrown by either side
+   is rethrown once all workers have stopped. */
+template <typename Produce, typename Consume>
+void ParallelOrdered(std::size_t count, Produce produce, Consume consume, unsigned threads = DefaultThreadCount())
+{
+    typedef decltype(produce(std::size_t(0))) Result;
+    threads = static_cast<unsigned>(std::min<std::size_t>(std::max(threads, 1u), count));
+    if (threads <= 1)
+    {
+        for (std::size_t i = 0; i < count; ++i)
+            consume(i, produce(i));
+        return;
+    }
+    const std::size_t window = 2 * static_cast<std::size_t>(threads);
+    std::vector<std::unique_ptr<Result>> ready(window);
+    std::size_t next = 0;
+    std::size_t consumed = 0;
+    bool failed = false;
+    std::exception_ptr error;
+    std::mutex lock;
+    std::condition_variable changed;
+    auto fail = [&]()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!error)
+                error = std::current_exception();
+            failed = true;
+        }
+        changed.notify_all();
+    };
+    auto worker = [&]()
+    {
+        for (;;)
+        {
+            std::size_t i;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]()
+                {
+                    return failed || next >= count || next < consumed + window;
+                });
+                if (failed || next >= count)
+                    return;
+                i = next++;
+            }
+            try
+            {
+                std::unique_ptr<Result> result(new Result(produce(i)));
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    ready[i % window] = std::move(result);
+                }
+                changed.notify_all();
+            }
+            catch (...)
+            {
+                fail();
+                return;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t)
+        workers.emplace_back(worker);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        std::unique_ptr<Result> result;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&]()
+            {
+                return failed || ready[i % window];
+            });
+            if (failed)
+                break;
+            result = std::move(ready[i % window]);
+        }
+        try
+        {
+            consume(i, std::move(*result));
+        }
+        catch (...)
+        {
+            fail();
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ++consumed;
+        }
+        changed.notify_all();
+    }
+    for (std::thread& thread : workers)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+#endif // H_PARALLEL
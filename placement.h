@@ -0,0 +1,251 @@
+#ifndef H_PLACEMENT
+#define H_PLACEMENT
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "blueprintlib/blueprint.h"
+#include "blueprintlib/blocks.h"
+#include "toolbarlog.h"
+#include "arena.h"
+
+/* Places the blocks of a grid in a compact box, keeping blocks that act on
+   each other close together. The fast mode orders blocks breadth first
+   along their toolbar connections and lays that order out on a serpentine
+   path through the box, so consecutive blocks are always neighbours. An
+   optional simulated annealing pass then swaps positions to shorten the
+   total wire length (Manhattan distance between a toolbar's owner and its
+   targets). Both are deterministic for a given seed. */
+class Placement
+{
+    public:
+        struct Position
+        {
+            int64_t x;
+            int64_t y;
+            int64_t z;
+        };
+
+    private:
+        std::vector<ICubeBlock*> blocks;
+        std::vector<uint32_t> neighbourStart;
+        std::vector<uint32_t> neighbours;
+        std::vector<std::pair<uint32_t, uint32_t>> wires;
+        std::vector<uint32_t> slotOf;
+        std::vector<uint32_t> blockAt;
+        unsigned sizeX, sizeY, sizeZ;
+
+        enum : uint32_t {EMPTY = UINT32_MAX};
+
+        Position SlotPosition(uint32_t slot) const
+        {
+            int64_t layer = slot / (sizeX * sizeY);
+            int64_t rest = slot % (sizeX * sizeY);
+            if (layer % 2)
+                rest = sizeX * sizeY - 1 - rest;
+            int64_t row = rest / sizeX;
+            int64_t column = rest % sizeX;
+            if (row % 2)
+                column = sizeX - 1 - column;
+            return Position{column, row, layer};
+        }
+        static int64_t Distance(const Position& a, const Position& b)
+        {
+            return std::llabs(a.x - b.x) + std::llabs(a.y - b.y) + std::llabs(a.z - b.z);
+        }
+        /* Wire length of every connection of `block` if it sat in `slot`,
+           with `other` (moving the opposite way) assumed in `otherSlot` */
+        int64_t Cost(uint32_t block, uint32_t slot, uint32_t other, uint32_t otherSlot) const
+        {
+            Position here = SlotPosition(slot);
+            int64_t cost = 0;
+            for (uint32_t i = neighbourStart[block]; i < neighbourStart[block + 1]; ++i)
+            {
+                uint32_t neighbour = neighbours[i];
+                cost += Distance(here, SlotPosition(neighbour == other ? otherSlot : slotOf[neighbour]));
+            }
+            return cost;
+        }
+
+        void BuildConnections(const ToolbarLog& log)
+        {
+            CircuitArena arena;
+            std::unordered_map<const ICubeBlock*, uint32_t, std::hash<const ICubeBlock*>, std::equal_to<const ICubeBlock*>,
+                               ArenaAllocator<std::pair<const ICubeBlock* const, uint32_t>>> index(&arena);
+            index.reserve(blocks.size());
+            for (uint32_t i = 0; i < blocks.size(); ++i)
+                index.emplace(blocks[i], i);
+            std::vector<uint32_t> degree(blocks.size(), 0);
+            auto connect = [&](uint32_t owner, const ICubeBlock* target)
+            {
+                auto found = index.find(target);
+                if (found == index.end() || found->second == owner)
+                    return;
+                wires.push_back(std::make_pair(owner, found->second));
+                ++degree[owner];
+                ++degree[found->second];
+            };
+            for (uint32_t owner = 0; owner < blocks.size(); ++owner)
+            {
+                log.ForEachEntry(*blocks[owner], [&](const ToolbarLog::Entry& entry)
+                {
+                    if (entry.group)
+                        log.ForEachMember(*entry.group, [&](ICubeBlock* member) { connect(owner, member); });
+                    else connect(owner, entry.block);
+                });
+            }
+
+            neighbourStart.assign(blocks.size() + 1, 0);
+            for (uint32_t i = 0; i < blocks.size(); ++i)
+                neighbourStart[i + 1] = neighbourStart[i] + degree[i];
+            neighbours.resize(neighbourStart.back());
+            std::vector<uint32_t> fill(neighbourStart.begin(), neighbourStart.end() - 1);
+            for (const std::pair<uint32_t, uint32_t>& wire : wires)
+            {
+                neighbours[fill[wire.first]++] = wire.second;
+                neighbours[fill[wire.second]++] = wire.first;
+            }
+        }
+
+        /* Breadth first over connections, components in grid order */
+        std::vector<uint32_t> ClusterOrder() const
+        {
+            std::vector<uint32_t> order;
+            std::vector<uint8_t> seen(blocks.size(), 0);
+            order.reserve(blocks.size());
+            for (uint32_t start = 0; start < blocks.size(); ++start)
+            {
+                if (seen[start])
+                    continue;
+                seen[start] = 1;
+                order.push_back(start);
+                for (std::size_t i = order.size() - 1; i < order.size(); ++i)
+                {
+                    uint32_t block = order[i];
+                    for (uint32_t k = neighbourStart[block]; k < neighbourStart[block + 1]; ++k)
+                    {
+                        if (!seen[neighbours[k]])
+                        {
+                            seen[neighbours[k]] = 1;
+                            order.push_back(neighbours[k]);
+                        }
+                    }
+                }
+            }
+            return order;
+        }
+
+        void Anneal(uint64_t moves, uint32_t seed)
+        {
+            if (!moves || blocks.size() < 2 || wires.empty())
+                return;
+            std::mt19937 random(seed);
+            const uint32_t slots = static_cast<uint32_t>(blockAt.size());
+            double temperature = 2.0;
+            const double cooling = std::pow(0.01 / temperature, 1.0 / double(moves));
+            for (uint64_t move = 0; move < moves; ++move, temperature *= cooling)
+            {
+                uint32_t block = random() % blocks.size();
+                uint32_t degree = neighbourStart[block + 1] - neighbourStart[block];
+                if (!degree)
+                    continue;
+                // aim next to a random neighbour, most useful moves are short
+                Position target = SlotPosition(slotOf[neighbours[neighbourStart[block] + random() % degree]]);
+                int64_t x = std::min<int64_t>(sizeX - 1, std::max<int64_t>(0, target.x + int64_t(random() % 3) - 1));
+                int64_t y = std::min<int64_t>(sizeY - 1, std::max<int64_t>(0, target.y + int64_t(random() % 3) - 1));
+                int64_t z = std::min<int64_t>(sizeZ - 1, std::max<int64_t>(0, target.z + int64_t(random() % 3) - 1));
+                uint32_t slot = SlotAt(x, y, z);
+                if (slot >= slots || slot == slotOf[block])
+                    continue;
+                uint32_t other = blockAt[slot];
+                uint32_t from = slotOf[block];
+                int64_t delta = Cost(block, slot, other, from) - Cost(block, from, EMPTY, 0);
+                if (other != EMPTY)
+                    delta += Cost(other, from, block, slot) - Cost(other, slot, EMPTY, 0);
+                if (delta > 0 && std::exp(-double(delta) / temperature) * 4294967296.0 <= double(random()))
+                    continue;
+                blockAt[from] = other;
+                blockAt[slot] = block;
+                slotOf[block] = slot;
+                if (other != EMPTY)
+                    slotOf[other] = from;
+            }
+        }
+        uint32_t SlotAt(int64_t x, int64_t y, int64_t z) const
+        {
+            int64_t column = y % 2 ? sizeX - 1 - x : x;
+            int64_t rest = y * sizeX + column;
+            if (z % 2)
+                rest = sizeX * sizeY - 1 - rest;
+            return static_cast<uint32_t>(z * sizeX * sizeY + rest);
+        }
+
+    public:
+        Placement(CubeGrid& cubegrid, const ToolbarLog& log = ToolbarLog::Get())
+        {
+            for (std::size_t i = 0; i < cubegrid.blocks.size(); ++i)
+                blocks.push_back(cubegrid.blocks[i]);
+            BuildConnections(log);
+            sizeX = sizeY = sizeZ = 0;
+        }
+
+        /* Fast deterministic placement, refined by annealingMoves swaps per
+           block when non-zero */
+        void Place(unsigned annealingMoves = 0, uint32_t seed = 1)
+        {
+            std::size_t count = blocks.size();
+            sizeX = std::max<unsigned>(1, static_cast<unsigned>(std::ceil(std::cbrt(double(count)))));
+            sizeY = sizeX;
+            sizeZ = std::max<unsigned>(1, static_cast<unsigned>((count + sizeX * sizeY - 1) / (sizeX * sizeY)));
+            blockAt.assign(std::size_t(sizeX) * sizeY * sizeZ, EMPTY);
+            slotOf.assign(count, EMPTY);
+            std::vector<uint32_t> order = ClusterOrder();
+            for (uint32_t slot = 0; slot < order.size(); ++slot)
+            {
+                slotOf[order[slot]] = slot;
+                blockAt[slot] = order[slot];
+            }
+            Anneal(uint64_t(annealingMoves) * count, seed);
+        }
+        /* Writes the positions into the blocks' Coords */
+        void Apply()
+        {
+            for (uint32_t block = 0; block < blocks.size(); ++block)
+            {
+                Position position = this->PositionOf(block);
+                blocks[block]->Coords.x = position.x;
+                blocks[block]->Coords.y = position.y;
+                blocks[block]->Coords.z = position.z;
+            }
+        }
+
+        Position PositionOf(uint32_t block) const
+        {
+            if (slotOf.empty())
+                throw std::logic_error("Blocks have not been placed yet");
+            return SlotPosition(slotOf[block]);
+        }
+        Position Extent() const
+        {
+            return Position{sizeX, sizeY, sizeZ};
+        }
+        uint64_t WireLength() const
+        {
+            uint64_t length = 0;
+            for (const std::pair<uint32_t, uint32_t>& wire : wires)
+                length += Distance(PositionOf(wire.first), PositionOf(wire.second));
+            return length;
+        }
+        std::size_t size() const
+        {
+            return blocks.size();
+        }
+};
+
+#endif // H_PLACEMENT
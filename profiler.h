@@ -0,0 +1,225 @@
+#ifndef H_PROFILER
+#define H_PROFILER
+
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "gates.h"
+#include "simulator.h"
+
+/* Counts what the game has to execute for a sequence of input changes:
+   every toolbar action, split by owning block or gate, and the trigger
+   chains they ran in. Blocks can be attributed to a gate name so a gate's
+   timers and updater are reported together; anything else is reported
+   under its own CustomName. */
+class ActivationProfiler
+{
+    public:
+        struct Stimulus
+        {
+            TimerSimulator::HookIndex hook;
+            bool value;
+        };
+
+    private:
+        struct StackNode
+        {
+            uint32_t parent;
+            uint32_t frame;
+            uint64_t actions;
+        };
+
+        TimerSimulator& simulator;
+        std::vector<uint64_t> actionsByBlock;
+        std::vector<uint64_t> runsByBlock;
+        uint64_t actionsByKind[4] = {0, 0, 0, 0};
+        uint64_t transitions = 0;
+
+        std::vector<uint32_t> frameOf;
+        std::vector<std::string> frameNames;
+        std::unordered_map<std::string, uint32_t> frameIds;
+
+        std::vector<StackNode> stack;
+        std::unordered_map<uint64_t, uint32_t> children;
+        uint32_t current = 0;
+
+        uint32_t FrameId(const std::string& name)
+        {
+            auto found = frameIds.find(name);
+            if (found != frameIds.end())
+                return found->second;
+            uint32_t id = static_cast<uint32_t>(frameNames.size());
+            frameNames.push_back(name);
+            frameIds.emplace(name, id);
+            return id;
+        }
+        uint32_t FrameOf(uint32_t node)
+        {
+            if (frameOf[node] != UINT32_MAX)
+                return frameOf[node];
+            std::string name;
+            if (TimerBlock* timer = dynamic_cast<TimerBlock*>(simulator.Block(node)))
+                name = timer->CustomName();
+            if (name.empty())
+                name = "block " + std::to_string(node);
+            return frameOf[node] = FrameId(name);
+        }
+        void AttributePair(TimerPair& timerPair, uint32_t frame)
+        {
+            frameOf[simulator.IndexOf(timerPair.timerLow)] = frame;
+            frameOf[simulator.IndexOf(timerPair.timerHigh)] = frame;
+        }
+
+    public:
+        ActivationProfiler(TimerSimulator& _simulator) : simulator(_simulator)
+        {
+            actionsByBlock.assign(simulator.size(), 0);
+            runsByBlock.assign(simulator.size(), 0);
+            frameOf.assign(simulator.size(), UINT32_MAX);
+            stack.push_back(StackNode{UINT32_MAX, UINT32_MAX, 0});
+        }
+
+        void Attribute(const ICubeBlock& block, const std::string& gate)
+        {
+            frameOf[simulator.IndexOf(block)] = FrameId(gate);
+        }
+        template <unsigned input_count> void AttributeGate(LogicGate<input_count>& logicGate, const std::string& gate)
+        {
+            uint32_t frame = FrameId(gate);
+            for (unsigned i = 0; i < input_count; ++i)
+                AttributePair(logicGate.inputs[i], frame);
+            AttributePair(logicGate.output, frame);
+            frameOf[simulator.IndexOf(logicGate.updater)] = frame;
+        }
+        void AttributeGate(RuntimeGate& runtimeGate, const std::string& gate)
+        {
+            uint32_t frame = FrameId(gate);
+            for (TimerPair& input : runtimeGate.inputs)
+                AttributePair(input, frame);
+            AttributePair(runtimeGate.output, frame);
+            frameOf[simulator.IndexOf(runtimeGate.updater)] = frame;
+        }
+
+        /* TimerSimulator observer interface */
+        void Enter(uint32_t node)
+        {
+            ++runsByBlock[node];
+            uint64_t key = (uint64_t(current) << 32) | FrameOf(node);
+            auto found = children.find(key);
+            if (found == children.end())
+            {
+                stack.push_back(StackNode{current, FrameOf(node), 0});
+                found = children.emplace(key, static_cast<uint32_t>(stack.size() - 1)).first;
+            }
+            current = found->second;
+        }
+        void Leave()
+        {
+            current = stack[current].parent;
+        }
+        void Action(uint32_t owner, uint32_t, ToolbarLog::ACTION action)
+        {
+            ++actionsByBlock[owner];
+            ++actionsByKind[action];
+            ++stack[current].actions;
+        }
+
+        void Run(const std::vector<Stimulus>& stimuli)
+        {
+            for (const Stimulus& stimulus : stimuli)
+            {
+                simulator.Drive(stimulus.hook, stimulus.value, *this);
+                ++transitions;
+            }
+        }
+
+        uint64_t TotalActions() const
+        {
+            uint64_t total = 0;
+            for (uint64_t count : actionsByKind)
+                total += count;
+            return total;
+        }
+        uint64_t Actions(ToolbarLog::ACTION action) const
+        {
+            return actionsByKind[action];
+        }
+        uint64_t Transitions() const
+        {
+            return transitions;
+        }
+
+        /* Actions and toolbar runs per gate, most expensive first */
+        std::vector<std::pair<std::string, std::pair<uint64_t, uint64_t>>> GateCounts()
+        {
+            std::vector<std::pair<uint64_t, uint64_t>> perFrame;
+            for (uint32_t node = 0; node < actionsByBlock.size(); ++node)
+            {
+                if (!actionsByBlock[node] && !runsByBlock[node])
+                    continue;
+                uint32_t frame = FrameOf(node);
+                if (perFrame.size() <= frame)
+                    perFrame.resize(frame + 1, std::make_pair(0, 0));
+                perFrame[frame].first += actionsByBlock[node];
+                perFrame[frame].second += runsByBlock[node];
+            }
+            std::vector<std::pair<std::string, std::pair<uint64_t, uint64_t>>> counts;
+            for (uint32_t frame = 0; frame < perFrame.size(); ++frame)
+                if (perFrame[frame].first || perFrame[frame].second)
+                    counts.push_back(std::make_pair(frameNames[frame], perFrame[frame]));
+            std::sort(counts.begin(), counts.end(), [](const std::pair<std::string, std::pair<uint64_t, uint64_t>>& a,
+                                                       const std::pair<std::string, std::pair<uint64_t, uint64_t>>& b)
+            {
+                return a.second.first > b.second.first;
+            });
+            return counts;
+        }
+
+        void PrintHotSpots(std::ostream& output, std::size_t top = 10)
+        {
+            output<<transitions<<" transitions, "<<TotalActions()<<" actions ("
+                  <<actionsByKind[ToolbarLog::TRIGGER]<<" TriggerNow, "
+                  <<actionsByKind[ToolbarLog::ON] + actionsByKind[ToolbarLog::OFF] + actionsByKind[ToolbarLog::TOGGLE]
+                  <<" OnOff)"<<std::endl;
+            std::vector<std::pair<std::string, std::pair<uint64_t, uint64_t>>> counts = GateCounts();
+            for (std::size_t i = 0; i < counts.size() && i < top; ++i)
+                output<<"  "<<counts[i].second.first<<"\t"<<counts[i].first<<std::endl;
+        }
+        void WriteCsv(std::ostream& output)
+        {
+            output<<"gate,actions,toolbar_runs,actions_per_transition"<<std::endl;
+            for (auto& count : GateCounts())
+            {
+                std::string name = count.first;
+                std::replace(name.begin(), name.end(), '"', '\'');
+                output<<'"'<<name<<"\","<<count.second.first<<","<<count.second.second<<","
+                      <<(transitions ? double(count.second.first) / transitions : 0.0)<<std::endl;
+            }
+        }
+        /* One "frame;frame;frame count" line per trigger chain, the folded
+           format flamegraph.pl and speedscope read */
+        void WriteFolded(std::ostream& output) const
+        {
+            for (uint32_t node = 1; node < stack.size(); ++node)
+            {
+                if (!stack[node].actions)
+                    continue;
+                std::vector<uint32_t> frames;
+                for (uint32_t i = node; i != 0; i = stack[i].parent)
+                    frames.push_back(stack[i].frame);
+                for (std::size_t i = frames.size(); i-- > 0;)
+                {
+                    std::string name = frameNames[frames[i]];
+                    std::replace(name.begin(), name.end(), ';', ',');
+                    output<<name<<(i ? ";" : " ");
+                }
+                output<<stack[node].actions<<std::endl;
+            }
+        }
+};
+
+#endif // H_PROFILER
@@ -0,0 +1,268 @@
+#ifndef H_SIMULATOR
+#define H_SIMULATOR
+
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include "gates.h"
+#include "toolbarlog.h"
+
+/* Native model of the timer network of one or more grids, as recorded in
+   ToolbarLog. Every block becomes a node with an enabled bit, every toolbar
+   entry becomes a packed action (groups are expanded up front) and
+   TriggerNow is executed the way the game does it: depth first, in slot
+   order, skipped for disabled timers. Only toolbars of blocks in the given
+   grids are compiled; blocks they act on outside the grids, such as the
+   decoder lights, become nodes without actions. Recursion is replaced with
+   an explicit event stack so deep cascades can't overflow the native stack. */
+class TimerSimulator
+{
+    public:
+        struct HookIndex
+        {
+            uint32_t low;
+            uint32_t high;
+            uint32_t updater;
+        };
+
+        struct NullObserver
+        {
+            void Enter(uint32_t) {}
+            void Leave() {}
+            void Action(uint32_t, uint32_t, ToolbarLog::ACTION) {}
+        };
+
+    private:
+        struct Frame
+        {
+            uint32_t node;
+            uint32_t cursor;
+        };
+
+        std::vector<ICubeBlock*> blocks;
+        std::unordered_map<const ICubeBlock*, uint32_t> index;
+        std::vector<uint8_t> initial;
+        std::vector<uint8_t> enabled;
+        std::vector<uint8_t> isTimer;
+        std::vector<uint32_t> firstAction;
+        std::vector<uint32_t> actions;
+        std::vector<Frame> events;
+        std::size_t maxDepth;
+        uint64_t actionCount = 0;
+        uint64_t triggerCount = 0;
+
+        uint32_t AddNode(ICubeBlock* block)
+        {
+            auto it = index.find(block);
+            if (it != index.end())
+                return it->second;
+            uint32_t node = static_cast<uint32_t>(blocks.size());
+            index.emplace(block, node);
+            blocks.push_back(block);
+            if (TimerBlock* timer = dynamic_cast<TimerBlock*>(block))
+            {
+                isTimer.push_back(1);
+                initial.push_back(timer->Enabled() ? 1 : 0);
+            }
+            else if (InteriorLight* light = dynamic_cast<InteriorLight*>(block))
+            {
+                isTimer.push_back(0);
+                initial.push_back(light->Enabled() ? 1 : 0);
+            }
+            else
+            {
+                isTimer.push_back(0);
+                initial.push_back(1);
+            }
+            return node;
+        }
+
+        void Compile(const std::vector<CubeGrid*>& cubegrids, const std::vector<const ToolbarLog*>& logs)
+        {
+            std::vector<std::vector<uint32_t>> perNode;
+            auto addAction = [&](uint32_t node, ICubeBlock* block, ToolbarLog::ACTION action)
+            {
+                uint32_t target = AddNode(block);
+                if (perNode.size() < blocks.size())
+                    perNode.resize(blocks.size());
+                perNode[node].push_back((target << 2) | action);
+            };
+            for (CubeGrid* cubegrid : cubegrids)
+                for (std::size_t i = 0; i < cubegrid->blocks.size(); ++i)
+                    AddNode(cubegrid->blocks[i]);
+            std::size_t owners = blocks.size();
+            for (uint32_t node = 0; node < owners; ++node)
+                for (const ToolbarLog* log : logs)
+                    log->ForEachEntry(*blocks[node], [&](const ToolbarLog::Entry& entry)
+                    {
+                        if (entry.action == ToolbarLog::UNKNOWN)
+                            return;
+                        if (entry.group)
+                            log->ForEachMember(*entry.group, [&](ICubeBlock* member) { addAction(node, member, entry.action); });
+                        else addAction(node, entry.block, entry.action);
+                    });
+            perNode.resize(blocks.size());
+
+            firstAction.assign(1, 0);
+            for (const std::vector<uint32_t>& nodeActions : perNode)
+            {
+                actions.insert(actions.end(), nodeActions.begin(), nodeActions.end());
+                firstAction.push_back(static_cast<uint32_t>(actions.size()));
+            }
+            enabled = initial;
+        }
+
+    public:
+        /* `logs` of every circuit in the grids, a block's entries are
+           looked up in each */
+        TimerSimulator(const std::vector<CubeGrid*>& cubegrids, const std::vector<const ToolbarLog*>& logs,
+                       std::size_t _maxDepth = 1 << 20)
+        {
+            maxDepth = _maxDepth;
+            Compile(cubegrids, logs);
+        }
+        TimerSimulator(const std::vector<CubeGrid*>& cubegrids, const ToolbarLog& log = ToolbarLog::Get(),
+                       std::size_t _maxDepth = 1 << 20)
+            : TimerSimulator(cubegrids, std::vector<const ToolbarLog*>(1, &log), _maxDepth) {}
+        TimerSimulator(CubeGrid& cubegrid, const ToolbarLog& log = ToolbarLog::Get(), std::size_t _maxDepth = 1 << 20)
+            : TimerSimulator(std::vector<CubeGrid*>(1, &cubegrid), log, _maxDepth) {}
+
+        std::size_t size() const
+        {
+            return blocks.size();
+        }
+        ICubeBlock* Block(uint32_t node) const
+        {
+            return blocks[node];
+        }
+        uint32_t IndexOf(const ICubeBlock& block) const
+        {
+            auto it = index.find(&block);
+            if (it == index.end())
+                throw std::out_of_range("Block is not part of the simulated network");
+            return it->second;
+        }
+        HookIndex Resolve(Hook hook) const
+        {
+            return HookIndex{IndexOf(hook.input.timerLow), IndexOf(hook.input.timerHigh), IndexOf(hook.updater)};
+        }
+
+        void Reset()
+        {
+            enabled = initial;
+            actionCount = 0;
+            triggerCount = 0;
+        }
+
+        /* Observer receives Enter(node) when a timer starts running its
+           toolbar, Leave() when it is done and Action(owner, target, action)
+           for every action executed */
+        template <typename Observer> void Trigger(uint32_t start, Observer& observer)
+        {
+            if (!isTimer[start] || !enabled[start])
+                return;
+            ++triggerCount;
+            events.push_back(Frame{start, firstAction[start]});
+            observer.Enter(start);
+            while (!events.empty())
+            {
+                Frame& frame = events.back();
+                if (frame.cursor == firstAction[frame.node + 1])
+                {
+                    events.pop_back();
+                    observer.Leave();
+                    continue;
+                }
+                uint32_t owner = frame.node;
+                uint32_t action = actions[frame.cursor++];
+                uint32_t target = action >> 2;
+                ++actionCount;
+                observer.Action(owner, target, static_cast<ToolbarLog::ACTION>(action & 3));
+                switch (action & 3)
+                {
+                    case ToolbarLog::ON:
+                        enabled[target] = 1;
+                        break;
+                    case ToolbarLog::OFF:
+                        enabled[target] = 0;
+                        break;
+                    case ToolbarLog::TOGGLE:
+                        enabled[target] ^= 1;
+                        break;
+                    case ToolbarLog::TRIGGER:
+                        if (isTimer[target] && enabled[target])
+                        {
+                            if (events.size() >= maxDepth)
+                            {
+                                events.clear();
+                                throw std::runtime_error("Trigger cascade exceeded maximum depth");
+                            }
+                            ++triggerCount;
+                            events.push_back(Frame{target, firstAction[target]});
+                            observer.Enter(target);
+                        }
+                        break;
+                }
+            }
+        }
+        void Trigger(uint32_t start)
+        {
+            NullObserver observer;
+            Trigger(start, observer);
+        }
+        void Trigger(const ICubeBlock& block)
+        {
+            Trigger(IndexOf(block));
+        }
+
+        void SetEnabled(uint32_t node, bool value)
+        {
+            enabled[node] = value;
+        }
+        void SetEnabled(const ICubeBlock& block, bool value)
+        {
+            SetEnabled(IndexOf(block), value);
+        }
+        bool IsEnabled(uint32_t node) const
+        {
+            return enabled[node];
+        }
+        bool IsEnabled(const ICubeBlock& block) const
+        {
+            return IsEnabled(IndexOf(block));
+        }
+
+        /* Same effect as a DebugInput press: flip the gate input to the
+           requested level and fire its updater */
+        void Drive(const HookIndex& hook, bool value)
+        {
+            NullObserver observer;
+            Drive(hook, value, observer);
+        }
+        template <typename Observer> void Drive(const HookIndex& hook, bool value, Observer& observer)
+        {
+            enabled[hook.low] = !value;
+            enabled[hook.high] = value;
+            Trigger(hook.updater, observer);
+        }
+        void Drive(Hook hook, bool value)
+        {
+            Drive(Resolve(hook), value);
+        }
+        bool Read(const TimerPair& timerPair) const
+        {
+            return IsEnabled(timerPair.timerHigh);
+        }
+
+        uint64_t ActionCount() const
+        {
+            return actionCount;
+        }
+        uint64_t TriggerCount() const
+        {
+            return triggerCount;
+        }
+};
+
+#endif // H_SIMULATOR
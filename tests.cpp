@@ -0,0 +1,1092 @@
+/* Regression tests for the generator. Build next to gates.h with
+   blueprintlib checked out, the same way as the benchmark:
+
+       g++ -std=c++17 -O2 -pthread -I. tests.cpp -o tests -lz
+
+   Runs every case, or only those whose name contains the --filter text,
+   and exits non-zero if any check failed. To check the parallel writers
+   for data races, build with -fsanitize=thread -g instead of -O2 and run
+   with --filter parallel. Cases that write files do so in
+   the working directory under a tests_ prefix and remove them afterwards. */
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "verify.h"
+#include "simulator.h"
+#include "blueprintpatch.h"
+#include "bus.h"
+#include "cache.h"
+#include "compression.h"
+
+namespace
+{
+    struct TestCase
+    {
+        std::string name;
+        std::function<void()> run;
+    };
+
+    unsigned failures = 0;
+
+    void Expect(bool condition, const std::string& what)
+    {
+        if (!condition)
+        {
+            std::cout<<"    FAILED: "<<what<<"\n";
+            ++failures;
+        }
+    }
+
+    template <unsigned input_count, unsigned output_count>
+    void ExpectDecoderVerifies(const std::string& name)
+    {
+        Expect(VerifyDecoder<input_count, output_count>() == UINT64_MAX, name + " flat");
+        Expect(VerifyDecoder<input_count, output_count, Word256>() == UINT64_MAX, name + " flat, 256 lanes");
+        DecoderOptions predecoded;
+        predecoded.predecode = true;
+        DecoderOptions minimized;
+        minimized.minimize = true;
+        DecoderOptions both = predecoded;
+        both.minimize = true;
+        Expect(VerifyDecoder<input_count, output_count>(predecoded) == UINT64_MAX, name + " predecoded");
+        Expect(VerifyDecoder<input_count, output_count>(minimized) == UINT64_MAX, name + " minimised");
+        Expect(VerifyDecoder<input_count, output_count>(both) == UINT64_MAX, name + " predecoded, minimised");
+        DecoderOptions unbuffered;
+        unbuffered.maxFanout = 0;
+        DecoderOptions buffered;
+        buffered.maxFanout = 3;
+        Expect(VerifyDecoder<input_count, output_count>(unbuffered) == UINT64_MAX, name + " unbuffered");
+        Expect(VerifyDecoder<input_count, output_count>(buffered) == UINT64_MAX, name + " buffered to 3 readers");
+    }
+
+    void VerifyDecoders()
+    {
+        ExpectDecoderVerifies<2, 4>("Decoder<2,4>");
+        ExpectDecoderVerifies<6, 64>("Decoder<6,64>");
+        ExpectDecoderVerifies<7, 128>("Decoder<7,128>");
+        ExpectDecoderVerifies<10, 1024>("Decoder<10,1024>");
+
+        // the netlists constructed decoders were actually lowered from
+        Decoder<6, 64> decoder("VERIFY", true);
+        Expect(VerifyDecoder(decoder) == UINT64_MAX, "constructed Decoder<6,64>");
+        RuntimeDecoder runtimeDecoder(5, 20, "VERIFY", true);
+        Expect(VerifyDecoder(runtimeDecoder) == UINT64_MAX, "constructed RuntimeDecoder(5, 20)");
+    }
+
+    /* A wrong spec must be reported at its first failing vector, in the
+       second lane of a Word256 */
+    void VerifyReportsFirstMismatch()
+    {
+        Netlist netlist;
+        std::vector<Netlist::NodeId> inputs;
+        for (unsigned i = 0; i < 8; i++)
+            inputs.push_back(netlist.AddInput());
+        Netlist::NodeId gate = netlist.AddNode(Netlist::AND, 8);
+        for (unsigned i = 0; i < 8; i++)
+            netlist.Connect(inputs[i], Netlist::Pin{gate, i});
+        netlist.MarkOutput(gate);
+
+        uint64_t failing = VerifyExhaustive<Word256>(netlist, [](const Word256* in, Word256* expected)
+        {
+            // all inputs set except bit 0 and bit 6, vector 190
+            Word256 wrong = in[1] & ~in[0] & ~in[6] & in[7];
+            for (unsigned i = 2; i < 6; i++)
+                wrong = wrong & in[i];
+            Word256 match = in[0];
+            for (unsigned i = 1; i < 8; i++)
+                match = match & in[i];
+            expected[0] = match | wrong;
+        });
+        Expect(failing == 190, "first mismatch reported as " + std::to_string(failing) + ", expected 190");
+    }
+
+    std::string ReadFile(const std::string& path)
+    {
+        std::ifstream input(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    }
+
+    /* Stream a small decoder to `path` */
+    void WriteDecoderBlueprint(const std::string& path)
+    {
+        Decoder<2, 4> decoder("TEST");
+        BufferedFileSink sink(path);
+        {
+            BlueprintStreamWriter writer(&sink);
+            decoder.StreamTo(writer);
+        }
+        sink.Close();
+    }
+
+    /* Accepts `capacity` bytes, then refuses everything */
+    class ShortSink : public std::streambuf
+    {
+        private:
+            std::size_t capacity;
+
+        protected:
+            std::streamsize xsputn(const char*, std::streamsize count) override
+            {
+                std::streamsize taken = std::min(count, static_cast<std::streamsize>(capacity));
+                capacity -= static_cast<std::size_t>(taken);
+                return taken;
+            }
+            int_type overflow(int_type c) override
+            {
+                if (!capacity)
+                    return traits_type::eof();
+                --capacity;
+                return traits_type::not_eof(c);
+            }
+
+        public:
+            ShortSink(std::size_t _capacity) : capacity(_capacity) {}
+    };
+
+    void PatchWrites()
+    {
+        WriteDecoderBlueprint("tests_patch.sbc");
+        std::string original = ReadFile("tests_patch.sbc");
+        {
+            BlueprintPatcher patcher("tests_patch.sbc");
+            Expect(patcher.BlockCount() > 0, "patcher found blocks");
+            Expect(patcher.Write("tests_copy.sbc") && ReadFile("tests_copy.sbc") == original, "unedited copy is byte for byte");
+
+            ShortSink full(original.size());
+            Expect(patcher.WriteTo(&full), "write into a sink with room");
+            ShortSink tooSmall(original.size() / 2);
+            Expect(!patcher.WriteTo(&tooSmall), "short write is reported");
+            Expect(!patcher.Write("tests_no_such_directory/bp.sbc"), "unwritable destination is reported");
+
+            patcher.SetName(0, "patched <0>");
+            Expect(patcher.Write("tests_patch.sbc"), "write over the mapped source");
+            Expect(patcher.Name(0) == "patched <0>", "source still readable after being replaced");
+        }
+        BlueprintPatcher reread("tests_patch.sbc");
+        Expect(reread.Name(0) == "patched <0>", "patched name read back");
+        Expect(reread.BlockCount() == BlueprintPatcher("tests_copy.sbc").BlockCount(), "patched file keeps every block");
+        std::remove("tests_patch.sbc");
+        std::remove("tests_copy.sbc");
+    }
+
+    /* Drives the primary inputs and every open pin of `netlist` with all
+       input combinations, and checks that the rewritten netlist computes the
+       same outputs with its open pins hooked where rewrite.Map() says */
+    bool SameFunction(const Netlist& netlist, const NetlistRewrite& rewrite)
+    {
+        Netlist before = netlist;
+        Netlist after = rewrite.netlist;
+        std::vector<Netlist::NodeId> beforeInputs;
+        std::vector<Netlist::NodeId> afterInputs;
+        for (Netlist::NodeId node = 0; node < netlist.size(); node++)
+        {
+            if (netlist.Kind(node) == Netlist::INPUT)
+            {
+                beforeInputs.push_back(node);
+                afterInputs.push_back(rewrite.Map(node));
+            }
+            for (unsigned i = 0; i < netlist.PinCount(node); i++)
+                if (netlist.Fanin(node)[i] == Netlist::NONE)
+                {
+                    beforeInputs.push_back(before.AddInput());
+                    before.Connect(beforeInputs.back(), Netlist::Pin{node, i});
+                    afterInputs.push_back(after.AddInput());
+                    after.Connect(afterInputs.back(), rewrite.Map(Netlist::Pin{node, i}));
+                }
+        }
+        BitsliceEvaluator<uint64_t> expected(before);
+        BitsliceEvaluator<uint64_t> actual(after);
+        for (uint64_t base = 0; base < (uint64_t(1) << beforeInputs.size()); base += 64)
+        {
+            for (unsigned i = 0; i < beforeInputs.size(); i++)
+            {
+                expected.SetInput(beforeInputs[i], BitsliceEvaluator<uint64_t>::InputPattern(i, base));
+                actual.SetInput(afterInputs[i], BitsliceEvaluator<uint64_t>::InputPattern(i, base));
+            }
+            expected.Evaluate();
+            actual.Evaluate();
+            for (std::size_t o = 0; o < before.Outputs().size(); o++)
+                if (expected.Value(before.Outputs()[o]) != actual.Value(after.Outputs()[o]))
+                    return false;
+        }
+        return true;
+    }
+
+    /* AND(AND(a, b), c): the inner gate is folded away and maps to NONE */
+    void MinimizeNestedGates()
+    {
+        Netlist netlist;
+        Netlist::NodeId a = netlist.AddInput(), b = netlist.AddInput(), c = netlist.AddInput();
+        Netlist::NodeId inner = netlist.AddNode(Netlist::AND, 2);
+        Netlist::NodeId outer = netlist.AddNode(Netlist::AND, 2);
+        netlist.Connect(a, inner, 0);
+        netlist.Connect(b, inner, 1);
+        netlist.Connect(inner, outer, 0);
+        netlist.Connect(c, outer, 1);
+        netlist.MarkOutput(outer);
+        NetlistRewrite rewrite = Minimize(netlist);
+        Expect(rewrite.Map(inner) == Netlist::NONE, "folded gate maps to NONE");
+        Expect(rewrite.netlist.size() == 4, "one three-input AND left");
+        Expect(SameFunction(netlist, rewrite), "minimised nested ANDs compute the same function");
+    }
+
+    /* Open pins of a folded gate move to the gate that absorbed it */
+    void SimplifyOpenPins()
+    {
+        Netlist netlist;
+        Netlist::NodeId a = netlist.AddInput(), b = netlist.AddInput();
+        Netlist::NodeId inner = netlist.AddNode(Netlist::AND, 2);
+        Netlist::NodeId outer = netlist.AddNode(Netlist::AND, 3);
+        netlist.Connect(a, inner, 0);
+        netlist.Connect(inner, outer, 1);
+        netlist.Connect(b, outer, 2);
+        netlist.MarkOutput(outer);
+        NetlistRewrite simplified = Simplify(netlist);
+        Netlist::Pin innerOpen = simplified.Map(Netlist::Pin{inner, 1});
+        Netlist::Pin outerOpen = simplified.Map(Netlist::Pin{outer, 0});
+        Expect(innerOpen.node == simplified.Map(outer) && outerOpen.node == simplified.Map(outer)
+               && innerOpen.index != outerOpen.index, "open pins mapped to distinct pins of the merged gate");
+        Expect(SameFunction(netlist, simplified), "simplified gate with open pins computes the same function");
+        Expect(SameFunction(netlist, Minimize(netlist)), "minimised gate with open pins computes the same function");
+    }
+
+    /* x&y is shared by six gates, x&z by five. Extracting x&y first leaves
+       x&z with three, still enough to be extracted next. */
+    void ExtractRequeuesReducedPairs()
+    {
+        Netlist netlist;
+        Netlist::NodeId x = netlist.AddInput(), y = netlist.AddInput(), z = netlist.AddInput();
+        auto gate = [&](std::vector<Netlist::NodeId> fanin)
+        {
+            fanin.push_back(netlist.AddInput());
+            Netlist::NodeId node = netlist.AddNode(Netlist::AND, static_cast<unsigned>(fanin.size()));
+            for (unsigned i = 0; i < fanin.size(); i++)
+                netlist.Connect(fanin[i], node, i);
+            netlist.MarkOutput(node);
+        };
+        for (unsigned i = 0; i < 2; i++)
+            gate({x, y, z});
+        for (unsigned i = 0; i < 4; i++)
+            gate({x, y});
+        for (unsigned i = 0; i < 3; i++)
+            gate({x, z});
+        NetlistRewrite rewrite = ExtractCommonPairs(netlist, 2);
+        bool extracted = false;
+        for (Netlist::NodeId node = 0; node < rewrite.netlist.size(); node++)
+        {
+            const Netlist::NodeId* fanin = rewrite.netlist.Fanin(node);
+            if (rewrite.netlist.Kind(node) == Netlist::AND && rewrite.netlist.PinCount(node) == 2
+                && std::min(fanin[0], fanin[1]) == rewrite.Map(x) && std::max(fanin[0], fanin[1]) == rewrite.Map(z))
+                extracted = true;
+        }
+        Expect(extracted, "x&z extracted after its count dropped");
+        Expect(SameFunction(netlist, rewrite), "extracted netlist computes the same function");
+    }
+
+    /* Drives every address with enable set and cleared and compares each
+       output pair and output light */
+    template <unsigned input_count, unsigned output_count> void ExpectDecoderSimulates(Decoder<input_count, output_count>& decoder)
+    {
+        TimerSimulator sim(decoder.GetCubegrid(), decoder.Log());
+        std::vector<TimerSimulator::HookIndex> inputs;
+        for (unsigned i = 0; i <= input_count; i++)
+            inputs.push_back(sim.Resolve(decoder.GetHook(i)));
+        // settle every input pair once, the way a DebugInput press would
+        for (unsigned i = 0; i <= input_count; i++)
+        {
+            sim.Drive(inputs[i], true);
+            sim.Drive(inputs[i], false);
+        }
+        std::vector<ICubeBlock*> lights = decoder.Lights();
+        unsigned wrong = 0;
+        for (unsigned enable = 0; enable < 2; enable++)
+        {
+            sim.Drive(inputs[input_count], enable);
+            for (unsigned value = 0; value < output_count; value++)
+            {
+                for (unsigned i = 0; i < input_count; i++)
+                    sim.Drive(inputs[i], (value >> i) & 1);
+                for (unsigned pulse = 0; pulse < decoder.Latency(); pulse++)
+                    sim.Trigger(decoder.GetClock()->timer);
+                for (unsigned o = 0; o < output_count; o++)
+                {
+                    bool expected = enable && o == value;
+                    wrong += sim.Read(decoder.GetOutput(o)) != expected;
+                    wrong += sim.IsEnabled(*lights[input_count + o]) != expected;
+                }
+            }
+        }
+        Expect(wrong == 0, std::to_string(wrong) + " wrong outputs or lights");
+    }
+
+    void SimulateDecoder()
+    {
+        Decoder<3, 8> decoder("SIM");
+        ExpectDecoderSimulates(decoder);
+    }
+
+    /* A decoder's grid is its netlist lowered, nothing built on the side:
+       a gate node with p pins is p+1 timer pairs and an updater */
+    void DecoderEmitsItsNetlist()
+    {
+        Decoder<3, 8> decoder("NET", true);
+        const Netlist& netlist = decoder.GetNetlist();
+        std::size_t blocks = 0;
+        for (Netlist::NodeId node = 0; node < netlist.size(); ++node)
+            if (netlist.Kind(node) != Netlist::INPUT)
+                blocks += 2 * (netlist.PinCount(node) + 1) + 1;
+        Expect(decoder.GetCubegrid().blocks.size() == blocks, std::to_string(decoder.GetCubegrid().blocks.size()) + " blocks for "
+               + std::to_string(blocks) + " in the netlist");
+        Expect(netlist.Outputs().size() == 8, "decoder outputs are declared");
+    }
+
+    /* No gate of a decoder drives more readers than one timer's toolbar
+       holds direct entries for */
+    void DecoderFanoutFitsToolbar()
+    {
+        Decoder<6, 64> decoder("FAN", true);
+        const Netlist& netlist = decoder.GetNetlist();
+        Netlist::Adjacency fanout = netlist.BuildFanout();
+        uint32_t widest = 0;
+        for (Netlist::NodeId node = 0; node < netlist.size(); ++node)
+            if (netlist.Kind(node) != Netlist::INPUT)
+                widest = std::max(widest, fanout.Count(node));
+        Expect(widest <= ToolbarStrategy().MaxFanout(), "a gate drives " + std::to_string(widest) + " readers");
+        Expect(VerifyDecoder(decoder) == UINT64_MAX, "buffered Decoder<6,64> verifies");
+    }
+
+    /* Predecoder lines only unused outputs read are swept before the
+       decoder is lowered */
+    void DecoderDropsDeadLines()
+    {
+        DecoderOptions kept;
+        kept.predecode = true;
+        kept.reduce = false;
+        DecoderOptions reduced = kept;
+        reduced.reduce = true;
+        RuntimeDecoder full(7, 20, "DEAD", true, kept);
+        RuntimeDecoder swept(7, 20, "DEAD", true, reduced);
+        Expect(swept.GetNetlist().size() < full.GetNetlist().size(), std::to_string(swept.GetNetlist().size()) + " nodes left of "
+               + std::to_string(full.GetNetlist().size()));
+        Expect(swept.GetCubegrid().blocks.size() < full.GetCubegrid().blocks.size(), "fewer blocks emitted");
+        Expect(VerifyDecoder(swept) == UINT64_MAX, "swept decoder verifies");
+    }
+
+    /* A circuit built after another one was destroyed must not see its
+       entries, and decoders record into their own logs only */
+    void SimulateSuccessiveCircuits()
+    {
+        std::size_t before = ToolbarLog::Get().EntryCount();
+        std::size_t nodes[2];
+        for (unsigned round = 0; round < 2; round++)
+        {
+            Decoder<2, 4> decoder("SIM");
+            nodes[round] = TimerSimulator(decoder.GetCubegrid(), decoder.Log()).size();
+            ExpectDecoderSimulates(decoder);
+        }
+        Expect(nodes[0] == nodes[1], "second decoder compiled " + std::to_string(nodes[1]) + " nodes, first " + std::to_string(nodes[0]));
+        Expect(ToolbarLog::Get().EntryCount() == before, "decoders left entries in the thread's log");
+    }
+
+    /* Forgetting the last entry of a log must not drop the members of a
+       group whose entry is yet to be added */
+    void ForgetKeepsPendingGroups()
+    {
+        ToolbarLog log;
+        TimerBlock member;
+        BlockGroup pending;
+        log.AddMember(pending, member);
+        {
+            TimerBlock gone;
+            log.Add(gone, "TriggerNow", member);
+            log.Forget(gone);
+        }
+        std::size_t members = 0;
+        log.ForEachMember(pending, [&members](ICubeBlock*)
+        {
+            ++members;
+        });
+        Expect(members == 1, std::to_string(members) + " members left in the pending group");
+    }
+
+    /* Decoder 2 selected, every address of it driven; decoder 1 must stay
+       low throughout */
+    void ExpectDeviceSimulates(const DecoderOptions& options, const std::string& what)
+    {
+        std::unique_ptr<Device> device(new Device(false, options));
+        TimerSimulator sim(device->GetCubegrids(), device->Logs());
+        Decoder<2,4>& selector = device->GetDecoder2to4();
+        Decoder<6,64>& decoder = device->GetDecoder6to64(2);
+        sim.Drive(selector.GetHook(2), true);
+        sim.Drive(selector.GetHook(1), true);
+        std::vector<TimerSimulator::HookIndex> inputs;
+        for (unsigned i = 0; i < 6; i++)
+        {
+            inputs.push_back(sim.Resolve(decoder.GetHook(i)));
+            sim.Drive(inputs[i], true);
+            sim.Drive(inputs[i], false);
+        }
+        sim.Drive(selector.GetHook(0), true);
+        sim.Drive(selector.GetHook(0), false);
+        unsigned wrong = 0;
+        for (unsigned value = 0; value < 64; value++)
+        {
+            for (unsigned i = 0; i < 6; i++)
+                sim.Drive(inputs[i], (value >> i) & 1);
+            for (unsigned pulse = 0; pulse < device->Latency(); pulse++)
+                sim.Trigger(device->GetClock()->timer);
+            for (unsigned o = 0; o < 64; o++)
+            {
+                wrong += sim.Read(decoder.GetOutput(o)) != (o == value);
+                wrong += sim.Read(device->GetDecoder6to64(1).GetOutput(o));
+            }
+        }
+        Expect(wrong == 0, std::to_string(wrong) + " wrong decoder outputs, " + what);
+    }
+
+    void SimulateDevice()
+    {
+        ExpectDeviceSimulates(DecoderOptions(), "default options");
+    }
+
+    /* Pipeline registers on the decoders' clock: an output only follows
+       its address Latency() pulses later, through the same lowering */
+    void SimulatePipelinedDevice()
+    {
+        DecoderOptions options;
+        options.stageHops = 6;
+        Decoder<6, 64> decoder("PIPE", false, options);
+        Expect(decoder.Latency() > 0 && decoder.GetClock(), "decoder is pipelined");
+        ExpectDecoderSimulates(decoder);
+        Expect(VerifyDecoder(decoder) == UINT64_MAX, "pipelined netlist computes the decoder");
+
+        TimerSimulator sim(decoder.GetCubegrid(), decoder.Log());
+        std::vector<TimerSimulator::HookIndex> inputs;
+        for (unsigned i = 0; i <= 6; i++)
+            inputs.push_back(sim.Resolve(decoder.GetHook(i)));
+        for (unsigned i = 0; i <= 6; i++)
+        {
+            sim.Drive(inputs[i], true);
+            sim.Drive(inputs[i], i == 0 || i == 6);
+        }
+        for (unsigned pulse = 0; pulse < decoder.Latency(); pulse++)
+        {
+            Expect(!sim.Read(decoder.GetOutput(1)), "output " + std::to_string(pulse) + " pulses in is still low");
+            sim.Trigger(decoder.GetClock()->timer);
+        }
+        Expect(sim.Read(decoder.GetOutput(1)), "output follows after the latency");
+
+        ExpectDeviceSimulates(options, "pipelined");
+        std::unique_ptr<Device> device(new Device(false, options));
+        Expect(device->GetClock() && device->GetClock()->size() > 0, "modules share the device clock");
+        Expect(!device->GetDecoder2to4().GetClock() || device->GetDecoder2to4().GetClock() == device->GetClock(), "selector on the device clock");
+    }
+
+    /* The decoders emitted from their predecoded, minimised netlists */
+    void SimulateMinimizedDevice()
+    {
+        DecoderOptions options;
+        options.predecode = true;
+        options.minimize = true;
+        ExpectDeviceSimulates(options, "predecoded and minimised");
+        Decoder<3, 8> decoder("SIM", false, options);
+        ExpectDecoderSimulates(decoder);
+        Expect(VerifyDecoder(decoder) == UINT64_MAX, "constructed minimised Decoder<3,8>");
+    }
+
+    std::size_t Count(const std::string& text, const std::string& what)
+    {
+        std::size_t count = 0;
+        for (std::size_t at = text.find(what); at != std::string::npos; at = text.find(what, at + what.size()))
+            ++count;
+        return count;
+    }
+
+    /* `text` with every EntityId, and every toolbar BlockEntityId pointing
+       at one, renumbered from 1 in order of appearance, so blueprints built
+       from different blocks can be compared; by default also without the
+       whitespace between tags */
+    std::string Normalized(const std::string& text, bool dropWhitespace = true)
+    {
+        std::string result;
+        std::map<std::string, std::size_t> ids;
+        for (std::size_t i = 0; i < text.size(); )
+        {
+            if (dropWhitespace && std::isspace(static_cast<unsigned char>(text[i])))
+            {
+                std::size_t end = i;
+                while (end < text.size() && std::isspace(static_cast<unsigned char>(text[end])))
+                    ++end;
+                bool betweenTags = (i == 0 || text[i - 1] == '>') && (end == text.size() || text[end] == '<');
+                if (!betweenTags)
+                    result.append(text, i, end - i);
+                i = end;
+                continue;
+            }
+            result += text[i++];
+            for (const char* tag : {"<EntityId>", "<BlockEntityId>"})
+            {
+                std::size_t length = std::strlen(tag);
+                if (result.size() < length || result.compare(result.size() - length, length, tag) != 0)
+                    continue;
+                std::size_t end = text.find('<', i);
+                std::string id = text.substr(i, end - i);
+                ids.insert(std::make_pair(id, ids.size() + 1));
+                result += std::to_string(ids[id]);
+                i = end;
+            }
+        }
+        return result;
+    }
+
+    /* Text written to a string by one decoder streamed on its own */
+    std::string StreamedDecoder(bool merge)
+    {
+        Decoder<6, 64> decoder("TEST");
+        std::stringbuf sink;
+        BlueprintStreamWriter writer(&sink, merge);
+        decoder.StreamTo(writer);
+        writer.Finish();
+        return sink.str();
+    }
+
+    /* Large grids go through the writer's buffer in pieces; the text must
+       come out the same as printing the whole Blueprint */
+    void StreamGridFilter()
+    {
+        Decoder<6, 64> decoder("TEST");
+        Blueprint blueprint;
+        blueprint.Cubegrids.push_back(decoder.GetStdMoveCubegrid());
+        std::ostringstream printed;
+        blueprint.Print(printed, false);
+
+        std::stringbuf sink;
+        {
+            BlueprintStreamWriter writer(&sink);
+            writer.Write(std::move(blueprint.Cubegrids[0]));
+        }
+        Expect(printed.str().size() > (1 << 16), "grid larger than the filter buffer");
+        Expect(sink.str() == printed.str(), "streamed grid matches Blueprint::Print");
+        Expect(Normalized(StreamedDecoder(true)) == Normalized(StreamedDecoder(false)), "a single merged grid is written unchanged");
+    }
+
+    /* Grids merged through a SpoolFile come out as if every grid had been
+       written to the merging writer directly */
+    void StreamSpooledGrids()
+    {
+        std::string direct;
+        std::string spooled;
+        for (bool spool : {false, true})
+        {
+            Decoder<4, 16> first("FIRST");
+            Decoder<4, 16> second("SECOND");
+            Decoder<4, 16> third("THIRD");
+            std::stringbuf sink;
+            {
+                BlueprintStreamWriter writer(&sink, true);
+                first.StreamTo(writer);
+                if (spool)
+                {
+                    SpoolFile later;
+                    {
+                        BlueprintStreamWriter laterWriter(&later, true);
+                        second.StreamTo(laterWriter);
+                        third.StreamTo(laterWriter);
+                    }
+                    writer.Write(later);
+                }
+                else
+                {
+                    second.StreamTo(writer);
+                    third.StreamTo(writer);
+                }
+                writer.Finish();
+            }
+            (spool ? spooled : direct) = Normalized(sink.str(), false);
+        }
+        Expect(Count(direct, "<CubeGrid>") == 1 && Count(direct, "SECOND") > 0, "grids merged into the first");
+        Expect(spooled == direct, "spooled grids merge the same way");
+    }
+
+    /* Every Device writer must produce the one grid BuildXml does, so
+       toolbar entries can reach blocks of other decoders */
+    void StreamDeviceAsOneGrid()
+    {
+        std::string built;
+        {
+            std::unique_ptr<Device> device(new Device);
+            device->BuildXml("tests_build.sbc");
+            built = ReadFile("tests_build.sbc");
+        }
+        Expect(Count(built, "<CubeGrid>") == 1, "BuildXml writes one grid");
+        {
+            std::unique_ptr<Device> device(new Device);
+            device->StreamXml("tests_stream.sbc");
+        }
+        std::string streamed = ReadFile("tests_stream.sbc");
+        Expect(Count(streamed, "<CubeGrid>") == 1, "StreamXml writes one grid");
+        Expect(Normalized(streamed) == Normalized(built), "StreamXml writes what BuildXml does");
+        {
+            std::unique_ptr<Device> device(new Device);
+            device->Wire();
+            device->StreamXml("tests_stream_built.sbc");
+        }
+        Expect(Normalized(ReadFile("tests_stream_built.sbc")) == Normalized(built), "StreamXml of a built Device writes the same");
+        {
+            std::unique_ptr<Device> device(new Device);
+            device->ParallelStreamXml(3, "tests_parallel.sbc");
+        }
+        std::string parallel = ReadFile("tests_parallel.sbc");
+        Expect(Count(parallel, "<CubeGrid>") == 1, "ParallelStreamXml writes one grid");
+        Expect(Normalized(parallel) == Normalized(built), "ParallelStreamXml writes what BuildXml does");
+        Device::StreamInstancedXml(false, "tests_instanced.sbc");
+        std::string instanced = ReadFile("tests_instanced.sbc");
+        Expect(Count(instanced, "<CubeGrid>") == 1, "StreamInstancedXml writes one grid");
+        Expect(Normalized(instanced, false) == Normalized(streamed, false), "StreamInstancedXml writes byte for byte what StreamXml does");
+        for (const char* path : {"tests_build.sbc", "tests_stream.sbc", "tests_stream_built.sbc", "tests_parallel.sbc",
+                                 "tests_instanced.sbc"})
+            std::remove(path);
+    }
+
+    /* A second run takes both modules from the cache and writes the same
+       file. A module built under another name, strategy or options gets
+       its own key, and a corrupt file is rebuilt instead of read. */
+    void CacheDevice()
+    {
+        {
+            FragmentCache cache("tests_fragments");
+            Device::StreamCachedXml(cache, false, "tests_cached.sbc");
+            std::string built = ReadFile("tests_cached.sbc");
+            Device::StreamCachedXml(cache, false, "tests_cached.sbc");
+            Expect(cache.Misses() == 2 && cache.Hits() == 2, "second run hits the cache");
+            Expect(ReadFile("tests_cached.sbc") == built, "cached run writes the same file");
+            uint64_t key = DeviceModuleKey("Decoder<6,64>", "DEC64-0", 6, 64, false).Value();
+            Expect(key != DeviceModuleKey("Decoder<6,64>", "DEC64-1", 6, 64, false).Value(), "name is part of the key");
+            Expect(key != DeviceModuleKey("Decoder<6,64>", "DEC64-0", 6, 64, true).Value(), "release is part of the key");
+            ToolbarStrategy strategy;
+            strategy.groupCost = 2.0;
+            Expect(key != DeviceModuleKey("Decoder<6,64>", "DEC64-0", 6, 64, false, DecoderOptions(), strategy).Value(),
+                   "toolbar strategy is part of the key");
+            DecoderOptions options;
+            options.predecode = true;
+            Expect(key != DeviceModuleKey("Decoder<6,64>", "DEC64-0", 6, 64, false, options).Value(),
+                   "the netlist the options lower is part of the key");
+
+            // a string size far beyond the file, which would not even fit in memory
+            for (const auto& entry : std::filesystem::directory_iterator("tests_fragments"))
+            {
+                std::ofstream corrupt(entry.path(), std::ios::binary | std::ios::trunc);
+                corrupt.write("SEFRAG01", 8);
+                for (unsigned i = 0; i < 8; i++)
+                    corrupt.put(static_cast<char>(i == 4 ? 0x80 : 0));
+            }
+            Device::StreamCachedXml(cache, false, "tests_cached.sbc");
+            Expect(cache.Misses() == 4 && cache.Hits() == 2, "corrupt files are misses");
+            Expect(ReadFile("tests_cached.sbc") == built, "rebuilt run writes the same file");
+        }
+        std::remove("tests_cached.sbc");
+        std::filesystem::remove_all("tests_fragments");
+    }
+
+    std::string ReadGzipFile(const std::string& path)
+    {
+        std::string text;
+        gzFile file = gzopen(path.c_str(), "rb");
+        if (!file)
+            return text;
+        char buffer[1 << 16];
+        int read;
+        while ((read = gzread(file, buffer, sizeof(buffer))) > 0)
+            text.append(buffer, static_cast<std::size_t>(read));
+        Expect(read == 0 && gzclose(file) == Z_OK, path + " read to the end");
+        return text;
+    }
+
+    /* The gzipped blueprint decompresses to what the plain writer puts out */
+    void GzipRoundTrip()
+    {
+        std::string plain;
+        {
+            std::unique_ptr<Device> device(new Device);
+            device->StreamXml("tests_plain.sbc");
+            plain = ReadFile("tests_plain.sbc");
+        }
+        std::string streamed;
+        {
+            std::unique_ptr<Device> device(new Device);
+            device->StreamXml<GzipFileSink>("tests_stream.sbc.gz");
+            streamed = ReadGzipFile("tests_stream.sbc.gz");
+        }
+        Expect(!streamed.empty() && Normalized(streamed) == Normalized(plain), "StreamXml gzipped round trip");
+        Expect(ReadFile("tests_stream.sbc.gz").size() < plain.size() / 4, "gzipped file is smaller");
+        std::string built;
+        {
+            std::unique_ptr<Device> device(new Device);
+            device->BuildXml<GzipFileSink>("tests_build.sbc.gz");
+            built = ReadGzipFile("tests_build.sbc.gz");
+        }
+        Expect(Normalized(built) == Normalized(plain), "BuildXml gzipped round trip");
+        {
+            FragmentCache cache("tests_fragments");
+            Device::StreamCachedXml(cache, false, "tests_cached.sbc");
+            Device::StreamCachedXml<GzipFileSink>(cache, false, "tests_cached.sbc.gz");
+            Expect(ReadGzipFile("tests_cached.sbc.gz") == ReadFile("tests_cached.sbc"), "cached gzipped round trip is byte for byte");
+        }
+
+        GzipFileSink sink("tests_close.sbc.gz");
+        Expect(sink.is_open() && sink.sputn("<x/>", 4) == 4, "gzip sink takes text");
+        Expect(sink.Close(), "gzip sink closes");
+        Expect(!sink.Close(), "closing twice is reported");
+        Expect(!GzipFileSink("tests_no_such_directory/bp.sbc.gz").is_open(), "unwritable gzip destination is reported");
+        for (const char* path : {"tests_plain.sbc", "tests_stream.sbc.gz", "tests_build.sbc.gz", "tests_cached.sbc",
+                                 "tests_cached.sbc.gz", "tests_close.sbc.gz"})
+            std::remove(path);
+        std::filesystem::remove_all("tests_fragments");
+    }
+
+    /* Printing on more threads must not change a byte: the same fragment
+       copies on 1 and 4 workers, and the Device, built concurrently,
+       against StreamXml */
+    void ParallelMatchesSerial()
+    {
+        Decoder<6, 64> decoder("TEST");
+        Fragment fragment(decoder.GetCubegrid(), "TEST");
+        std::vector<Fragment::Instance> instances(8);
+        for (std::size_t i = 0; i < instances.size(); i++)
+        {
+            instances[i].name = "COPY-" + std::to_string(i);
+            instances[i].z = static_cast<int64_t>(i) * fragment.Extent().z;
+            instances[i].firstId = 1 + i * fragment.IdCount();
+        }
+        std::string serial;
+        for (unsigned threads : {1u, 4u})
+        {
+            std::stringbuf sink;
+            {
+                BlueprintStreamWriter writer(&sink, true);
+                writer.Write(fragment, instances, threads);
+            }
+            if (threads == 1)
+                serial = sink.str();
+            else Expect(sink.str() == serial, "fragment copies on " + std::to_string(threads) + " threads");
+        }
+
+        std::string streamed;
+        {
+            std::unique_ptr<Device> device(new Device);
+            device->StreamXml("tests_stream.sbc");
+            streamed = Normalized(ReadFile("tests_stream.sbc"));
+        }
+        for (unsigned threads : {1u, 2u, 8u})
+        {
+            std::unique_ptr<Device> device(new Device);
+            device->ParallelStreamXml(threads, "tests_parallel.sbc");
+            Expect(Normalized(ReadFile("tests_parallel.sbc")) == streamed, "ParallelStreamXml on " + std::to_string(threads) + " threads");
+        }
+        std::remove("tests_stream.sbc");
+        std::remove("tests_parallel.sbc");
+
+        bool rethrown = false;
+        try
+        {
+            ParallelFor(64, [](std::size_t i)
+            {
+                if (i == 17)
+                    throw std::runtime_error("job 17");
+            }, 4);
+        }
+        catch (const std::runtime_error& error)
+        {
+            rethrown = std::string(error.what()) == "job 17";
+        }
+        Expect(rethrown, "a job's exception is rethrown");
+
+        std::vector<std::size_t> order;
+        ParallelOrdered(100, [](std::size_t i)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds((i * 37) % 200));
+            return i * i;
+        }, [&order](std::size_t i, std::size_t square)
+        {
+            if (square == i * i)
+                order.push_back(i);
+        }, 4);
+        bool ordered = order.size() == 100;
+        for (std::size_t i = 0; ordered && i < order.size(); i++)
+            ordered = order[i] == i;
+        Expect(ordered, "the work queue consumes every result in order");
+        for (bool inConsume : {false, true})
+        {
+            rethrown = false;
+            try
+            {
+                ParallelOrdered(64, [inConsume](std::size_t i)
+                {
+                    if (!inConsume && i == 17)
+                        throw std::runtime_error("job 17");
+                    return i;
+                }, [inConsume](std::size_t i, std::size_t)
+                {
+                    if (inConsume && i == 17)
+                        throw std::runtime_error("job 17");
+                }, 4);
+            }
+            catch (const std::runtime_error& error)
+            {
+                rethrown = std::string(error.what()) == "job 17";
+            }
+            Expect(rethrown, inConsume ? "a consumer's exception is rethrown" : "a producer's exception is rethrown");
+        }
+    }
+
+    /* A number that merely equals an EntityId, here in a block's name, is
+       not an id and must come out of every copy unchanged */
+    void FragmentPatchesOnlyIds()
+    {
+        TimerBlock owner;
+        TimerBlock target;
+        std::string name = "after " + std::to_string(target.GetEntityId());
+        owner.CustomName = name;
+        ToolbarLog::AddEntry(owner, "TriggerNow", target);
+        CubeGrid cubegrid;
+        cubegrid.blocks.AddBlock(owner);
+        cubegrid.blocks.AddBlock(target);
+        Fragment fragment(cubegrid);
+        Fragment::Instance instance;
+        instance.firstId = 7;
+        std::stringbuf sink;
+        fragment.Instantiate(&sink, instance);
+        std::string copy = sink.str();
+        Expect(copy.find("<EntityId>7</EntityId>") != std::string::npos && copy.find("<EntityId>8</EntityId>") != std::string::npos,
+               "blocks get the copy's ids");
+        Expect(copy.find("<BlockEntityId>8</BlockEntityId>") != std::string::npos, "toolbar entry points at the copy's block");
+        Expect(copy.find(name) != std::string::npos, "name that looks like an id is kept");
+        ToolbarLog::Get().Forget(owner);
+    }
+
+    /* Only the marker as a whole word of a name is patched: a longer name
+       that starts with it belongs to another module and stays as it is */
+    void FragmentPatchesWholeNames()
+    {
+        TimerBlock marked;
+        TimerBlock longer;
+        marked.CustomName = "AND DEC64-0 5";
+        longer.CustomName = "AND DEC64-00 5";
+        CubeGrid cubegrid;
+        cubegrid.blocks.AddBlock(marked);
+        cubegrid.blocks.AddBlock(longer);
+        Fragment fragment(cubegrid, "DEC64-0");
+        Fragment::Instance instance;
+        instance.name = "DEC64-3";
+        std::stringbuf sink;
+        fragment.Instantiate(&sink, instance);
+        std::string copy = sink.str();
+        Expect(copy.find("<CustomName>AND DEC64-3 5</CustomName>") != std::string::npos, "marker renamed");
+        Expect(copy.find("<CustomName>AND DEC64-00 5</CustomName>") != std::string::npos, "longer name kept");
+    }
+
+    /* Pairs stay with their manager after a hand-out: a connection made
+       later is written at the next one, one never written is reported */
+    void LateConnectionsWritten()
+    {
+        TimerPair source;
+        TimerPair target;
+        TimerPair stray;
+        CircuitCubegridManager manager;
+        manager.AddTimers(source);
+        manager.AddTimers(target);
+        manager.GetCubegrid();
+        source.Connect(target);
+        manager.GetCubegrid();
+        Expect(ToolbarLog::Get().EntryCount(source.timerLow) > 0, "connection made after a hand-out is written");
+        stray.Connect(target);
+        bool reported = false;
+        try
+        {
+            stray.CheckWritten();
+        }
+        catch (const std::logic_error&)
+        {
+            reported = true;
+        }
+        Expect(reported, "pair never added to a manager is reported");
+        CircuitCubegridManager other;
+        other.AddTimers(stray);
+        other.GetStdMoveCubegrid();
+        bool movedOut = false;
+        try
+        {
+            other.GetCubegrid();
+        }
+        catch (const std::logic_error&)
+        {
+            movedOut = true;
+        }
+        Expect(movedOut, "a grid moved out can't be handed out again");
+    }
+
+    /* Pair names render from their segments as soon as a gate is renamed,
+       so the simulator and profiler can show them, and are written into
+       the blocks once the grid is handed out */
+    void NamesBeforeEmission()
+    {
+        NotGate gate;
+        gate.AppendToName(" X 1");
+        Expect(gate.output.Name(TimerPair::LOW) == "NOT output L X 1", "output low named " + gate.output.Name(TimerPair::LOW));
+        Expect(gate.updater.CustomName() == "NOT updater X 1", "updater named " + gate.updater.CustomName());
+        CircuitCubegridManager manager;
+        manager.AddGate(gate);
+        manager.GetCubegrid();
+        Expect(gate.output.timerHigh.CustomName() == "NOT output H X 1", "output high block named " + gate.output.timerHigh.CustomName());
+        Expect(gate.inputs[0].timerLow.CustomName() == "NOT input A L X 1", "input low block named " + gate.inputs[0].timerLow.CustomName());
+    }
+
+    /* Entries of `owner` that go through a group */
+    std::size_t GroupEntries(const TimerBlock& owner)
+    {
+        std::size_t count = 0;
+        ToolbarLog::Get().ForEachEntry(owner, [&count](const ToolbarLog::Entry& entry)
+        {
+            count += entry.group != nullptr;
+        });
+        return count;
+    }
+
+    /* The strategy is applied by the grid's manager, so it also covers the
+       gate templates: a NOT input with one target gets direct entries even
+       though NotGate defaults to groups, an output driving many gets groups */
+    void StrategyCoversTemplates()
+    {
+        NotGate source;
+        std::unique_ptr<GateArray<AndGate<1>, 16>> targets(new GateArray<AndGate<1>, 16>);
+        for (unsigned i = 0; i < 16; i++)
+            source.HookOutputTo(targets->gates[i].GetHook(0));
+        CircuitCubegridManager manager;
+        manager.AddGate(source);
+        targets->AddTo(manager);
+        CubeGrid& cubegrid = manager.GetCubegrid();
+        Expect(GroupEntries(source.inputs[0].timerLow) == 0, "single target gets direct entries");
+        Expect(GroupEntries(source.output.timerLow) == 3, "16 targets go through groups");
+
+        TimerSimulator sim(cubegrid);
+        sim.Drive(source.GetHook(0), true);
+        unsigned wrong = 0;
+        for (unsigned i = 0; i < 16; i++)
+            wrong += sim.Read(targets->gates[i].output);
+        sim.Drive(source.GetHook(0), false);
+        for (unsigned i = 0; i < 16; i++)
+            wrong += !sim.Read(targets->gates[i].output);
+        Expect(wrong == 0, std::to_string(wrong) + " wrong targets");
+    }
+
+    /* A timer whose toolbar is nearly full of other entries must switch to
+       groups, placed after those entries instead of over them */
+    void StrategyCountsExistingEntries()
+    {
+        AndGate<1> source;
+        AndGate<1> target;
+        std::vector<std::unique_ptr<InteriorLight>> lights;
+        for (unsigned i = 0; i < 79; i++)
+        {
+            lights.emplace_back(new InteriorLight);
+            ToolbarLog::AddEntry(source.output.timerLow, "OnOff_Off", *lights.back());
+            ToolbarLog::AddEntry(source.output.timerHigh, "OnOff_On", *lights.back());
+        }
+        source.HookOutputTo(target.GetHook(0));
+        CircuitCubegridManager manager;
+        manager.AddGate(source);
+        manager.AddGate(target);
+        CubeGrid& cubegrid = manager.GetCubegrid();
+        Expect(GroupEntries(source.output.timerLow) == 3, "full toolbar switches to groups");
+        Expect(ToolbarLog::Get().EntryCount(source.output.timerLow) == 82, "existing entries are kept");
+        Expect(ToolbarLog::Get().NextSlot(source.output.timerLow) == 82, "groups come after the existing entries");
+
+        TimerSimulator sim(cubegrid);
+        sim.Drive(source.GetHook(0), true);
+        bool on = sim.Read(target.output);
+        sim.Drive(source.GetHook(0), false);
+        Expect(on && !sim.Read(target.output), "target follows the source");
+        ToolbarLog::Get().Forget(source.output.timerLow);
+        ToolbarLog::Get().Forget(source.output.timerHigh);
+    }
+
+    std::vector<TestCase> Cases()
+    {
+        return {
+            {"verify/decoders", VerifyDecoders},
+            {"verify/first-mismatch", VerifyReportsFirstMismatch},
+            {"optimize/minimize-nested", MinimizeNestedGates},
+            {"optimize/simplify-open-pins", SimplifyOpenPins},
+            {"optimize/extract-requeue", ExtractRequeuesReducedPairs},
+            {"simulator/decoder", SimulateDecoder},
+            {"lowering/decoder-netlist", DecoderEmitsItsNetlist},
+            {"lowering/decoder-fanout", DecoderFanoutFitsToolbar},
+            {"lowering/decoder-dead-lines", DecoderDropsDeadLines},
+            {"simulator/successive-circuits", SimulateSuccessiveCircuits},
+            {"toolbarlog/forget-keeps-pending-groups", ForgetKeepsPendingGroups},
+            {"simulator/device", SimulateDevice},
+            {"simulator/device-minimized", SimulateMinimizedDevice},
+            {"simulator/device-pipelined", SimulatePipelinedDevice},
+            {"names/before-emission", NamesBeforeEmission},
+            {"manager/late-connections", LateConnectionsWritten},
+            {"strategy/templates", StrategyCoversTemplates},
+            {"strategy/existing-entries", StrategyCountsExistingEntries},
+            {"patch/write", PatchWrites},
+            {"stream/grid-filter", StreamGridFilter},
+            {"stream/spooled-grids", StreamSpooledGrids},
+            {"stream/device-one-grid", StreamDeviceAsOneGrid},
+            {"instancing/only-ids-patched", FragmentPatchesOnlyIds},
+            {"instancing/whole-names-patched", FragmentPatchesWholeNames},
+            {"parallel/matches-serial", ParallelMatchesSerial},
+            {"cache/device", CacheDevice},
+            {"compression/gzip-round-trip", GzipRoundTrip},
+        };
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string filter;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc)
+            filter = argv[++i];
+        else
+        {
+            std::cout<<"Usage: "<<argv[0]<<" [--filter text]\n";
+            return 2;
+        }
+    }
+
+    unsigned run = 0;
+    for (const TestCase& test : Cases())
+    {
+        if (test.name.find(filter) == std::string::npos)
+            continue;
+        std::cout<<test.name<<"\n";
+        unsigned before = failures;
+        test.run();
+        if (failures == before)
+            std::cout<<"    ok\n";
+        ++run;
+    }
+    std::cout<<run<<" cases, "<<failures<<" failed checks\n";
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,146 @@
+#ifndef H_TIMING
+#define H_TIMING
+
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include "netlist.h"
+
+/* Hop-count timing of a netlist. A change reaching a gate costs three
+   TriggerNow hops before its output can pass it on: the updater, the input
+   timers it triggers, and the output timers those trigger. Primary inputs
+   and open pins arrive at hop 0. A REGISTER starts over: its output is one
+   hop after the clock, and the signal it samples ends a path like an
+   output does, so arrivals and budget are per clock cycle. */
+class TimingAnalysis
+{
+    public:
+        enum : unsigned {HOPS_PER_GATE = 3};
+
+    private:
+        const Netlist& netlist;
+        std::vector<uint32_t> arrival;
+        std::vector<uint32_t> required;
+        std::vector<Netlist::NodeId> order;
+        uint32_t budget;
+
+        static unsigned Cost(Netlist::KIND kind)
+        {
+            return kind == Netlist::INPUT ? 0u : static_cast<unsigned>(HOPS_PER_GATE);
+        }
+        /* Outputs and the nodes sampled by registers */
+        std::vector<Netlist::NodeId> Endpoints() const
+        {
+            std::vector<Netlist::NodeId> endpoints = netlist.Outputs();
+            for (Netlist::NodeId node = 0; node < netlist.size(); ++node)
+                if (netlist.Kind(node) == Netlist::REGISTER && netlist.Fanin(node)[0] != Netlist::NONE)
+                    endpoints.push_back(netlist.Fanin(node)[0]);
+            return endpoints;
+        }
+
+    public:
+        /* budget of 0 means the worst output arrival */
+        TimingAnalysis(const Netlist& _netlist, uint32_t _budget = 0) : netlist(_netlist)
+        {
+            order = netlist.TopologicalOrder(true);
+            arrival.assign(netlist.size(), 0);
+            for (Netlist::NodeId node : order)
+            {
+                uint32_t latest = 0;
+                const Netlist::NodeId* fanin = netlist.Fanin(node);
+                for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+                    if (fanin[i] != Netlist::NONE)
+                        latest = std::max(latest, arrival[fanin[i]]);
+                arrival[node] = netlist.Kind(node) == Netlist::REGISTER ? 1 : latest + Cost(netlist.Kind(node));
+            }
+
+            budget = _budget ? _budget : WorstArrival();
+            required.assign(netlist.size(), UINT32_MAX);
+            for (Netlist::NodeId node : Endpoints())
+                required[node] = budget;
+            for (std::size_t k = order.size(); k-- > 0;)
+            {
+                Netlist::NodeId node = order[k];
+                if (required[node] == UINT32_MAX || netlist.Kind(node) == Netlist::REGISTER)
+                    continue;
+                uint32_t before = required[node] >= Cost(netlist.Kind(node)) ? required[node] - Cost(netlist.Kind(node)) : 0;
+                const Netlist::NodeId* fanin = netlist.Fanin(node);
+                for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+                    if (fanin[i] != Netlist::NONE)
+                        required[fanin[i]] = std::min(required[fanin[i]], before);
+            }
+        }
+
+        uint32_t Arrival(Netlist::NodeId node) const
+        {
+            return arrival[node];
+        }
+        /* Hops to spare before the node delays an output or a register past
+           the budget; negative when it already does, INT64_MAX when it
+           reaches neither */
+        int64_t Slack(Netlist::NodeId node) const
+        {
+            if (required[node] == UINT32_MAX)
+                return INT64_MAX;
+            return int64_t(required[node]) - int64_t(arrival[node]);
+        }
+        uint32_t WorstArrival() const
+        {
+            uint32_t worst = 0;
+            for (Netlist::NodeId node : Endpoints())
+                worst = std::max(worst, arrival[node]);
+            return worst;
+        }
+        uint32_t Budget() const
+        {
+            return budget;
+        }
+
+        /* From a source or register to `output`, always following the
+           latest input */
+        std::vector<Netlist::NodeId> CriticalPath(Netlist::NodeId output) const
+        {
+            std::vector<Netlist::NodeId> path;
+            Netlist::NodeId node = output;
+            while (node != Netlist::NONE)
+            {
+                path.push_back(node);
+                if (netlist.Kind(node) == Netlist::REGISTER && path.size() > 1)
+                    break;
+                Netlist::NodeId latest = Netlist::NONE;
+                const Netlist::NodeId* fanin = netlist.Fanin(node);
+                for (unsigned i = 0; i < netlist.PinCount(node); ++i)
+                    if (fanin[i] != Netlist::NONE && (latest == Netlist::NONE || arrival[fanin[i]] > arrival[latest]))
+                        latest = fanin[i];
+                node = latest;
+            }
+            std::reverse(path.begin(), path.end());
+            return path;
+        }
+        std::vector<Netlist::NodeId> CriticalPath() const
+        {
+            Netlist::NodeId worst = Netlist::NONE;
+            for (Netlist::NodeId node : Endpoints())
+                if (worst == Netlist::NONE || arrival[node] > arrival[worst])
+                    worst = node;
+            return worst == Netlist::NONE ? std::vector<Netlist::NodeId>() : CriticalPath(worst);
+        }
+
+        void Print(std::ostream& output) const
+        {
+            output<<"Budget: "<<budget<<" hops, worst output: "<<WorstArrival()<<" hops"<<std::endl;
+            for (std::size_t i = 0; i < netlist.Outputs().size(); ++i)
+            {
+                Netlist::NodeId node = netlist.Outputs()[i];
+                output<<"  output "<<i<<" ("<<Netlist::KindName(netlist.Kind(node))<<netlist.Label(node)<<"): "
+                      <<arrival[node]<<" hops, slack "<<Slack(node)<<std::endl;
+            }
+            output<<"Critical path:"<<std::endl;
+            for (Netlist::NodeId node : CriticalPath())
+                output<<"  "<<arrival[node]<<"\t"<<Netlist::KindName(netlist.Kind(node))<<netlist.Label(node)
+                      <<" #"<<node<<std::endl;
+        }
+};
+
+#endif // H_TIMING
@@ -0,0 +1,390 @@
+#ifndef H_TOOLBARLOG
+#define H_TOOLBARLOG
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "blueprintlib/blueprint.h"
+#include "blueprintlib/blocks.h"
+#include "arena.h"
+
+class TimerPair;
+
+/* Mirror of every toolbar entry and group membership created by the gates,
+   kept so the circuit can be analysed without going through the serialized
+   blueprint. Blocks and groups are keyed by address, the same way CubeGrid
+   already refers to them, so they have to stay in place once wired. Every
+   class owning a toolbar forgets its entries when it is destroyed, so the
+   log only describes blocks that are still alive.
+   There is one log per circuit, not per process: gates record into the log
+   Get() returns on their thread when they are built and keep using that
+   one. A Scope makes a circuit's own log current while it is built, so
+   circuits built on different threads share nothing.
+   The per-block and per-group maps live on the log's CircuitArena and
+   everything is chained through pools, so recording an entry does not go
+   to the heap; the arena is given back at once when the log forgets its
+   last block and group. */
+class ToolbarLog
+{
+    public:
+        enum ACTION {ON = 0, OFF = 1, TOGGLE = 2, TRIGGER = 3, UNKNOWN = 4};
+
+        struct Entry
+        {
+            ACTION action;
+            ICubeBlock* block;
+            BlockGroup* group;
+            int slot;
+        };
+
+        /* A connection a pair recorded and its manager has not written
+           yet; `block` is set for an updater target, `pair` otherwise */
+        struct Connection
+        {
+            TimerPair* pair;
+            TimerBlock* block;
+            bool negate;
+            bool update;
+        };
+
+    private:
+        enum : uint32_t {END = UINT32_MAX};
+
+        /* All entries and group members live in two flat pools, chained per
+           owner, instead of one small vector per block */
+        struct EntryLink
+        {
+            Entry entry;
+            uint32_t next;
+        };
+        struct MemberLink
+        {
+            ICubeBlock* block;
+            uint32_t next;
+        };
+        struct ConnectionLink
+        {
+            Connection connection;
+            uint32_t next;
+        };
+        struct Chain
+        {
+            uint32_t first;
+            uint32_t last;
+        };
+        template <typename Key> using ChainMap = std::unordered_map<Key, Chain, std::hash<Key>, std::equal_to<Key>,
+                                                                    ArenaAllocator<std::pair<const Key, Chain>>>;
+
+        CircuitArena arena;
+        std::vector<EntryLink> entryPool;
+        std::vector<MemberLink> memberPool;
+        std::vector<ConnectionLink> connectionPool;
+        ChainMap<const ICubeBlock*> entries;
+        ChainMap<const BlockGroup*> members;
+        std::size_t liveEntries = 0;
+        std::size_t pendingConnections = 0;
+
+        static ToolbarLog*& Current()
+        {
+            static thread_local ToolbarLog* current = nullptr;
+            return current;
+        }
+
+        void Insert(const ICubeBlock& owner, Entry entry)
+        {
+            uint32_t link = static_cast<uint32_t>(entryPool.size());
+            auto found = entries.find(&owner);
+            if (found == entries.end())
+            {
+                if (entry.slot < 0)
+                    entry.slot = 0;
+                entryPool.push_back(EntryLink{entry, END});
+                entries.emplace(&owner, Chain{link, link});
+                ++liveEntries;
+                return;
+            }
+            Chain& chain = found->second;
+            if (entry.slot < 0)
+                entry.slot = entryPool[chain.last].entry.slot + 1;
+            uint32_t previous = END;
+            for (uint32_t i = chain.first; i != END; previous = i, i = entryPool[i].next)
+            {
+                if (entryPool[i].entry.slot == entry.slot)
+                {
+                    entryPool[i].entry = entry;
+                    return;
+                }
+                if (entryPool[i].entry.slot > entry.slot)
+                {
+                    entryPool.push_back(EntryLink{entry, i});
+                    ++liveEntries;
+                    if (previous == END)
+                        chain.first = link;
+                    else entryPool[previous].next = link;
+                    return;
+                }
+            }
+            entryPool.push_back(EntryLink{entry, END});
+            entryPool[chain.last].next = link;
+            chain.last = link;
+            ++liveEntries;
+        }
+        /* Both maps are empty, so their nodes can go with the arena */
+        void ReleaseArena()
+        {
+            ChainMap<const ICubeBlock*>(entries.get_allocator()).swap(entries);
+            ChainMap<const BlockGroup*>(members.get_allocator()).swap(members);
+            arena.Release();
+        }
+
+    public:
+        /* Makes `log` the one Get() returns on this thread while it lives */
+        class Scope
+        {
+            private:
+                ToolbarLog* previous;
+
+            public:
+                Scope(ToolbarLog& log) : previous(Current())
+                {
+                    Current() = &log;
+                }
+                ~Scope()
+                {
+                    Current() = previous;
+                }
+                Scope(const Scope&) = delete;
+                Scope& operator=(const Scope&) = delete;
+        };
+
+        /* A pair's recorded connections, in the order they were made */
+        class ConnectionList
+        {
+            friend class ToolbarLog;
+
+            private:
+                uint32_t first = END;
+                uint32_t last = END;
+
+            public:
+                bool empty() const
+                {
+                    return first == END;
+                }
+        };
+
+        ToolbarLog() : arena(1 << 16), entries(&arena), members(&arena) {}
+        ToolbarLog(const ToolbarLog&) = delete;
+        ToolbarLog& operator=(const ToolbarLog&) = delete;
+
+        /* The innermost Scope's log, or one kept for the thread outside
+           any scope */
+        static ToolbarLog& Get()
+        {
+            if (ToolbarLog* current = Current())
+                return *current;
+            static thread_local ToolbarLog log;
+            return log;
+        }
+
+        static ACTION ParseAction(const std::string& action)
+        {
+            if (action == "OnOff_On")
+                return ON;
+            else if (action == "OnOff_Off")
+                return OFF;
+            else if (action == "OnOff")
+                return TOGGLE;
+            else if (action == "TriggerNow")
+                return TRIGGER;
+            else return UNKNOWN;
+        }
+
+        void Add(TimerBlock& owner, const std::string& action, ICubeBlock& target)
+        {
+            owner.toolbar.AddEntry(action, target);
+            Insert(owner, Entry{ParseAction(action), &target, nullptr, -1});
+        }
+        void Add(TimerBlock& owner, const std::string& action, ICubeBlock& target, int slot)
+        {
+            owner.toolbar.AddEntry(action, target, slot);
+            Insert(owner, Entry{ParseAction(action), &target, nullptr, slot});
+        }
+        void Add(TimerBlock& owner, const std::string& action, BlockGroup& target, int slot)
+        {
+            owner.toolbar.AddEntry(action, target, slot);
+            Insert(owner, Entry{ParseAction(action), nullptr, &target, slot});
+        }
+        void AddMember(BlockGroup& group, ICubeBlock& block)
+        {
+            group.AddBlock(block);
+            uint32_t link = static_cast<uint32_t>(memberPool.size());
+            memberPool.push_back(MemberLink{&block, END});
+            auto found = members.find(&group);
+            if (found == members.end())
+                members.emplace(&group, Chain{link, link});
+            else
+            {
+                memberPool[found->second.last].next = link;
+                found->second.last = link;
+            }
+        }
+        /* The same, recorded in the current log */
+        static void AddEntry(TimerBlock& owner, std::string action, ICubeBlock& target)
+        {
+            Get().Add(owner, action, target);
+        }
+        static void AddEntry(TimerBlock& owner, std::string action, ICubeBlock& target, int slot)
+        {
+            Get().Add(owner, action, target, slot);
+        }
+        static void AddEntry(TimerBlock& owner, std::string action, BlockGroup& target, int slot)
+        {
+            Get().Add(owner, action, target, slot);
+        }
+        static void AddToGroup(BlockGroup& group, ICubeBlock& block)
+        {
+            Get().AddMember(group, block);
+        }
+
+        void Record(ConnectionList& list, const Connection& connection)
+        {
+            uint32_t link = static_cast<uint32_t>(connectionPool.size());
+            connectionPool.push_back(ConnectionLink{connection, END});
+            if (list.empty())
+                list.first = link;
+            else connectionPool[list.last].next = link;
+            list.last = link;
+            ++pendingConnections;
+        }
+        template <typename Function> void ForEachConnection(const ConnectionList& list, Function function) const
+        {
+            for (uint32_t i = list.first; i != END; i = connectionPool[i].next)
+                function(connectionPool[i].connection);
+        }
+        /* Empties a list once it is written; the pool is reclaimed when no
+           list refers to it */
+        void Drop(ConnectionList& list)
+        {
+            for (uint32_t i = list.first; i != END; i = connectionPool[i].next)
+                --pendingConnections;
+            list = ConnectionList();
+            if (!pendingConnections)
+                connectionPool.clear();
+        }
+
+        template <typename Function> void ForEachEntry(const ICubeBlock& owner, Function function) const
+        {
+            auto found = entries.find(&owner);
+            if (found != entries.end())
+                for (uint32_t i = found->second.first; i != END; i = entryPool[i].next)
+                    function(entryPool[i].entry);
+        }
+        template <typename Function> void ForEachMember(const BlockGroup& group, Function function) const
+        {
+            auto found = members.find(&group);
+            if (found != members.end())
+                for (uint32_t i = found->second.first; i != END; i = memberPool[i].next)
+                    function(memberPool[i].block);
+        }
+        /* Drops the entries of a block about to be destroyed and the
+           members of the groups they use, so a later block or group at the
+           same address starts clean. A pool's space, and the arena once
+           both maps are empty, is reclaimed when nothing refers to it;
+           other groups keep their members. */
+        void Forget(const ICubeBlock& owner)
+        {
+            auto found = entries.find(&owner);
+            if (found == entries.end())
+                return;
+            for (uint32_t i = found->second.first; i != END; i = entryPool[i].next)
+            {
+                if (entryPool[i].entry.group)
+                    members.erase(entryPool[i].entry.group);
+                --liveEntries;
+            }
+            entries.erase(found);
+            if (entries.empty())
+                entryPool.clear();
+            if (members.empty())
+                memberPool.clear();
+            if (entries.empty() && members.empty())
+                this->ReleaseArena();
+        }
+        void Forget(CubeGrid& cubegrid)
+        {
+            for (std::size_t i = 0; i < cubegrid.blocks.size(); ++i)
+                Forget(*cubegrid.blocks[i]);
+        }
+        /* Entries of the blocks still alive */
+        std::size_t EntryCount() const
+        {
+            return liveEntries;
+        }
+        std::size_t EntryCount(const ICubeBlock& owner) const
+        {
+            std::size_t count = 0;
+            ForEachEntry(owner, [&count](const Entry&)
+            {
+                ++count;
+            });
+            return count;
+        }
+        /* Slot an entry added to `owner` without one would get */
+        int NextSlot(const ICubeBlock& owner) const
+        {
+            auto found = entries.find(&owner);
+            return found == entries.end() ? 0 : entryPool[found->second.last].entry.slot + 1;
+        }
+        void Clear()
+        {
+            entryPool.clear();
+            memberPool.clear();
+            this->ReleaseArena();
+            liveEntries = 0;
+        }
+};
+
+/* Chooses per timer between direct toolbar entries and BlockGroup entries.
+   Switching and updating F targets directly puts F*(2+u) entries on the
+   timer, u being 1 for an updater target and 2 for a timer pair target;
+   through groups it is one entry per group used (at most three) but as many
+   more groups in the grid. Direct entries are used while they fit the
+   toolbar next to the entries already there and cost no more than the
+   groups would. CircuitCubegridManager applies it to every timer pair once
+   all of the pair's connections are known. */
+struct ToolbarStrategy
+{
+    unsigned slotsPerPage = 9;
+    unsigned pages = 9;
+    double entryCost = 1.0;
+    double groupCost = 1.0;
+
+    static const ToolbarStrategy& Default()
+    {
+        static const ToolbarStrategy strategy;
+        return strategy;
+    }
+
+    /* `direct` entries or `groups` group entries, next to `existing` */
+    bool UseGroups(unsigned direct, unsigned groups, unsigned existing) const
+    {
+        if (existing + direct > slotsPerPage * pages)
+            return true;
+        return direct * entryCost > groups * (entryCost + groupCost);
+    }
+    /* An AND/OR updater triggers both timers of every input */
+    constexpr unsigned MaxGateInputs() const
+    {
+        return slotsPerPage * pages / 2;
+    }
+    /* An output timer switches both timers of every reader and triggers
+       its updater */
+    constexpr unsigned MaxFanout() const
+    {
+        return slotsPerPage * pages / 3;
+    }
+};
+
+#endif // H_TOOLBARLOG
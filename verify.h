@@ -0,0 +1,63 @@
+#ifndef H_VERIFY
+#define H_VERIFY
+
+#include <cstdint>
+#include "gates.h"
+#include "bitslice.h"
+#include "optimize.h"
+
+/* Exhaustively checks a decoder netlist whose primary input k drives
+   address bit k, the last one enable, and whose declared outputs are the
+   decoder outputs in order. Returns the first failing input vector or
+   UINT64_MAX. */
+template <typename Word = uint64_t>
+uint64_t VerifyConnectedDecoder(const Netlist& netlist, unsigned input_count, unsigned output_count)
+{
+    if (netlist.Inputs().size() != input_count + 1 || netlist.Outputs().size() != output_count)
+        throw std::logic_error("Netlist does not have the decoder's inputs and outputs");
+    return VerifyExhaustive<Word>(netlist, [input_count, output_count](const Word* inputs, Word* expected)
+    {
+        for (unsigned j = 0; j < output_count; j++)
+        {
+            Word match = inputs[input_count];
+            for (unsigned i = 0; i < input_count; i++)
+                match = match & (((j >> i) & 1) ? inputs[i] : ~inputs[i]);
+            expected[j] = match;
+        }
+    });
+}
+
+/* VerifyConnectedDecoder for a netlist whose inputs and enable are still
+   the open pins in `model` */
+template <typename Word = uint64_t, typename Model>
+uint64_t VerifyDecoderNetlist(Netlist netlist, const Model& model, unsigned input_count, unsigned output_count)
+{
+    for (unsigned i = 0; i < input_count; i++)
+        netlist.Connect(netlist.AddInput(), model.inputs[i]);
+    netlist.Connect(netlist.AddInput(), model.enable);
+    return VerifyConnectedDecoder<Word>(netlist, input_count, output_count);
+}
+
+/* The netlist a constructed decoder was lowered from, so whatever its
+   constructor wired is what gets checked */
+template <typename Word = uint64_t> uint64_t VerifyDecoder(const RuntimeDecoder& decoder)
+{
+    return VerifyDecoderNetlist<Word>(decoder.GetNetlist(), decoder.GetModel(), decoder.InputCount(), decoder.OutputCount());
+}
+template <typename Word = uint64_t, unsigned input_count, unsigned output_count>
+uint64_t VerifyDecoder(const Decoder<input_count, output_count>& decoder)
+{
+    return VerifyDecoderNetlist<Word>(decoder.GetNetlist(), decoder.GetModel(), input_count, output_count);
+}
+
+/* Decoder<input_count, output_count> from the netlist its constructor
+   lowers with `options`, without building any blocks */
+template <unsigned input_count, unsigned output_count, typename Word = uint64_t>
+uint64_t VerifyDecoder(const DecoderOptions& options = DecoderOptions())
+{
+    RuntimeDecoder::Model model;
+    return VerifyDecoderNetlist<Word>(RuntimeDecoder::BuildNetlist(input_count, output_count, "", model, options),
+                                      model, input_count, output_count);
+}
+
+#endif // H_VERIFY